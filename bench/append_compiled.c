@@ -0,0 +1,50 @@
+// Compares string_builder_append_compiled() with string_builder_append_format()
+// on a typical log line.
+//
+// cc -O2 -o append_compiled bench/append_compiled.c && ./append_compiled
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+#define ITERATIONS 5000000
+#define LOG_LINE "%s [%-5s] request %llu from %s took %u us, status %d\n"
+
+double now_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main() {
+    StringBuilder b = string_builder_new_with_capacity(1 << 20);
+    StringBuilder *builder = &b;
+    StringBuilderFormat format = string_builder_format_compile(LOG_LINE);
+
+    double start = now_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (builder->length > (1 << 19)) {
+            builder->length = 0;
+        }
+        string_builder_append_compiled(builder, &format, "2023-06-01T12:00:00Z", "INFO", (unsigned long long)i, "10.0.0.1", (unsigned)i % 5000, 200);
+    }
+    double compiled_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (builder->length > (1 << 19)) {
+            builder->length = 0;
+        }
+        string_builder_append_format(builder, LOG_LINE, "2023-06-01T12:00:00Z", "INFO", (unsigned long long)i, "10.0.0.1", (unsigned)i % 5000, 200);
+    }
+    double format_time = now_seconds() - start;
+
+    printf("append_compiled: %.2f ns/op\n", compiled_time * 1e9 / ITERATIONS);
+    printf("append_format:   %.2f ns/op\n", format_time * 1e9 / ITERATIONS);
+
+    string_builder_format_free(&format);
+    string_builder_free(builder);
+}
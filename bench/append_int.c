@@ -0,0 +1,56 @@
+// Compares string_builder_append_i64() with string_builder_append_format("%lld").
+//
+// cc -O2 -o append_int bench/append_int.c && ./append_int
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+#define ITERATIONS 10000000
+
+double now_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// A cheap generator that produces numbers of all lengths.
+int64_t next_value(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (int64_t)(*state >> (*state % 64));
+}
+
+int main() {
+    StringBuilder b = string_builder_new_with_capacity(1 << 20);
+    StringBuilder *builder = &b;
+    uint64_t state = 88172645463325252ull;
+
+    double start = now_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (builder->length > (1 << 19)) {
+            builder->length = 0;
+        }
+        string_builder_append_i64(builder, next_value(&state));
+    }
+    double append_i64_time = now_seconds() - start;
+
+    state = 88172645463325252ull;
+    start = now_seconds();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (builder->length > (1 << 19)) {
+            builder->length = 0;
+        }
+        string_builder_append_format(builder, "%lld", (long long)next_value(&state));
+    }
+    double append_format_time = now_seconds() - start;
+
+    printf("append_i64:             %.2f ns/op\n", append_i64_time * 1e9 / ITERATIONS);
+    printf("append_format(\"%%lld\"): %.2f ns/op\n", append_format_time * 1e9 / ITERATIONS);
+
+    string_builder_free(builder);
+}
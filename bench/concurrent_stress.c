@@ -0,0 +1,89 @@
+// Stress test for StringBuilderConcurrent, meant to run under
+// ThreadSanitizer: 16 producers append 16-byte records while a reader
+// ships what's committed. Checks that the reader never sees half of a
+// record, and that in the end every record is there, once, with the
+// records of each producer in the order it appended them.
+//
+// make -C bench stress
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+#define PRODUCER_COUNT 16
+#define RECORDS_PER_PRODUCER 20000
+#define RECORD_LENGTH 16
+
+StringBuilderConcurrent log_buffer;
+int producers_done = 0;
+
+// "pp:rrrrrrrrrrrr\n", the producer and the record number.
+void make_record(char *record, int producer, int number) {
+    snprintf(record, RECORD_LENGTH + 1, "%02d:%012d\n", producer, number);
+}
+
+void *producer(void *argument) {
+    int id = (int)(intptr_t)argument;
+    char record[RECORD_LENGTH + 1];
+    for (int i = 0; i < RECORDS_PER_PRODUCER; i++) {
+        make_record(record, id, i);
+        string_builder_concurrent_append_n(&log_buffer, record, RECORD_LENGTH);
+    }
+    __atomic_add_fetch(&producers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main() {
+    log_buffer = string_builder_concurrent_new();
+
+    pthread_t producers[PRODUCER_COUNT];
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        pthread_create(&producers[i], NULL, producer, (void *)(intptr_t)i);
+    }
+
+    StringBuilder shipped = string_builder_new();
+    size_t shipped_length = 0;
+    int failed = 0;
+    while (__atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) < PRODUCER_COUNT) {
+        shipped_length = string_builder_concurrent_read(&log_buffer, shipped_length, &shipped);
+        if (shipped_length % RECORD_LENGTH != 0) {
+            printf("The reader saw half of a record at %zu\n", shipped_length);
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    // Every record is committed once all the producers have returned.
+    shipped_length = string_builder_concurrent_read(&log_buffer, shipped_length, &shipped);
+
+    int next[PRODUCER_COUNT] = {0};
+    char expected[RECORD_LENGTH + 1];
+    for (size_t offset = 0; offset + RECORD_LENGTH <= shipped.length; offset += RECORD_LENGTH) {
+        int id = atoi(shipped.string + offset);
+        if (id < 0 || id >= PRODUCER_COUNT) {
+            printf("Garbled record at %zu\n", offset);
+            failed = 1;
+            break;
+        }
+        make_record(expected, id, next[id]++);
+        if (memcmp(shipped.string + offset, expected, RECORD_LENGTH) != 0) {
+            printf("Expected %.*s at %zu, got %.*s\n", RECORD_LENGTH - 1, expected, offset, RECORD_LENGTH - 1, shipped.string + offset);
+            failed = 1;
+            break;
+        }
+    }
+    if (shipped.length != (size_t)PRODUCER_COUNT * RECORDS_PER_PRODUCER * RECORD_LENGTH) {
+        printf("Shipped %zu bytes of %d\n", shipped.length, PRODUCER_COUNT * RECORDS_PER_PRODUCER * RECORD_LENGTH);
+        failed = 1;
+    }
+    printf("%s: %d producers, %zu records\n", failed ? "FAILED" : "ok", PRODUCER_COUNT, shipped.length / RECORD_LENGTH);
+
+    string_builder_free(&shipped);
+    string_builder_concurrent_free(&log_buffer);
+    return failed;
+}
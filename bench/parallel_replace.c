@@ -0,0 +1,73 @@
+// Shows how string_builder_count_substrings_parallel() and
+// string_builder_replace_parallel() scale with the number of threads,
+// next to the single-threaded functions.
+//
+// make -C bench parallel_replace && ./bench/parallel_replace [megabytes]
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+double now_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Log-like text where "user=" starts roughly every 60 bytes.
+StringBuilder make_text(size_t length) {
+    static const char *const words[] = {"GET", "/api/v1/items", "user=", "200", "took", "ms", "POST", "status"};
+    StringBuilder text = string_builder_new_with_capacity(length + 64);
+    uint64_t state = 88172645463325252ull;
+    while (text.length < length) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        string_builder_append(&text, words[state % (sizeof words / sizeof *words)]);
+        string_builder_append_char(&text, state % 8 == 0 ? '\n' : ' ');
+    }
+    return text;
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    StringBuilder original = make_text(megabytes << 20);
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    StringBuilder serial = string_builder_new_from(original.string);
+    double start = now_seconds();
+    int serial_count = string_builder_count_substrings(&serial, "user=");
+    double serial_count_time = now_seconds() - start;
+    start = now_seconds();
+    string_builder_replace(&serial, "user=", "account_id=");
+    double serial_replace_time = now_seconds() - start;
+
+    printf("%zu MiB, %ld online processors\n", megabytes, online);
+    printf("threads,count_ms,replace_ms,count_speedup,replace_speedup\n");
+    printf("serial,%.1f,%.1f,1.00,1.00\n", serial_count_time * 1e3, serial_replace_time * 1e3);
+
+    for (int thread_count = 1; thread_count <= 2 * online && thread_count <= STRING_BUILDER_MAX_THREADS; thread_count *= 2) {
+        StringBuilder parallel = string_builder_new_from(original.string);
+        start = now_seconds();
+        size_t count = string_builder_count_substrings_parallel(&parallel, "user=", thread_count);
+        double count_time = now_seconds() - start;
+        start = now_seconds();
+        string_builder_replace_parallel(&parallel, "user=", "account_id=", thread_count);
+        double replace_time = now_seconds() - start;
+
+        if (count != (size_t)serial_count || parallel.length != serial.length || memcmp(parallel.string, serial.string, serial.length) != 0) {
+            printf("%d threads: result differs from the serial one\n", thread_count);
+            return 1;
+        }
+        printf("%d,%.1f,%.1f,%.2f,%.2f\n", thread_count, count_time * 1e3, replace_time * 1e3,
+               serial_count_time / count_time, serial_replace_time / replace_time);
+        string_builder_free(&parallel);
+    }
+
+    string_builder_free(&serial);
+    string_builder_free(&original);
+}
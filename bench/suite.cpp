@@ -0,0 +1,728 @@
+// Runs realistic workloads on the string builder and on the usual
+// alternatives: std::string, std::ostringstream, open_memstream and raw
+// snprintf into a fixed buffer.
+//
+// Prints one CSV row per workload and implementation, with the time,
+// the allocated bytes and the number of allocations per operation. An
+// operation is one whole document: a log of 200 lines, 1 MiB of replaced
+// text and so on. Run it on two versions and diff the output to spot
+// regressions.
+//
+// make -C bench suite && ./bench/suite [workload...]
+
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.hpp"
+
+// Allocations are counted by wrapping glibc's malloc, so the allocations
+// made inside std::string, iostreams and the stdio of open_memstream are
+// counted the same way as the builder's.
+#ifdef __GLIBC__
+#define COUNTS_ALLOCATIONS 1
+
+static std::uint64_t allocation_count = 0;
+static std::uint64_t allocated_bytes = 0;
+
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *pointer, std::size_t size);
+void  __libc_free(void *pointer);
+
+void *malloc(std::size_t size) noexcept {
+    allocation_count++;
+    allocated_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size) noexcept {
+    allocation_count++;
+    allocated_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, std::size_t size) noexcept {
+    allocation_count++;
+    allocated_bytes += size;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) noexcept {
+    __libc_free(pointer);
+}
+}
+#else
+#define COUNTS_ALLOCATIONS 0
+
+static std::uint64_t allocation_count = 0;
+static std::uint64_t allocated_bytes = 0;
+#endif // __GLIBC__
+
+// Workload inputs, made once before measuring.
+
+static const char *const pieces[] = {"a", "bc", "def", ",", "\n", "key", "=", "value;", "0x", "\"quoted\""};
+#define PIECE_COUNT (sizeof pieces / sizeof *pieces)
+#define TINY_APPENDS 10000
+#define LOG_LINES 200
+#define FRONT_INSERTS 2000
+#define MARKERS 64
+#define DUMPED_VALUES 1000
+#define FAN_OUT_PREFIX 4096
+#define FAN_OUT_VARIANTS 100
+
+static std::vector<std::size_t> piece_lengths;
+static std::vector<StringSlice> piece_slices;
+static std::string text;
+static std::string utf8_text;
+static std::vector<std::uint64_t> values;
+static std::vector<double> doubles;
+
+static void make_inputs() {
+    for (const char *piece : pieces) {
+        piece_lengths.push_back(std::strlen(piece));
+        piece_slices.push_back(string_slice_from(piece));
+    }
+
+    static const char *const words[] = {"lorem", "ipsum", "needle", "dolor", "sit", "amet", "haystack", "consectetur", "adipiscing"};
+    std::uint64_t state = 88172645463325252ull;
+    while (text.size() < (1 << 20)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        text += words[state % (sizeof words / sizeof *words)];
+        text += state % 16 == 0 ? '\n' : ' ';
+        values.push_back(state);
+        // Full precision doubles from about 1e-5 to 1e10.
+        doubles.push_back((double)(state >> 11) / (double)(1ull << (state % 64)));
+    }
+
+    static const char *const utf8_words[] = {"caf\xc3\xa9", "na\xc3\xafve", "\xe6\x97\xa5\xe6\x9c\xac", "lorem", "ipsum", "dolor", "sit", "amet"};
+    while (utf8_text.size() < (1 << 20)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        utf8_text += utf8_words[state % (sizeof utf8_words / sizeof *utf8_words)];
+        utf8_text += ' ';
+    }
+}
+
+// Keeps the results alive so the work isn't optimized away.
+static volatile std::size_t result_sink;
+
+// A log line: "[INFO ] request 123456 took 789 us, status 200 path=/api/v1/items\n"
+static int request_id(int line) { return 100000 + line * 37; }
+static int duration(int line) { return (line * 7919) % 100000; }
+static int status(int line) { return line % 17 == 0 ? 500 : 200; }
+
+// tiny_appends
+
+static std::size_t tiny_appends_builder() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        string_builder_append(&builder, pieces[i % PIECE_COUNT]);
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t tiny_appends_builder_n() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        string_builder_append_n(&builder, pieces[i % PIECE_COUNT], piece_lengths[i % PIECE_COUNT]);
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// The pieces go in one line at a time, so memory is reserved once per line.
+static std::size_t tiny_appends_builder_many() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < TINY_APPENDS; i += PIECE_COUNT) {
+        string_builder_append_many(&builder, piece_slices.data(), PIECE_COUNT);
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t tiny_appends_string() {
+    std::string string;
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        string.append(pieces[i % PIECE_COUNT], piece_lengths[i % PIECE_COUNT]);
+    }
+    return string.size();
+}
+
+static std::size_t tiny_appends_ostringstream() {
+    std::ostringstream stream;
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        stream << pieces[i % PIECE_COUNT];
+    }
+    return stream.str().size();
+}
+
+static std::size_t tiny_appends_memstream() {
+    char *buffer;
+    std::size_t length;
+    FILE *stream = open_memstream(&buffer, &length);
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        std::fputs(pieces[i % PIECE_COUNT], stream);
+    }
+    std::fclose(stream);
+    std::free(buffer);
+    return length;
+}
+
+static std::size_t tiny_appends_snprintf() {
+    static char buffer[TINY_APPENDS * 8 + 1];
+    std::size_t length = 0;
+    for (int i = 0; i < TINY_APPENDS; i++) {
+        length += std::snprintf(buffer + length, sizeof buffer - length, "%s", pieces[i % PIECE_COUNT]);
+    }
+    return length;
+}
+
+// log_lines
+
+#define LOG_FORMAT "[%-5s] request %d took %d us, status %d path=%s\n"
+
+static std::size_t log_lines_builder() {
+    StringBuilder builder = string_builder_new();
+    for (int line = 0; line < LOG_LINES; line++) {
+        string_builder_append(&builder, "[INFO ] request ");
+        string_builder_append_int(&builder, request_id(line));
+        string_builder_append(&builder, " took ");
+        string_builder_append_int(&builder, duration(line));
+        string_builder_append(&builder, " us, status ");
+        string_builder_append_int(&builder, status(line));
+        string_builder_append(&builder, " path=/api/v1/items\n");
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t log_lines_builder_format() {
+    StringBuilder builder = string_builder_new();
+    for (int line = 0; line < LOG_LINES; line++) {
+        string_builder_append_format(&builder, LOG_FORMAT, "INFO", request_id(line), duration(line), status(line), "/api/v1/items");
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static StringBuilderFormat log_format;
+
+static std::size_t log_lines_builder_compiled() {
+    StringBuilder builder = string_builder_new();
+    for (int line = 0; line < LOG_LINES; line++) {
+        string_builder_append_compiled(&builder, &log_format, "INFO", request_id(line), duration(line), status(line), "/api/v1/items");
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+#if __cplusplus >= 202002L
+static std::size_t log_lines_sb_format() {
+    sb::Builder builder;
+    for (int line = 0; line < LOG_LINES; line++) {
+        sb::format<LOG_FORMAT>(builder, "INFO", request_id(line), duration(line), status(line), "/api/v1/items");
+    }
+    return builder.size();
+}
+#endif // __cplusplus >= 202002L
+
+static std::size_t log_lines_string() {
+    std::string string;
+    for (int line = 0; line < LOG_LINES; line++) {
+        string += "[INFO ] request ";
+        string += std::to_string(request_id(line));
+        string += " took ";
+        string += std::to_string(duration(line));
+        string += " us, status ";
+        string += std::to_string(status(line));
+        string += " path=/api/v1/items\n";
+    }
+    return string.size();
+}
+
+static std::size_t log_lines_ostringstream() {
+    std::ostringstream stream;
+    for (int line = 0; line < LOG_LINES; line++) {
+        stream << "[INFO ] request " << request_id(line) << " took " << duration(line)
+               << " us, status " << status(line) << " path=/api/v1/items\n";
+    }
+    return stream.str().size();
+}
+
+static std::size_t log_lines_memstream() {
+    char *buffer;
+    std::size_t length;
+    FILE *stream = open_memstream(&buffer, &length);
+    for (int line = 0; line < LOG_LINES; line++) {
+        std::fprintf(stream, LOG_FORMAT, "INFO", request_id(line), duration(line), status(line), "/api/v1/items");
+    }
+    std::fclose(stream);
+    std::free(buffer);
+    return length;
+}
+
+static std::size_t log_lines_snprintf() {
+    static char buffer[LOG_LINES * 128];
+    std::size_t length = 0;
+    for (int line = 0; line < LOG_LINES; line++) {
+        length += std::snprintf(buffer + length, sizeof buffer - length, LOG_FORMAT, "INFO", request_id(line), duration(line), status(line), "/api/v1/items");
+    }
+    return length;
+}
+
+// replace_shrink and replace_grow, on 1 MiB of text
+
+static std::string replace_all(const std::string &string, std::string_view from, std::string_view to) {
+    std::string result;
+    result.reserve(string.size());
+    std::size_t start = 0;
+    std::size_t match;
+    while ((match = string.find(from, start)) != std::string::npos) {
+        result.append(string, start, match - start);
+        result += to;
+        start = match + from.size();
+    }
+    result.append(string, start, std::string::npos);
+    return result;
+}
+
+static std::size_t replace_shrink_builder() {
+    StringBuilder builder = string_builder_new_from(text.c_str());
+    string_builder_replace(&builder, "needle", "pin");
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t replace_shrink_string() {
+    return replace_all(text, "needle", "pin").size();
+}
+
+static std::size_t replace_grow_builder() {
+    StringBuilder builder = string_builder_new_from(text.c_str());
+    string_builder_replace(&builder, "sit", "sitting");
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t replace_grow_string() {
+    return replace_all(text, "sit", "sitting").size();
+}
+
+// front_insert
+
+static std::size_t front_insert_builder() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < FRONT_INSERTS; i++) {
+        string_builder_insert(&builder, 0, "word ");
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t front_insert_rope() {
+    StringRope rope = string_rope_new();
+    for (int i = 0; i < FRONT_INSERTS; i++) {
+        string_rope_insert(&rope, 0, "word ");
+    }
+    std::size_t length = rope.length;
+    string_rope_free(&rope);
+    return length;
+}
+
+static std::size_t front_insert_string() {
+    std::string string;
+    for (int i = 0; i < FRONT_INSERTS; i++) {
+        string.insert(0, "word ");
+    }
+    return string.size();
+}
+
+// markers: 64 markers spread over 1 MiB of text
+
+// Going from the last one, the indices don't shift.
+static std::size_t markers_builder_insert() {
+    StringBuilder builder = string_builder_new_from(text.c_str());
+    for (int i = MARKERS - 1; i >= 0; i--) {
+        string_builder_insert(&builder, i * (text.size() / MARKERS), "<mark>");
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t markers_builder_insert_many() {
+    StringBuilder builder = string_builder_new_from(text.c_str());
+    StringBuilderInsertion insertions[MARKERS];
+    for (int i = 0; i < MARKERS; i++) {
+        insertions[i].index = i * (text.size() / MARKERS);
+        insertions[i].string = "<mark>";
+    }
+    string_builder_insert_many(&builder, insertions, MARKERS);
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// bits_dump
+
+static std::size_t bits_dump_builder() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        string_builder_append_bits(&builder, (std::int64_t)values[i], 64);
+        string_builder_append_char(&builder, '\n');
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t bits_dump_builder_bytes() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_bits_bytes(&builder, values.data(), DUMPED_VALUES * sizeof(std::uint64_t));
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t bits_dump_string() {
+    std::string string;
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        string += std::bitset<64>(values[i]).to_string();
+        string += '\n';
+    }
+    return string.size();
+}
+
+// printf has no binary conversion, so this is the hand-written loop
+// it would otherwise be.
+static std::size_t bits_dump_loop() {
+    static char buffer[DUMPED_VALUES * 65];
+    std::size_t length = 0;
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        for (int bit = 63; bit >= 0; bit--) {
+            buffer[length++] = (values[i] >> bit) & 1 ? '1' : '0';
+        }
+        buffer[length++] = '\n';
+    }
+    // Reading the buffer keeps the loop from being optimized away.
+    return length + (buffer[result_sink % length] == '1');
+}
+
+// doubles_dump: the shortest round trip digits against printf's 6 and 17 digits
+
+static std::size_t doubles_dump_builder() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        string_builder_append_double(&builder, doubles[i]);
+        string_builder_append_char(&builder, '\n');
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t doubles_dump_builder_format() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        string_builder_append_format(&builder, "%g\n", doubles[i]);
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// The shortest printf precision that always round trips.
+static std::size_t doubles_dump_builder_format_17() {
+    StringBuilder builder = string_builder_new();
+    for (int i = 0; i < DUMPED_VALUES; i++) {
+        string_builder_append_format(&builder, "%.17g\n", doubles[i]);
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// json_escape: 1 MiB of mostly clean text with a newline to escape
+// every few dozen words.
+
+static std::size_t json_escape_builder() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_json_escaped(&builder, text.data(), text.size());
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// What escaping looks like without a bulk appender.
+static std::size_t json_escape_builder_chars() {
+    StringBuilder builder = string_builder_new();
+    for (char c : text) {
+        if (c == '\n') {
+            string_builder_append_char(&builder, '\\');
+            string_builder_append_char(&builder, 'n');
+        } else if (c == '"' || c == '\\') {
+            string_builder_append_char(&builder, '\\');
+            string_builder_append_char(&builder, c);
+        } else {
+            string_builder_append_char(&builder, c);
+        }
+    }
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t json_escape_string() {
+    std::string string;
+    for (char c : text) {
+        if (c == '\n') {
+            string += "\\n";
+        } else if (c == '"' || c == '\\') {
+            string += '\\';
+            string += c;
+        } else {
+            string += c;
+        }
+    }
+    return string.size();
+}
+
+// The memcpy() speed that the escaping appender should come close to.
+static std::size_t json_escape_memcpy() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_n(&builder, text.data(), text.size());
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+// find_all: every match of a short and a long pattern in 1 MiB of text
+
+#define LONG_PATTERN "haystack consectetur adipiscing"
+
+static std::size_t find_all_builder(const char *pattern) {
+    static StringBuilder builder = string_builder_new_from(text.c_str());
+    StringBuilderSearcher searcher = string_builder_searcher_new(pattern);
+    return string_builder_find_all(&builder, &searcher, NULL, 0);
+}
+
+static std::size_t find_all_string(const char *pattern) {
+    std::size_t length = std::strlen(pattern);
+    std::size_t count = 0;
+    for (std::size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + length)) {
+        count++;
+    }
+    return count;
+}
+
+static std::size_t find_all_short_builder() { return find_all_builder("needle"); }
+static std::size_t find_all_short_string() { return find_all_string("needle"); }
+static std::size_t find_all_long_builder() { return find_all_builder(LONG_PATTERN); }
+static std::size_t find_all_long_string() { return find_all_string(LONG_PATTERN); }
+
+// utf8_validate: 1 MiB of text where about every third word isn't ASCII
+
+static std::size_t utf8_validate_builder() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_utf8_validated(&builder, utf8_text.data(), utf8_text.size(), STRING_BUILDER_UTF8_REJECT);
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t utf8_validate_memcpy() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_n(&builder, utf8_text.data(), utf8_text.size());
+    std::size_t length = builder.length;
+    string_builder_free(&builder);
+    return length;
+}
+
+static std::size_t utf8_validate_codepoint_count() {
+    StringBuilder builder = string_builder_new();
+    string_builder_append_n(&builder, utf8_text.data(), utf8_text.size());
+    std::size_t count = string_builder_codepoint_count(&builder);
+    string_builder_free(&builder);
+    return count;
+}
+
+// fan_out: variants of a 4 KiB prefix that differ in a short tail
+
+static std::size_t fan_out_builder_copy() {
+    StringBuilder prefix = string_builder_new();
+    string_builder_append_n(&prefix, text.data(), FAN_OUT_PREFIX);
+    std::size_t length = 0;
+    for (int i = 0; i < FAN_OUT_VARIANTS; i++) {
+        StringBuilder variant = string_builder_new_from(prefix.string);
+        string_builder_append(&variant, "\nvariant=");
+        string_builder_append_int(&variant, i);
+        length += variant.length;
+        string_builder_free(&variant);
+    }
+    string_builder_free(&prefix);
+    return length;
+}
+
+static std::size_t fan_out_builder_snapshot() {
+    StringBuilder prefix = string_builder_new();
+    string_builder_append_n(&prefix, text.data(), FAN_OUT_PREFIX);
+    std::size_t length = 0;
+    for (int i = 0; i < FAN_OUT_VARIANTS; i++) {
+        StringBuilder variant = string_builder_snapshot(&prefix);
+        string_builder_append(&variant, "\nvariant=");
+        string_builder_append_int(&variant, i);
+        length += variant.length;
+        string_builder_free(&variant);
+    }
+    string_builder_free(&prefix);
+    return length;
+}
+
+static std::size_t fan_out_string() {
+    std::string prefix(text.data(), FAN_OUT_PREFIX);
+    std::size_t length = 0;
+    for (int i = 0; i < FAN_OUT_VARIANTS; i++) {
+        std::string variant = prefix;
+        variant += "\nvariant=";
+        variant += std::to_string(i);
+        length += variant.size();
+    }
+    return length;
+}
+
+struct Case {
+    const char *workload;
+    const char *implementation;
+    std::size_t (*run)();
+};
+
+static const Case cases[] = {
+    {"tiny_appends", "string_builder_append", tiny_appends_builder},
+    {"tiny_appends", "string_builder_append_n", tiny_appends_builder_n},
+    {"tiny_appends", "string_builder_append_many", tiny_appends_builder_many},
+    {"tiny_appends", "std::string", tiny_appends_string},
+    {"tiny_appends", "std::ostringstream", tiny_appends_ostringstream},
+    {"tiny_appends", "open_memstream", tiny_appends_memstream},
+    {"tiny_appends", "snprintf", tiny_appends_snprintf},
+
+    {"log_lines", "string_builder_append_int", log_lines_builder},
+    {"log_lines", "string_builder_append_format", log_lines_builder_format},
+    {"log_lines", "string_builder_append_compiled", log_lines_builder_compiled},
+#if __cplusplus >= 202002L
+    {"log_lines", "sb::format", log_lines_sb_format},
+#endif // __cplusplus >= 202002L
+    {"log_lines", "std::string", log_lines_string},
+    {"log_lines", "std::ostringstream", log_lines_ostringstream},
+    {"log_lines", "open_memstream", log_lines_memstream},
+    {"log_lines", "snprintf", log_lines_snprintf},
+
+    {"replace_shrink", "string_builder_replace", replace_shrink_builder},
+    {"replace_shrink", "std::string", replace_shrink_string},
+    {"replace_grow", "string_builder_replace", replace_grow_builder},
+    {"replace_grow", "std::string", replace_grow_string},
+
+    {"front_insert", "string_builder_insert", front_insert_builder},
+    {"front_insert", "string_rope_insert", front_insert_rope},
+    {"front_insert", "std::string", front_insert_string},
+
+    {"markers", "string_builder_insert", markers_builder_insert},
+    {"markers", "string_builder_insert_many", markers_builder_insert_many},
+
+    {"bits_dump", "string_builder_append_bits", bits_dump_builder},
+    {"bits_dump", "string_builder_append_bits_bytes", bits_dump_builder_bytes},
+    {"bits_dump", "std::bitset", bits_dump_string},
+    {"bits_dump", "loop", bits_dump_loop},
+
+    {"doubles_dump", "string_builder_append_double", doubles_dump_builder},
+    {"doubles_dump", "string_builder_append_format %g", doubles_dump_builder_format},
+    {"doubles_dump", "string_builder_append_format %.17g", doubles_dump_builder_format_17},
+
+    {"json_escape", "string_builder_append_json_escaped", json_escape_builder},
+    {"json_escape", "string_builder_append_char", json_escape_builder_chars},
+    {"json_escape", "std::string", json_escape_string},
+    {"json_escape", "string_builder_append_n (no escaping)", json_escape_memcpy},
+
+    {"find_all_short", "string_builder_find_all", find_all_short_builder},
+    {"find_all_short", "std::string::find", find_all_short_string},
+    {"find_all_long", "string_builder_find_all", find_all_long_builder},
+    {"find_all_long", "std::string::find", find_all_long_string},
+
+    {"utf8_validate", "string_builder_append_utf8_validated", utf8_validate_builder},
+    {"utf8_validate", "string_builder_append_n (no validation)", utf8_validate_memcpy},
+    {"utf8_validate", "string_builder_codepoint_count", utf8_validate_codepoint_count},
+
+    {"fan_out", "string_builder_new_from", fan_out_builder_copy},
+    {"fan_out", "string_builder_snapshot", fan_out_builder_snapshot},
+    {"fan_out", "std::string", fan_out_string},
+};
+
+#define MIN_SECONDS 0.2
+
+static void measure(const Case &test) {
+    using Clock = std::chrono::steady_clock;
+
+    // Double the number of operations until a batch runs long enough.
+    for (std::uint64_t operations = 1;; operations *= 2) {
+        std::uint64_t start_count = allocation_count;
+        std::uint64_t start_bytes = allocated_bytes;
+        Clock::time_point start = Clock::now();
+        for (std::uint64_t i = 0; i < operations; i++) {
+            result_sink = test.run();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::uint64_t count = allocation_count - start_count;
+        std::uint64_t bytes = allocated_bytes - start_bytes;
+
+        if (seconds >= MIN_SECONDS) {
+            if (COUNTS_ALLOCATIONS) {
+                std::printf("%s,%s,%.1f,%.1f,%.2f\n", test.workload, test.implementation,
+                            seconds * 1e9 / operations, (double)bytes / operations, (double)count / operations);
+            } else {
+                std::printf("%s,%s,%.1f,,\n", test.workload, test.implementation, seconds * 1e9 / operations);
+            }
+            std::fflush(stdout);
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    make_inputs();
+    log_format = string_builder_format_compile(LOG_FORMAT);
+
+    std::printf("workload,implementation,ns_per_op,bytes_per_op,allocations_per_op\n");
+    for (const Case &test : cases) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++) {
+            selected = selected || std::strcmp(argv[i], test.workload) == 0;
+        }
+        if (selected) {
+            measure(test);
+        }
+    }
+
+    string_builder_format_free(&log_format);
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    StringBuilderArena *arena = string_builder_arena_new(4096);
+
+    for (int request = 0; request < 3; request++) {
+        StringBuilder b = string_builder_new_with_allocator(&arena->allocator);
+        StringBuilder *builder = &b;
+
+        string_builder_append(builder, "Response #");
+        string_builder_append_int(builder, request);
+
+        printf("%s\n", builder->string); // Response #0, Response #1, Response #2
+
+        // No need to free the builder: all of its memory goes back at once.
+        string_builder_arena_reset(arena);
+    }
+
+    string_builder_arena_free(arena);
+}
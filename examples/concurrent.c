@@ -0,0 +1,63 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+#define WORKER_COUNT 4
+#define RECORDS_PER_WORKER 10000
+
+StringBuilderConcurrent log_buffer;
+
+void *worker(void *argument) {
+    int id = (int)(intptr_t)argument;
+
+    // Each record is built privately, then appended in one piece.
+    char buffer[64];
+    StringBuilder record = string_builder_new_from_buffer(buffer, sizeof buffer);
+    for (int i = 0; i < RECORDS_PER_WORKER; i++) {
+        record.length = 0;
+        string_builder_append(&record, "worker ");
+        string_builder_append_int(&record, id);
+        string_builder_append(&record, ": request ");
+        string_builder_append_int(&record, i);
+        string_builder_append_char(&record, '\n');
+        string_builder_concurrent_append_n(&log_buffer, record.string, record.length);
+    }
+    string_builder_free(&record);
+    return NULL;
+}
+
+int main() {
+    log_buffer = string_builder_concurrent_new();
+
+    pthread_t workers[WORKER_COUNT];
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        pthread_create(&workers[i], NULL, worker, (void *)(intptr_t)i);
+    }
+
+    // Ships what's committed while the workers are still appending,
+    // until every record has arrived.
+    StringBuilder shipped = string_builder_new();
+    size_t shipped_length = 0;
+    size_t record_count = 0;
+    while (record_count < WORKER_COUNT * RECORDS_PER_WORKER) {
+        size_t old_length = shipped_length;
+        shipped_length = string_builder_concurrent_read(&log_buffer, shipped_length, &shipped);
+        for (size_t i = old_length; i < shipped_length; i++) {
+            record_count += shipped.string[i] == '\n';
+        }
+        if (shipped.length > 0 && shipped.string[shipped.length - 1] != '\n') {
+            printf("Shipped half of a record!\n");
+        }
+    }
+    printf("Shipped %zu records\n", record_count); // Shipped 40000 records
+
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    string_builder_free(&shipped);
+    string_builder_concurrent_free(&log_buffer);
+}
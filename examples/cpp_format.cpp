@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <cstdint>
+#include <string>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.hpp"
+
+// Needs C++20: g++ -std=c++20 cpp_format.cpp
+int main() {
+    sb::Builder builder;
+    std::string user = "alice";
+
+    for (unsigned id = 1; id <= 3; id++) {
+        sb::format<"[%-5s] user=%s id=%04u\n">(builder, "INFO", user, id);
+    }
+    sb::format<"%s took %zu ms, delta %d, mask 0x%08X, 100%%\n">(builder, "request", sizeof(int64_t), -42, 0xbeefu);
+
+    std::printf("%s", builder.c_str());
+
+    // sb::format<"%d">(builder, "text");       // Error: %d expects an integer
+    // sb::format<"%d">(builder, int64_t(1));   // Error: add a length modifier
+    // sb::format<"%s %s">(builder, "one");     // Error: the number of arguments doesn't match
+}
+
+// OUTPUT:
+// [INFO ] user=alice id=0001
+// [INFO ] user=alice id=0002
+// [INFO ] user=alice id=0003
+// request took 8 ms, delta -42, mask 0x0000BEEF, 100%
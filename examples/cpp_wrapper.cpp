@@ -0,0 +1,29 @@
+#include <cstdio>
+#include <string_view>
+#include <utility>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.hpp"
+
+sb::Builder make_greeting(std::string_view name) {
+    sb::Builder builder;
+    builder << "Hello, " << name << "! You are visitor #" << 1024u << '.';
+    return builder; // Moved out, the string isn't copied.
+}
+
+int main() {
+    sb::Builder greeting = make_greeting("World");
+    std::printf("%s\n", greeting.c_str()); // Hello, World! You are visitor #1024.
+
+    sb::Builder stats;
+    stats << "ratio=" << 0.1 << ", delta=" << -7 << ", ok=" << true;
+    std::string_view view = stats;
+    std::printf("%.*s\n", (int)view.size(), view.data()); // ratio=0.1, delta=-7, ok=true
+
+    sb::Builder moved = std::move(stats);
+    std::printf("%zu %zu\n", stats.size(), moved.size()); // 0 28
+
+    char *owned = moved.release();
+    std::printf("%s\n", owned); // ratio=0.1, delta=-7, ok=true
+    STRING_BUILDER_FREE(owned);
+} // `greeting` is freed here.
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    StringBuilder b = string_builder_new();
+    StringBuilder *builder = &b;
+
+    string_builder_append_double(builder, 0.1 + 0.2);
+    string_builder_append_char(builder, ' ');
+    string_builder_append_float(builder, 0.1f + 0.2f);
+    string_builder_append_char(builder, ' ');
+    string_builder_append_double(builder, 6.02214076e23);
+    string_builder_append_char(builder, ' ');
+    string_builder_append_double_fixed(builder, 3.14159, 2);
+
+    printf("%s\n", builder->string); // 0.30000000000000004 0.3 6.02214076e+23 3.14
+
+    string_builder_free(builder);
+}
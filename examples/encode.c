@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    const unsigned char frame[] = { 0x81, 0x05, 'h', 'e', 'l', 'l', 'o' };
+
+    StringBuilder b = string_builder_new();
+    StringBuilder *builder = &b;
+
+    string_builder_append(builder, "hex: ");
+    string_builder_append_hex(builder, frame, sizeof frame);
+    string_builder_append(builder, "\nbase64: ");
+    string_builder_append_base64(builder, frame, sizeof frame);
+    string_builder_append(builder, "\nbits: ");
+    string_builder_append_bits_bytes(builder, frame, 2);
+
+    printf("%s\n", builder->string);
+    // hex: 810568656c6c6f
+    // base64: gQVoZWxsbw==
+    // bits: 1000000100000101
+
+    string_builder_free(builder);
+}
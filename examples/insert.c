@@ -12,4 +12,6 @@ int main() {
     string_builder_insert(builder, 5, ", ");
 
     printf("%s\n", builder->string); // Hello, World?
+
+    string_builder_free(builder);
 }
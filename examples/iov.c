@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+static const char headers[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Server: example\r\n"
+    "Content-Type: text/plain; charset=utf-8\r\n";
+
+int main() {
+    const char *body = "A response body that was produced somewhere else and is only referenced here.\n";
+    size_t body_length = strlen(body);
+
+    StringBuilderIov iov = string_builder_iov_new();
+
+    // The headers and the body are never copied.
+    string_builder_iov_append_ref(&iov, headers, sizeof headers - 1);
+    string_builder_iov_append(&iov, "Content-Length: ");
+    string_builder_iov_append_int(&iov, (int)body_length);
+    string_builder_iov_append(&iov, "\r\n\r\n");
+    string_builder_iov_append_ref(&iov, body, body_length);
+
+    printf("%zu segments, %zu bytes\n", iov.segment_count, iov.length); // 3 segments, 175 bytes
+    fflush(stdout);
+    string_builder_iov_write(&iov, STDOUT_FILENO);
+
+    string_builder_iov_free(&iov);
+}
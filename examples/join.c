@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    StringBuilder builder = string_builder_new();
+
+    const char *path = "/index.html";
+    StringSlice request_line[] = {
+        STRING_SLICE("GET "),
+        string_slice_from(path),
+        STRING_SLICE(" HTTP/1.1\n"),
+    };
+    string_builder_append_many(&builder, request_line, 3);
+
+    string_builder_append_strings(&builder, "Host", ": ", "example.com", "\n", NULL);
+
+    StringSlice encodings[] = { STRING_SLICE("gzip"), STRING_SLICE("deflate"), STRING_SLICE("br") };
+    string_builder_append(&builder, "Accept-Encoding: ");
+    string_builder_join(&builder, encodings, 3, ", ");
+
+    // GET /index.html HTTP/1.1
+    // Host: example.com
+    // Accept-Encoding: gzip, deflate, br
+    printf("%s\n", builder.string);
+
+    string_builder_free(&builder);
+}
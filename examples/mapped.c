@@ -0,0 +1,33 @@
+// The mapped builder needs the POSIX declarations that strict ISO C modes hide.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    // The report is built in the page cache of report.csv, not on the heap.
+    StringBuilder b = string_builder_new_mapped("report.csv");
+    StringBuilder *builder = &b;
+    if (builder->string == NULL) {
+        fprintf(stderr, "Failed to map report.csv\n");
+        return 1;
+    }
+
+    string_builder_append(builder, "id;value\r\n");
+    for (int i = 0; i < 1000000; i++) {
+        string_builder_append_int(builder, i);
+        string_builder_append_char(builder, ';');
+        string_builder_append_u64_hex(builder, (uint64_t)i * 2654435761u);
+        string_builder_append(builder, "\r\n");
+    }
+    string_builder_replace(builder, "\r\n", "\n");
+
+    size_t length = builder->length;
+    if (string_builder_mapped_finish(builder) != 0) {
+        fprintf(stderr, "Failed to write report.csv\n");
+        return 1;
+    }
+    printf("Wrote %zu bytes\n", length); // Wrote 20775781 bytes
+}
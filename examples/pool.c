@@ -0,0 +1,48 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+#define WORKER_COUNT 4
+#define REQUESTS_PER_WORKER 10000
+
+StringBuilderPool *pool;
+
+void *worker(void *argument) {
+    int id = (int)(intptr_t)argument;
+    size_t sent = 0;
+
+    for (int request = 0; request < REQUESTS_PER_WORKER; request++) {
+        // Comes with the capacity an earlier response of this thread grew to.
+        StringBuilder response = string_builder_pool_acquire(pool);
+        string_builder_append(&response, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+        for (int line = 0; line < request % 50; line++) {
+            string_builder_append(&response, "worker ");
+            string_builder_append_int(&response, id);
+            string_builder_append(&response, " says hello\n");
+        }
+        sent += response.length;
+        string_builder_pool_release(pool, &response);
+    }
+
+    return (void *)sent;
+}
+
+int main() {
+    pool = string_builder_pool_new(256, 64 * 1024, 4);
+
+    pthread_t workers[WORKER_COUNT];
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        pthread_create(&workers[i], NULL, worker, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    StringBuilderPoolStats stats = string_builder_pool_stats(pool);
+    printf("%llu hits, %llu misses\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses); // 39996 hits, 4 misses
+
+    string_builder_pool_free(pool);
+}
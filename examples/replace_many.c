@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    StringBuilderReplacement pairs[] = {
+        { "&", "&amp;" },
+        { "<", "&lt;" },
+        { ">", "&gt;" },
+    };
+    StringBuilderAutomaton automaton = string_builder_automaton_new(pairs, 3);
+
+    StringBuilder b = string_builder_new_from("<b>Fish & Chips</b>");
+    StringBuilder *builder = &b;
+
+    string_builder_replace_many(builder, &automaton);
+    printf("'%s'\n", builder->string); // '&lt;b&gt;Fish &amp; Chips&lt;/b&gt;'
+
+    string_builder_free(builder);
+    string_builder_automaton_free(&automaton);
+}
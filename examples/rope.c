@@ -0,0 +1,28 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    StringRope rope = string_rope_new();
+
+    for (int section = 3; section >= 1; section--) {
+        string_rope_insert(&rope, 0, "\n");
+        string_rope_insert(&rope, 0, "Section ");
+        string_rope_insert(&rope, 8, section == 1 ? "1" : section == 2 ? "2" : "3");
+    }
+    string_rope_insert(&rope, 0, "Contents:\n");
+    string_rope_replace_range(&rope, 0, 8, "Index");
+
+    StringBuilder b = string_rope_flatten(&rope);
+    StringBuilder *builder = &b;
+
+    printf("%s", builder->string);
+    // Index:
+    // Section 1
+    // Section 2
+    // Section 3
+
+    string_builder_free(builder);
+    string_rope_free(&rope);
+}
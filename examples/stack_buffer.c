@@ -0,0 +1,19 @@
+#include <stdio.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    char buffer[32];
+    StringBuilder b = string_builder_new_from_buffer(buffer, sizeof buffer);
+    StringBuilder *builder = &b;
+
+    string_builder_append(builder, "user:");
+    string_builder_append_int(builder, 1024);
+    printf("%s (on the stack: %d)\n", builder->string, builder->string == buffer); // user:1024 (on the stack: 1)
+
+    string_builder_append(builder, ":sessions:active:expires-at");
+    printf("%s (on the stack: %d)\n", builder->string, builder->string == buffer); // ... (on the stack: 0)
+
+    string_builder_free(builder);
+}
@@ -0,0 +1,32 @@
+#include <inttypes.h>
+#include <stdio.h>
+
+#define STRING_BUILDER_STATS
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+// Stands in for a metrics system: prints the counters of every builder
+// when it is freed.
+void report(const StringBuilder *builder, void *context) {
+    const char *name = (const char *)context;
+    printf("%s: %" PRIu64 " allocations, %" PRIu64 " reallocations, %" PRIu64 " bytes moved, peak capacity %" PRIu64 "\n",
+           name, builder->stats.allocations, builder->stats.reallocations, builder->stats.bytes_moved, builder->stats.peak_capacity);
+}
+
+int main() {
+    string_builder_stats_set_callback(report, "builder");
+
+    StringBuilder b = string_builder_new();
+    StringBuilder *builder = &b;
+
+    for (int i = 0; i < 1000; i++) {
+        string_builder_append_format(builder, "line %d\n", i);
+    }
+    string_builder_insert(builder, 0, "header\n");
+    string_builder_replace(builder, "line", "row");
+
+    string_builder_free(builder); // builder: 1 allocations, 10 reallocations, 13788 bytes moved, peak capacity 16384
+
+    StringBuilderStats stats = string_builder_stats_global();
+    printf("process: %" PRIu64 " growths, %" PRIu64 " replace passes\n", stats.growths, stats.replace_passes); // process: 10 growths, 2 replace passes
+}
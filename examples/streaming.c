@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#define STRING_BUILDER_IMPLEMENTATION
+#include "../string_builder.h"
+
+int main() {
+    // Never keeps more than 4 KiB of the CSV in memory.
+    StringBuilder b = string_builder_new_streaming(STDOUT_FILENO, 4096);
+    StringBuilder *builder = &b;
+
+    string_builder_append(builder, "id,square,hex\n");
+    for (int i = 0; i < 100000; i++) {
+        string_builder_append_int(builder, i);
+        string_builder_append_char(builder, ',');
+        string_builder_append_u64(builder, (uint64_t)i * i);
+        string_builder_append_char(builder, ',');
+        string_builder_append_u64_hex(builder, i);
+        string_builder_append_char(builder, '\n');
+    }
+
+    if (string_builder_flush(builder) != 0) {
+        fprintf(stderr, "Failed to write the CSV\n");
+    }
+    fprintf(stderr, "Wrote %zu bytes\n", builder->sink->flushed_length); // Wrote 2172751 bytes
+
+    string_builder_free(builder);
+}
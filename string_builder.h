@@ -20,39 +20,471 @@
 #define STRING_BUILDER_FREE    free
 #endif // STRING_BUILDER_CUSTOM_MEMORY_MANAGEMENT
 
+#ifdef STRING_BUILDER_STATS
+#include <time.h>
+#endif // STRING_BUILDER_STATS
+
 #ifndef STRING_BUILDER_ASSERT
 #include <assert.h>
 #define STRING_BUILDER_ASSERT assert
 #endif // STRING_BUILDER_ASSERT
 
+#if !defined(STRING_BUILDER_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define STRING_BUILDER_X86_SIMD
+#define STRING_BUILDER_SIMD_SSE2  1
+#define STRING_BUILDER_SIMD_SSSE3 2
+#define STRING_BUILDER_SIMD_AVX2  3
+#endif // STRING_BUILDER_NO_SIMD
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define STRING_BUILDER_POSIX
+#ifndef STRING_BUILDER_NO_THREADS
+#include <pthread.h>
+#define STRING_BUILDER_THREADS
+#endif // STRING_BUILDER_NO_THREADS
+#ifdef IOV_MAX
+#define STRING_BUILDER_IOV_MAX IOV_MAX
+#else
+#define STRING_BUILDER_IOV_MAX 1024
+#endif // IOV_MAX
+#if defined(MAP_ANONYMOUS)
+#define STRING_BUILDER_PAGES
+#endif // MAP_ANONYMOUS
+// ftruncate() is hidden by strict ISO C modes unless POSIX is asked for.
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L) || defined(_XOPEN_SOURCE) || defined(__APPLE__)
+#define STRING_BUILDER_MAPPED
+#endif // _POSIX_C_SOURCE
+#endif // __unix__ || __APPLE__
+
 #ifndef STRING_BUILDER_RESIZE_FACTOR
 #define STRING_BUILDER_RESIZE_FACTOR 2
 #endif // STRING_BUILDER_RESIZE_FACTOR
 
+#ifndef STRING_BUILDER_PAGE_SIZE
+#define STRING_BUILDER_PAGE_SIZE 4096
+#endif // STRING_BUILDER_PAGE_SIZE
+
+#ifndef STRING_BUILDER_HUGE_PAGE_SIZE
+#define STRING_BUILDER_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif // STRING_BUILDER_HUGE_PAGE_SIZE
+
 #ifndef STRING_BUILDER_DEFAULT_CAPACITY
 #define STRING_BUILDER_DEFAULT_CAPACITY 16
 #endif // STRING_BUILDER_DEFAULT_CAPACITY
 
+#ifndef STRING_BUILDER_ARENA_ALIGNMENT
+#define STRING_BUILDER_ARENA_ALIGNMENT 16
+#endif // STRING_BUILDER_ARENA_ALIGNMENT
+
+#ifndef STRING_BUILDER_IOV_COPY_THRESHOLD
+#define STRING_BUILDER_IOV_COPY_THRESHOLD 64
+#endif // STRING_BUILDER_IOV_COPY_THRESHOLD
+
+#ifndef STRING_ROPE_CHUNK_SIZE
+#define STRING_ROPE_CHUNK_SIZE 256
+#endif // STRING_ROPE_CHUNK_SIZE
+
+// The concurrent builder and snapshots need the __atomic builtins.
+#if defined(__GNUC__) || defined(__clang__)
+#define STRING_BUILDER_CONCURRENT
+#endif // __GNUC__ || __clang__
+
+#ifndef STRING_BUILDER_CONCURRENT_SEGMENT_SIZE
+#define STRING_BUILDER_CONCURRENT_SEGMENT_SIZE 4096
+#endif // STRING_BUILDER_CONCURRENT_SEGMENT_SIZE
+
+#ifndef STRING_BUILDER_CONCURRENT_SEGMENTS
+#define STRING_BUILDER_CONCURRENT_SEGMENTS 40
+#endif // STRING_BUILDER_CONCURRENT_SEGMENTS
+
+#define STRING_BUILDER_CACHE_LINE 64
+
+#ifndef STRING_BUILDER_MAX_THREADS
+#define STRING_BUILDER_MAX_THREADS 64
+#endif // STRING_BUILDER_MAX_THREADS
+
+#ifndef STRING_BUILDER_PARALLEL_MIN_CHUNK
+#define STRING_BUILDER_PARALLEL_MIN_CHUNK (1024 * 1024)
+#endif // STRING_BUILDER_PARALLEL_MIN_CHUNK
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct {
+    void *(*allocate)(void *context, size_t size);
+    void *(*reallocate)(void *context, void *pointer, size_t old_size, size_t new_size);
+    void  (*deallocate)(void *context, void *pointer, size_t size);
+    void  *context;
+} StringBuilderAllocator;
+
+// Where a streaming builder writes its string, see string_builder_new_streaming().
+typedef struct {
+    int    fd;              // -1 when writing to `file`
+    void  *file;            // FILE *, NULL when writing to `fd`
+    size_t high_water_mark;
+    size_t flushed_length;  // Characters already written out
+    int    error;           // Nonzero once a write failed (errno for descriptors)
+} StringBuilderSink;
+
+// Returns the capacity to grow to from `capacity` so that a string of
+// `expected_length` characters and its null terminator fit.
+typedef size_t (*StringBuilderGrowthPolicy)(size_t capacity, size_t expected_length);
+
+#ifdef STRING_BUILDER_STATS
+// What a builder did with its memory, see string_builder_stats_global().
+typedef struct {
+    uint64_t allocations;         // Buffers allocated for the string
+    uint64_t reallocations;       // Buffers resized, in place or not
+    uint64_t growths;             // Times the string outgrew its buffer
+    uint64_t bytes_copied;        // Bytes of the string copied to a new buffer
+    uint64_t bytes_moved;         // Bytes shifted inside the string by inserts and replaces
+    uint64_t replace_passes;      // Scans over the string made by replaces
+    uint64_t peak_capacity;       // Largest capacity reached
+    uint64_t replace_nanoseconds; // Time spent in replaces
+    uint64_t format_nanoseconds;  // Time spent in formatted appends
+} StringBuilderStats;
+#endif // STRING_BUILDER_STATS
+
 typedef struct {
     size_t length;
     size_t capacity;
     char  *string;
+    const StringBuilderAllocator *allocator;
+    unsigned flags;
+    StringBuilderSink *sink;
+    StringBuilderGrowthPolicy growth; // NULL for string_builder_growth_geometric
+    size_t counted_length;  // Characters counted by string_builder_codepoint_count() so far
+    size_t codepoint_count; // Code points in them
+#ifdef STRING_BUILDER_STATS
+    StringBuilderStats stats;
+#endif // STRING_BUILDER_STATS
 } StringBuilder;
 
+// The string is in a buffer provided by the caller and must not be freed.
+#define STRING_BUILDER_FLAG_BORROWED 1u
+// The string is shared with snapshots and is copied before it's changed,
+// see string_builder_snapshot().
+#define STRING_BUILDER_FLAG_SHARED 2u
+
+typedef struct StringBuilderArenaBlock {
+    struct StringBuilderArenaBlock *next;
+    size_t capacity;
+} StringBuilderArenaBlock;
+
+typedef struct {
+    StringBuilderAllocator   allocator;
+    StringBuilderArenaBlock *first;
+    StringBuilderArenaBlock *current;
+    size_t                   offset;
+    char                    *last_allocation;
+    size_t                   block_size;
+} StringBuilderArena;
+
+#ifdef STRING_BUILDER_THREADS
+typedef struct {
+    uint64_t hits;     // Builders handed out from a cache
+    uint64_t misses;   // Builders allocated because the cache was empty
+    uint64_t trims;    // Builders shrunk to `max_capacity` on release
+    uint64_t discards; // Builders freed on release because the cache was full
+} StringBuilderPoolStats;
+
+// The builders one thread keeps, followed by room for `cache_size` of them.
+typedef struct StringBuilderPoolCache {
+    struct StringBuilderPoolCache *next;
+    struct StringBuilderPoolCache *previous;
+    struct StringBuilderPool      *pool;
+    size_t                         count;
+    StringBuilderPoolStats         stats; // Only written by the owning thread
+} StringBuilderPoolCache;
+
+typedef struct StringBuilderPool {
+    size_t                  initial_capacity;
+    size_t                  max_capacity;
+    size_t                  cache_size;
+    pthread_key_t           key;    // The calling thread's cache
+    pthread_mutex_t         mutex;  // Guards `caches` and `exited_stats`
+    StringBuilderPoolCache *caches;
+    StringBuilderPoolStats  exited_stats; // Counters of the threads that exited
+} StringBuilderPool;
+#endif // STRING_BUILDER_THREADS
+
+// The file behind a builder made by string_builder_new_mapped().
+typedef struct {
+    StringBuilderAllocator allocator;
+    int    fd;
+    char  *data;  // NULL while nothing is mapped
+    size_t size;  // Of the mapping and of the file
+} StringBuilderMapping;
+
+// A string that is not null terminated, given by its start and length.
+typedef struct {
+    const char *data;
+    size_t      length;
+} StringSlice;
+
+// Makes a StringSlice out of a string literal, without a strlen() at runtime.
+#define STRING_SLICE(literal) { (literal), sizeof(literal) - 1 }
+
+typedef struct {
+    const char *pattern;
+    const char *replacement;
+} StringBuilderReplacement;
+
+typedef struct {
+    size_t      index; // In the string before any of the insertions
+    const char *string;
+} StringBuilderInsertion;
+
+// Returned by string_builder_find() and string_builder_rfind() when the
+// pattern isn't found.
+#define STRING_BUILDER_NOT_FOUND ((size_t)-1)
+
+// The Two-Way factorization of a pattern, read in one direction.
+typedef struct {
+    size_t   split;  // Where the right half of the pattern starts
+    size_t   period;
+    size_t   memory; // Bytes that still match after a shift by `period`, 0 if it isn't the period
+    uint32_t shifts[256];
+} StringBuilderSearchTable;
+
+typedef struct {
+    const char              *pattern;
+    size_t                   length;
+    StringBuilderSearchTable forward;  // For patterns longer than 16 characters
+    StringBuilderSearchTable backward; // Of the reversed pattern
+} StringBuilderSearcher;
+
+typedef struct {
+    // A DFA of the reversed patterns
+    size_t   state_count;
+    int32_t *transitions;
+    int32_t *matches;
+    size_t   longest_pattern;
+    size_t   pattern_count;
+    size_t  *pattern_lengths;
+    size_t  *replacement_lengths;
+    char   **replacements;
+    int      grows;
+} StringBuilderAutomaton;
+
+typedef struct StringRopeNode {
+    struct StringRopeNode *left;
+    struct StringRopeNode *right;
+    uint32_t priority;
+    size_t   length;
+    size_t   total_length;
+    char     chunk[STRING_ROPE_CHUNK_SIZE];
+} StringRopeNode;
+
+typedef struct {
+    size_t          length;
+    StringRopeNode *root;
+    uint32_t        seed;
+} StringRope;
+
+// What string_builder_append_utf8_validated() does with invalid UTF-8.
+#define STRING_BUILDER_UTF8_REJECT  0 // Appends nothing
+#define STRING_BUILDER_UTF8_REPLACE 1 // Appends U+FFFD for every invalid sequence
+
+#define STRING_BUILDER_FORMAT_LEFT 1
+#define STRING_BUILDER_FORMAT_ZERO 2
+
+typedef struct {
+    size_t literal_start;
+    size_t literal_length;
+    char   conversion;
+    char   length_modifier;
+    char   flags;
+    int    width;
+    int    precision;
+} StringBuilderFormatField;
+
+typedef struct {
+    char                     *literals;
+    size_t                    literals_length;
+    StringBuilderFormatField *fields;
+    size_t                    field_count;
+} StringBuilderFormat;
+
+typedef struct {
+    const char *data;
+    size_t      length;
+} StringBuilderSegment;
+
+typedef struct {
+    StringBuilderSegment *segments;
+    size_t                segment_count;
+    size_t                segment_capacity;
+    size_t                length;
+    StringBuilderArena   *scratch;
+} StringBuilderIov;
+
+#ifdef STRING_BUILDER_CONCURRENT
+typedef struct {
+    // Segment i holds STRING_BUILDER_CONCURRENT_SEGMENT_SIZE << i bytes,
+    // followed by a bitmap with a bit per byte that is set once the byte is
+    // written. It is allocated by the first producer that reaches it.
+    char  *segments[STRING_BUILDER_CONCURRENT_SEGMENTS];
+    // The two counters are written by different producers at different
+    // times, so they get cache lines of their own.
+    char   segments_padding[STRING_BUILDER_CACHE_LINE];
+    size_t reserved;  // Bytes handed out to producers
+    char   reserved_padding[STRING_BUILDER_CACHE_LINE - sizeof(size_t)];
+    size_t committed; // Bytes written in full, all of them before any unfinished ones
+    char   committed_padding[STRING_BUILDER_CACHE_LINE - sizeof(size_t)];
+} StringBuilderConcurrent;
+#endif // STRING_BUILDER_CONCURRENT
+
 StringBuilder string_builder_new();
 StringBuilder string_builder_new_with_capacity(size_t capacity);
 StringBuilder string_builder_new_from(const char *string);
+StringBuilder string_builder_new_with_allocator(const StringBuilderAllocator *allocator);
+StringBuilder string_builder_new_from_buffer(char *buffer, size_t capacity);
+#ifdef STRING_BUILDER_POSIX
+StringBuilder string_builder_new_streaming(int fd, size_t high_water_mark);
+#endif // STRING_BUILDER_POSIX
+#ifndef STRING_BUILDER_NO_FORMAT
+StringBuilder string_builder_new_streaming_file(FILE *file, size_t high_water_mark);
+#endif // STRING_BUILDER_NO_FORMAT
+int           string_builder_flush(StringBuilder *builder);
+#ifdef STRING_BUILDER_MAPPED
+StringBuilder string_builder_new_mapped(const char *path);
+int           string_builder_mapped_sync(StringBuilder *builder);
+int           string_builder_mapped_finish(StringBuilder *builder);
+#endif // STRING_BUILDER_MAPPED
 void          string_builder_free(StringBuilder *builder);
+char         *string_builder_release(StringBuilder *builder);
+void          string_builder_clear(StringBuilder *builder);
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilder string_builder_snapshot(StringBuilder *builder);
+#endif // STRING_BUILDER_CONCURRENT
+
+StringBuilderArena *string_builder_arena_new(size_t block_size);
+void                string_builder_arena_reset(StringBuilderArena *arena);
+void                string_builder_arena_free(StringBuilderArena *arena);
+
+#ifdef STRING_BUILDER_THREADS
+StringBuilderPool     *string_builder_pool_new(size_t initial_capacity, size_t max_capacity, size_t cache_size);
+void                   string_builder_pool_free(StringBuilderPool *pool);
+StringBuilder          string_builder_pool_acquire(StringBuilderPool *pool);
+void                   string_builder_pool_release(StringBuilderPool *pool, StringBuilder *builder);
+StringBuilderPoolStats string_builder_pool_stats(StringBuilderPool *pool);
+#endif // STRING_BUILDER_THREADS
+
+size_t string_builder_growth_geometric(size_t capacity, size_t expected_length);
+size_t string_builder_growth_one_and_half(size_t capacity, size_t expected_length);
+size_t string_builder_growth_paged(size_t capacity, size_t expected_length);
+#ifdef STRING_BUILDER_PAGES
+extern const StringBuilderAllocator string_builder_page_allocator;
+#endif // STRING_BUILDER_PAGES
 
 void string_builder_ensure_capacity(StringBuilder *builder, size_t expected_length);
+void string_builder_reserve_exact(StringBuilder *builder, size_t expected_length);
+void string_builder_shrink_to_fit(StringBuilder *builder);
+#ifdef STRING_BUILDER_STATS
+typedef void (*StringBuilderStatsCallback)(const StringBuilder *builder, void *context);
+StringBuilderStats string_builder_stats_global();
+void               string_builder_stats_reset_global();
+void               string_builder_stats_set_callback(StringBuilderStatsCallback callback, void *context);
+#endif // STRING_BUILDER_STATS
 void string_builder_append(StringBuilder *builder, const char *append_string);
 void string_builder_append_n(StringBuilder *builder, const char *append_string, size_t length);
 void string_builder_append_char(StringBuilder *builder, char c);
+void string_builder_append_many(StringBuilder *builder, const StringSlice *slices, size_t count);
+void string_builder_append_strings(StringBuilder *builder, ...);
+void string_builder_join(StringBuilder *builder, const StringSlice *slices, size_t count, const char *separator);
+StringSlice string_slice_from(const char *string);
 void string_builder_append_int(StringBuilder *builder, int value);
+void string_builder_append_i64(StringBuilder *builder, int64_t value);
+void string_builder_append_u64(StringBuilder *builder, uint64_t value);
+void string_builder_append_u64_hex(StringBuilder *builder, uint64_t value);
+void string_builder_append_u64_oct(StringBuilder *builder, uint64_t value);
+void string_builder_append_double(StringBuilder *builder, double value);
+void string_builder_append_float(StringBuilder *builder, float value);
+void string_builder_append_double_fixed(StringBuilder *builder, double value, int precision);
 void string_builder_append_bits(StringBuilder *builder, int64_t value, int bit_count);
+void string_builder_append_bits_bytes(StringBuilder *builder, const void *data, size_t size);
+void string_builder_append_hex(StringBuilder *builder, const void *data, size_t size);
+void string_builder_append_base64(StringBuilder *builder, const void *data, size_t size);
+void string_builder_append_json_escaped(StringBuilder *builder, const char *string, size_t length);
+void string_builder_append_html_escaped(StringBuilder *builder, const char *string, size_t length);
+void string_builder_append_csv_field(StringBuilder *builder, const char *string, size_t length);
+void string_builder_append_shell_quoted(StringBuilder *builder, const char *string, size_t length);
+int  string_builder_append_utf8_validated(StringBuilder *builder, const char *string, size_t length, int mode);
+void string_builder_append_codepoint(StringBuilder *builder, uint32_t codepoint);
+void string_builder_append_utf16(StringBuilder *builder, const uint16_t *string, size_t length);
+void string_builder_append_latin1(StringBuilder *builder, const char *string, size_t length);
+size_t string_builder_codepoint_count(StringBuilder *builder);
 void string_builder_append_format(StringBuilder *builder, const char *format, ...);
+void string_builder_append_compiled(StringBuilder *builder, const StringBuilderFormat *format, ...);
+void string_builder_append_compiled_v(StringBuilder *builder, const StringBuilderFormat *format, va_list arg_list);
 void string_builder_insert(StringBuilder *builder, size_t insert_index, const char *insertion);
+void string_builder_insert_many(StringBuilder *builder, const StringBuilderInsertion *insertions, size_t count);
 void string_builder_replace(StringBuilder *builder, const char *string_to_replace, const char *replacement);
+void string_builder_replace_searched(StringBuilder *builder, const StringBuilderSearcher *searcher, const char *replacement);
+void string_builder_replace_range(StringBuilder *builder, size_t start, size_t length, const char *replacement);
+int  string_builder_count_substrings(StringBuilder *builder, const char *substring);
+#ifdef STRING_BUILDER_THREADS
+size_t string_builder_count_substrings_parallel(StringBuilder *builder, const char *substring, int thread_count);
+void   string_builder_replace_parallel(StringBuilder *builder, const char *string_to_replace, const char *replacement, int thread_count);
+#endif // STRING_BUILDER_THREADS
+void string_builder_replace_many(StringBuilder *builder, const StringBuilderAutomaton *automaton);
+
+StringBuilderAutomaton string_builder_automaton_new(const StringBuilderReplacement *replacements, size_t count);
+void                   string_builder_automaton_free(StringBuilderAutomaton *automaton);
+
+StringBuilderSearcher string_builder_searcher_new(const char *pattern);
+size_t                string_builder_find(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t from);
+size_t                string_builder_rfind(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t end);
+size_t                string_builder_find_all(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t *offsets, size_t max_offsets);
+
+StringBuilderFormat string_builder_format_compile(const char *format);
+void                string_builder_format_free(StringBuilderFormat *format);
+
+StringBuilderIov string_builder_iov_new();
+void             string_builder_iov_free(StringBuilderIov *iov);
+void             string_builder_iov_reset(StringBuilderIov *iov);
+void             string_builder_iov_append(StringBuilderIov *iov, const char *append_string);
+void             string_builder_iov_append_n(StringBuilderIov *iov, const char *append_string, size_t length);
+void             string_builder_iov_append_ref(StringBuilderIov *iov, const char *data, size_t length);
+void             string_builder_iov_append_char(StringBuilderIov *iov, char c);
+void             string_builder_iov_append_int(StringBuilderIov *iov, int value);
+StringBuilder    string_builder_iov_flatten(const StringBuilderIov *iov);
+#ifdef STRING_BUILDER_POSIX
+int              string_builder_iov_write(const StringBuilderIov *iov, int fd);
+#endif // STRING_BUILDER_POSIX
+
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilderConcurrent string_builder_concurrent_new();
+void                    string_builder_concurrent_free(StringBuilderConcurrent *builder);
+void                    string_builder_concurrent_append(StringBuilderConcurrent *builder, const char *append_string);
+void                    string_builder_concurrent_append_n(StringBuilderConcurrent *builder, const char *append_string, size_t length);
+size_t                  string_builder_concurrent_committed(const StringBuilderConcurrent *builder);
+size_t                  string_builder_concurrent_read(const StringBuilderConcurrent *builder, size_t from, StringBuilder *destination);
+StringBuilder           string_builder_concurrent_flatten(const StringBuilderConcurrent *builder);
+#endif // STRING_BUILDER_CONCURRENT
+
+StringRope    string_rope_new();
+StringRope    string_rope_new_from(const char *string);
+void          string_rope_free(StringRope *rope);
+StringBuilder string_rope_flatten(const StringRope *rope);
+
+void string_rope_append(StringRope *rope, const char *append_string);
+void string_rope_append_n(StringRope *rope, const char *append_string, size_t length);
+void string_rope_append_char(StringRope *rope, char c);
+void string_rope_append_int(StringRope *rope, int value);
+void string_rope_append_format(StringRope *rope, const char *format, ...);
+void string_rope_insert(StringRope *rope, size_t insert_index, const char *insertion);
+void string_rope_insert_n(StringRope *rope, size_t insert_index, const char *insertion, size_t length);
+void string_rope_replace_range(StringRope *rope, size_t start, size_t length, const char *replacement);
 
 // Creates a new StringBuilder with length set to zero and
 // capacity set to STRING_BUILDER_DEFAULT_CAPACITY.
@@ -102,6 +534,145 @@ StringBuilder string_builder_new_with_capacity(size_t capacity);
 // }
 StringBuilder string_builder_new_from(const char *string);
 
+// Creates a new StringBuilder that gets all of its memory from `allocator`
+// instead of STRING_BUILDER_MALLOC/REALLOC/FREE. The allocator isn't copied,
+// so it has to outlive the builder. Passing NULL gives the same builder as
+// string_builder_new().
+//
+// The allocator's functions receive its `context` and, where it matters,
+// the old size of the block, so they can be backed by arenas, pools or
+// per-request heaps.
+//
+//
+// Example:
+//
+// StringBuilderArena *arena = string_builder_arena_new(64 * 1024);
+// StringBuilder builder = string_builder_new_with_allocator(&arena->allocator);
+// string_builder_append(&builder, "Hello");
+// /* ... */
+// string_builder_arena_reset(arena); /* Frees every builder of the request at once. */
+StringBuilder string_builder_new_with_allocator(const StringBuilderAllocator *allocator);
+
+// Creates a new empty StringBuilder that stores its string in `buffer`,
+// which is `capacity` bytes long. Nothing is allocated while the string
+// fits into the buffer, so short strings can be built entirely on the stack.
+//
+// When the string outgrows the buffer, it is moved to the heap (through
+// `builder.allocator` if one is set) and the builder continues as usual.
+// The buffer is never freed by the builder, but it has to stay alive until
+// the builder is freed or has moved to the heap.
+//
+//
+// Example:
+//
+// char buffer[32];
+// StringBuilder builder = string_builder_new_from_buffer(buffer, sizeof buffer);
+// string_builder_append(&builder, "key:");
+// string_builder_append_int(&builder, 42);
+// builder = StringBuilder{
+//      length = 6,
+//      capacity = 32,
+//      string = buffer, // "key:42\0", no allocations made
+// }
+StringBuilder string_builder_new_from_buffer(char *buffer, size_t capacity);
+
+// Creates a new StringBuilder that streams its string into the file
+// descriptor `fd` instead of keeping all of it, for outputs that don't
+// have to fit into memory.
+//
+// Appends work as usual, but when the string would grow past
+// `high_water_mark` characters, what has been built so far is written out
+// with `write`/`writev` and the buffer is reused. A single append longer
+// than `high_water_mark` is written straight from its source where
+// possible. Memory use stays around `high_water_mark` bytes no matter how
+// much is appended.
+//
+// Only the unflushed tail is kept: `builder.length`, `builder.string` and
+// the indices of insert and replace refer to it, and replacements can't
+// see matches that were already written out. `builder.sink->flushed_length`
+// counts what is already written.
+//
+// Call string_builder_flush() at the end to write the tail out and to
+// check for errors. string_builder_free() flushes as well, but can't
+// report a failure.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_streaming(STDOUT_FILENO, 64 * 1024);
+// for (int i = 0; i < 100000000; i++) {
+//     string_builder_append_int(&builder, i);
+//     string_builder_append_char(&builder, '\n');
+// }
+// builder = StringBuilder{
+//      length = ???,   // Not more than 64 * 1024
+//      capacity = ???, // Greater than length
+//      string = ???,   // The numbers not written to stdout yet
+// }
+// if (string_builder_flush(&builder) != 0) {
+//     /* Report the error */
+// }
+// string_builder_free(&builder);
+#ifdef STRING_BUILDER_POSIX
+StringBuilder string_builder_new_streaming(int fd, size_t high_water_mark);
+#endif // STRING_BUILDER_POSIX
+
+// Like string_builder_new_streaming(), but writes to `file` with `fwrite`.
+// The file stays open when the builder is freed.
+#ifndef STRING_BUILDER_NO_FORMAT
+StringBuilder string_builder_new_streaming_file(FILE *file, size_t high_water_mark);
+#endif // STRING_BUILDER_NO_FORMAT
+
+// Writes the string of a streaming builder out and empties the builder.
+// Returns 0 on success or the `error` of the sink if any write failed.
+// After a failure, the streaming builder drops everything appended to it.
+// Does nothing for other builders.
+int           string_builder_flush(StringBuilder *builder);
+
+// Creates a new StringBuilder whose string lives in a shared memory
+// mapping of the file at `path`, which is created or truncated. The pages
+// are written back by the kernel, so resident memory is bounded by the
+// page cache instead of by the size of the string, and the string can grow
+// past physical memory.
+//
+// Growing extends the file with `ftruncate` and the mapping with `mremap`
+// (or by mapping the file again where `mremap` isn't available), so the
+// string is never copied. `builder.string` and `builder.length` work as
+// usual, and so do all the other functions.
+//
+// If the file can't be opened or mapped, `builder.string` is NULL and the
+// builder behaves like a released one: appending to it uses the heap.
+//
+// Available on POSIX systems, with _POSIX_C_SOURCE >= 200112L on glibc's
+// strict ISO C modes.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_mapped("report.csv");
+// for (size_t i = 0; i < row_count; i++) {
+//     append_row(&builder, &rows[i]);
+// }
+// string_builder_replace(&builder, "\r\n", "\n");
+// if (string_builder_mapped_finish(&builder) != 0) { // report.csv is builder.length bytes long
+//     /* Report the error */
+// }
+#ifdef STRING_BUILDER_MAPPED
+StringBuilder string_builder_new_mapped(const char *path);
+
+// Writes the pages of a mapped builder to the file with `msync` and waits
+// for it. Returns 0 on success or the `errno` of the failure.
+int           string_builder_mapped_sync(StringBuilder *builder);
+
+// Unmaps the string of a mapped builder, truncates the file to
+// `builder.length` (the null terminator isn't written) and closes it.
+// Returns 0 on success or the `errno` of the first failure. The builder is
+// left empty and can't be used anymore, except for string_builder_free().
+// string_builder_free() finishes mapped builders too, but can't report
+// a failure.
+int           string_builder_mapped_finish(StringBuilder *builder);
+#endif // STRING_BUILDER_MAPPED
+
 // Frees the memory allocated for the string and resets
 // length and capacity. After calling string_builder_free(),
 // the freed builder should not be used anymore.
@@ -114,6 +685,201 @@ StringBuilder string_builder_new_from(const char *string);
 // string_builder_append(&builder, "Hello"); /* DON'T DO THAT! */
 void          string_builder_free(StringBuilder *builder);
 
+// Hands the built string over to the caller without copying it and
+// leaves the builder empty, with no memory of its own. The caller
+// becomes responsible for freeing the string: with STRING_BUILDER_FREE,
+// or through `builder.allocator` if one is set.
+//
+// A string that lives in a caller-provided buffer is copied to the heap
+// first, so the returned pointer can always be freed. Streaming and mapped
+// builders can't be released, a mapped one is finished with
+// string_builder_mapped_finish() instead.
+//
+// The emptied builder can be appended to again or passed to string_builder_free().
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append(&builder, "Hello");
+// char *string = string_builder_release(&builder); // "Hello\0"
+// builder = StringBuilder{
+//      length = 0,
+//      capacity = 0,
+//      string = NULL,
+// }
+// STRING_BUILDER_FREE(string);
+char         *string_builder_release(StringBuilder *builder);
+
+// Empties the string but keeps its memory, so that the builder can be
+// reused without allocating until it outgrows its capacity again.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append(&builder, "Hello, world!");
+// string_builder_clear(&builder);
+// builder = StringBuilder{
+//      length = 0,
+//      capacity = 16,
+//      string = "\0",
+// }
+void          string_builder_clear(StringBuilder *builder);
+
+// Creates a new StringBuilder that shares the string of `builder` instead
+// of copying it. Taking a snapshot is O(1) and usually doesn't allocate:
+// the reference count lives in the unused capacity after the string.
+//
+// The string is copied on the first change to either builder (an append,
+// an insert, a replace, a clear), and only for the builder that changes
+// it. Until then the capacity of the sharing builders is
+// their length, so the first append takes the slow path that makes the
+// copy, into a buffer that already has room for the appended characters.
+// A builder that outlived all the others it shared a string with takes
+// the whole buffer back without copying.
+//
+// The reference count is atomic, so snapshots can be handed to other
+// threads and freed there. Each builder must still be used by one thread
+// at a time. Streaming and mapped builders can't be snapshotted.
+//
+//
+// Example:
+//
+// StringBuilder headers = string_builder_new();
+// string_builder_append(&headers, "HTTP/1.1 200 OK\r\nServer: sb\r\n");
+// StringBuilder response = string_builder_snapshot(&headers); // Nothing is copied
+// string_builder_append(&response, "Content-Length: 0\r\n\r\n");     // The headers are copied
+// response = StringBuilder{
+//      length = 50,
+//      capacity = ???, // Greater than length
+//      string = "HTTP/1.1 200 OK\r\nServer: sb\r\nContent-Length: 0\r\n\r\n\0",
+// }
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilder string_builder_snapshot(StringBuilder *builder);
+#endif // STRING_BUILDER_CONCURRENT
+
+// Creates a bump allocator that hands out memory from blocks of
+// `block_size` bytes. Use `&arena->allocator` with
+// string_builder_new_with_allocator().
+//
+// Allocations only move a pointer forward. Growing the most recent
+// allocation happens in place while the block has room, so a builder that
+// is appended to while nothing else allocates from the arena never copies
+// its string. Requests larger than `block_size` get a block of their own.
+//
+//
+// Example:
+//
+// StringBuilderArena *arena = string_builder_arena_new(64 * 1024);
+// arena->allocator = StringBuilderAllocator{
+//      allocate = ???,   // Bump allocation
+//      reallocate = ???, // In place for the last allocation
+//      deallocate = ???, // Only gives back the last allocation
+//      context = arena,
+// }
+StringBuilderArena *string_builder_arena_new(size_t block_size);
+
+// Makes all the memory of the arena available again in O(1).
+// Every builder allocated from the arena becomes invalid.
+// The blocks are kept and reused by the next allocations.
+void                string_builder_arena_reset(StringBuilderArena *arena);
+
+// Frees all the blocks of the arena and the arena itself.
+void                string_builder_arena_free(StringBuilderArena *arena);
+
+// A pool of builders for programs that build one string per request and
+// throw it away. Every thread keeps up to `cache_size` released builders
+// in a cache of its own, so acquiring and releasing a builder neither
+// allocates nor takes a lock once the caches are warm, and a builder
+// comes back with the capacity it grew to.
+//
+// New builders start with `initial_capacity`. Builders that grew past
+// `max_capacity` are shrunk back to it when released, so that one huge
+// response doesn't pin its memory forever.
+//
+// A thread's cache is freed when the thread exits. The pool must outlive
+// the threads that use it, or be freed after they stopped using it.
+//
+//
+// Example:
+//
+// StringBuilderPool *pool = string_builder_pool_new(1024, 64 * 1024, 8);
+// // For every request:
+// StringBuilder response = string_builder_pool_acquire(pool);
+// string_builder_append(&response, "HTTP/1.1 200 OK\r\n");
+// send(socket_fd, response.string, response.length, 0);
+// string_builder_pool_release(pool, &response);
+// response = StringBuilder{
+//      length = 0,
+//      capacity = 0,
+//      string = NULL, // Back in the cache, still holding 1024 bytes
+// }
+#ifdef STRING_BUILDER_THREADS
+StringBuilderPool     *string_builder_pool_new(size_t initial_capacity, size_t max_capacity, size_t cache_size);
+
+// Frees the pool and every builder cached in it, from all the threads.
+// Builders that are acquired and not released yet stay valid and have to
+// be freed with string_builder_free().
+void                   string_builder_pool_free(StringBuilderPool *pool);
+
+// Returns an empty builder, from the calling thread's cache if it isn't
+// empty.
+StringBuilder          string_builder_pool_acquire(StringBuilderPool *pool);
+
+// Empties `builder` and keeps it in the calling thread's cache, or frees
+// it if the cache is full. A builder can be released by another thread
+// than the one that acquired it. Builders with a caller-provided buffer,
+// an allocator or a sink are always freed. `builder` is left without
+// memory of its own.
+void                   string_builder_pool_release(StringBuilderPool *pool, StringBuilder *builder);
+
+// Sums the counters of all the threads that used the pool.
+StringBuilderPoolStats string_builder_pool_stats(StringBuilderPool *pool);
+#endif // STRING_BUILDER_THREADS
+
+// Growth policies decide how much memory a builder asks for when its string
+// doesn't fit anymore. A builder uses the one in `builder.growth`, which
+// can be changed at any time.
+//
+// string_builder_growth_geometric() multiplies the capacity by
+// STRING_BUILDER_RESIZE_FACTOR and is the default.
+//
+// string_builder_growth_one_and_half() grows by 1.5 times, which wastes
+// less memory in processes that are tight on it, at the cost of more
+// reallocations.
+//
+// string_builder_growth_paged() grows geometrically, but rounds capacities
+// past a page to STRING_BUILDER_PAGE_SIZE and capacities past a huge page
+// to STRING_BUILDER_HUGE_PAGE_SIZE. Together with
+// string_builder_page_allocator, big buffers are whole pages that grow by
+// remapping them instead of copying.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_with_allocator(&string_builder_page_allocator);
+// builder.growth = string_builder_growth_paged;
+// string_builder_ensure_capacity(&builder, 5000);
+// builder = StringBuilder{
+//      length = 0,
+//      capacity = 8192, // 16 doubled past 5000 and rounded to pages
+//      string = "\0",
+// }
+size_t string_builder_growth_geometric(size_t capacity, size_t expected_length);
+size_t string_builder_growth_one_and_half(size_t capacity, size_t expected_length);
+size_t string_builder_growth_paged(size_t capacity, size_t expected_length);
+
+// An allocator that takes whole pages from the system with `mmap` and
+// grows them with `mremap`, so growing a big string moves page table
+// entries instead of bytes. Where `mremap` isn't declared, growing maps
+// new pages and copies. Meant for big buffers, every allocation takes at
+// least a page. Declared where `MAP_ANONYMOUS` is, which glibc's strict
+// ISO C modes hide.
+#ifdef STRING_BUILDER_PAGES
+extern const StringBuilderAllocator string_builder_page_allocator;
+#endif // STRING_BUILDER_PAGES
+
 // After calling string_builder_ensure_capacity(builder, expected_length), the builder
 // is guaranteed to have enough memory allocated for string of length `expected_length`.
 //
@@ -128,6 +894,79 @@ void          string_builder_free(StringBuilder *builder);
 // string_builder_ensure_capacity(&builder, strlen(string));
 void string_builder_ensure_capacity(StringBuilder *builder, size_t expected_length);
 
+// Like string_builder_ensure_capacity(), but if the builder has to grow, it
+// gets exactly enough memory for `expected_length` characters and the null
+// terminator instead of following its growth policy. Useful when the final
+// length is known up front.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_reserve_exact(&builder, 1000);
+// builder = StringBuilder{
+//      length = 0,
+//      capacity = 1001,
+//      string = "\0",
+// }
+void string_builder_reserve_exact(StringBuilder *builder, size_t expected_length);
+
+// Gives back the memory that the string doesn't use, so that capacity
+// becomes `length + 1`. Meant for long-lived builders that are done
+// growing. Builders in a caller-provided buffer are left as they are.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_with_capacity(1024);
+// string_builder_append(&builder, "Hello");
+// string_builder_shrink_to_fit(&builder);
+// builder = StringBuilder{
+//      length = 5,
+//      capacity = 6,
+//      string = "Hello\0",
+// }
+void string_builder_shrink_to_fit(StringBuilder *builder);
+
+// With STRING_BUILDER_STATS defined before every include of this header,
+// each builder counts its allocations, copies, growths and the time it
+// spends in replaces and formatted appends in `builder.stats`. The same
+// counters are also summed over all builders of the process with atomic
+// adds. Without the define none of this is compiled in, and StringBuilder
+// doesn't have the `stats` field.
+//
+// string_builder_stats_global() returns the process-wide counters and
+// string_builder_stats_reset_global() sets them back to zero, for example
+// after exporting them.
+//
+// The callback passed to string_builder_stats_set_callback() is called by
+// string_builder_free() with the builder that is about to be freed, so
+// that its counters can be sent to a metrics system. Set it before the
+// builders are used from several threads; `context` is passed through.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append(&builder, "Hello, world!");
+// string_builder_insert(&builder, 0, ">> ");
+// builder.stats = StringBuilderStats{
+//      allocations = 1,
+//      reallocations = 1,
+//      growths = 1,
+//      bytes_copied = ???, // 14 if realloc() moved the string
+//      bytes_moved = 14,   // "Hello, world!\0" shifted by the insert
+//      replace_passes = 0,
+//      peak_capacity = 32,
+//      replace_nanoseconds = 0,
+//      format_nanoseconds = 0,
+// }
+#ifdef STRING_BUILDER_STATS
+StringBuilderStats string_builder_stats_global();
+void               string_builder_stats_reset_global();
+void               string_builder_stats_set_callback(StringBuilderStatsCallback callback, void *context);
+#endif // STRING_BUILDER_STATS
+
 // Appends the `append_string` to the end of the string being built.
 // Memory is allocated if needed.
 //
@@ -181,77 +1020,523 @@ void string_builder_append_n(StringBuilder *builder, const char *append_string,
 // }
 void string_builder_append_char(StringBuilder *builder, char c);
 
-// Appends an integer to the end of the string being built.
-// The integer is converted to it's string representation.
-// No memory is allocated for integer to string conversion.
+// Appends `count` slices one after the other. Their lengths are summed
+// first, so memory is reserved at most once and the string is null
+// terminated once, which is cheaper than a string_builder_append() for
+// each of them.
 //
 //
 // Example:
 //
 // StringBuilder builder = string_builder_new();
-// string_builder_append_int(builder, 123);
+// StringSlice slices[] = {
+//     STRING_SLICE("GET "),
+//     string_slice_from(path), // "/index.html"
+//     STRING_SLICE(" HTTP/1.1"),
+// };
+// string_builder_append_many(&builder, slices, 3);
 // builder = StringBuilder{
-//      length = 3,
+//      length = 24,
 //      capacity = ???, // Greater than length
-//      string = "123\0",
+//      string = "GET /index.html HTTP/1.1\0",
 // }
-void string_builder_append_int(StringBuilder *builder, int value);
+void string_builder_append_many(StringBuilder *builder, const StringSlice *slices, size_t count);
 
-// Appends a bit representation of an integer to the end of the string
-// being built. Only `bit_count` bits are appended, starting from the
-// low-order byte. The string representation of bits is not reversed.
-// Memory is not allocated for the bit to string conversion, but
-// allocated for the string being built if needed.
+// Same as string_builder_append_many(), but takes the strings as arguments.
+// The last argument must be NULL. Memory is reserved once for every 16
+// strings.
 //
 //
-// Examples:
+// Example:
 //
 // StringBuilder builder = string_builder_new();
-// string_builder_append_bits(builder, 49, 8);
+// string_builder_append_strings(&builder, "key", "=", "value", ";", NULL);
 // builder = StringBuilder{
-//      length = 8,
+//      length = 10,
 //      capacity = ???, // Greater than length
-//      string = "00110001\0",
+//      string = "key=value;\0",
 // }
-void string_builder_append_bits(StringBuilder *builder, int64_t value, int bit_count);
+void string_builder_append_strings(StringBuilder *builder, ...);
 
-// Appends a formatted string to the end of the string being built.
-// The formats are the same formats that are supported in `printf``
-// No memory is allocated for integer to string conversion.
+// Appends `count` slices with `separator` between each two of them.
+// Memory is reserved at most once, like in string_builder_append_many().
 //
 //
 // Example:
 //
 // StringBuilder builder = string_builder_new();
-// string_builder_append_format(builder, "%d * %.2f = %s", 5, 5.4, "27.0");
+// StringSlice columns[] = { STRING_SLICE("id"), STRING_SLICE("name"), STRING_SLICE("email") };
+// string_builder_join(&builder, columns, 3, ", ");
 // builder = StringBuilder{
 //      length = 15,
 //      capacity = ???, // Greater than length
-//      string = "5 * 5.40 = 27.0\0",
+//      string = "id, name, email\0",
 // }
-void string_builder_append_format(StringBuilder *builder, const char *format, ...);
+void string_builder_join(StringBuilder *builder, const StringSlice *slices, size_t count, const char *separator);
 
-// Inserts `insertion` at `insert_index` in the string being built.
-// All the string after `insert_index` is moved to accomodate the inserted
-// string.
-//
-// Memory is allocated if needed for the string being built.
+// Makes a StringSlice out of a null terminated string.
+StringSlice string_slice_from(const char *string);
+
+// Appends an integer to the end of the string being built.
+// The integer is converted to it's string representation.
+// No memory is allocated for integer to string conversion.
 //
 //
 // Example:
 //
 // StringBuilder builder = string_builder_new();
-// string_builder_append(&builder, "world")
-// string_builder_insert(&builder, 0, "hello");
-// string_builder_insert(&builder, 5, " ");
+// string_builder_append_int(builder, 123);
 // builder = StringBuilder{
-//      length = 11,
+//      length = 3,
 //      capacity = ???, // Greater than length
-//      string = "hello world\0",
+//      string = "123\0",
 // }
-void string_builder_insert(StringBuilder *builder, size_t insert_index, const char *insertion);
+void string_builder_append_int(StringBuilder *builder, int value);
 
-// Replaces all entries of `string_to_replace` in the string being built with
+// Appends a 64-bit integer to the end of the string being built.
+// The number of digits is computed up front, so memory is reserved
+// once and the digits are written straight into the string, two at a time.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_i64(builder, INT64_MIN);
+// builder = StringBuilder{
+//      length = 20,
+//      capacity = ???, // Greater than length
+//      string = "-9223372036854775808\0",
+// }
+void string_builder_append_i64(StringBuilder *builder, int64_t value);
+
+// Appends an unsigned 64-bit integer to the end of the string being built.
+// Works the same way as string_builder_append_i64().
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_u64(builder, UINT64_MAX);
+// builder = StringBuilder{
+//      length = 20,
+//      capacity = ???, // Greater than length
+//      string = "18446744073709551615\0",
+// }
+void string_builder_append_u64(StringBuilder *builder, uint64_t value);
+
+// Appends an unsigned 64-bit integer in lowercase hexadecimal,
+// without a prefix or leading zeros.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_u64_hex(builder, 48879);
+// builder = StringBuilder{
+//      length = 4,
+//      capacity = ???, // Greater than length
+//      string = "beef\0",
+// }
+void string_builder_append_u64_hex(StringBuilder *builder, uint64_t value);
+
+// Appends an unsigned 64-bit integer in octal,
+// without a prefix or leading zeros.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_u64_oct(builder, 493);
+// builder = StringBuilder{
+//      length = 3,
+//      capacity = ???, // Greater than length
+//      string = "755\0",
+// }
+void string_builder_append_u64_oct(StringBuilder *builder, uint64_t value);
+
+// Appends the shortest decimal representation of `value` that reads back
+// as exactly the same double.
+//
+// The digits come from Grisu3, which only needs 64-bit integer arithmetic.
+// About 0.5% of doubles are too close to call for it, and those are done with
+// exact big integer arithmetic (the free-format algorithm of Steele & White /
+// Burger & Dybvig) instead. Neither uses `printf`, so the result doesn't
+// depend on the locale and this works under STRING_BUILDER_NO_FORMAT.
+// Integers below 2^53 take a faster path.
+//
+// Numbers from 1e-6 up to 1e21 are written without an exponent,
+// the rest as `d.ddde+XX`. Special values are written as
+// "nan", "inf" and "-inf".
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_double(builder, 0.1);
+// string_builder_append_char(builder, ' ');
+// string_builder_append_double(builder, 1e300);
+// string_builder_append_char(builder, ' ');
+// string_builder_append_double(builder, 42);
+// builder = StringBuilder{
+//      length = 13,
+//      capacity = ???, // Greater than length
+//      string = "0.1 1e+300 42\0",
+// }
+void string_builder_append_double(StringBuilder *builder, double value);
+
+// Same as string_builder_append_double(), but the digits are the shortest
+// ones that read back as the same float.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_float(builder, 0.3f);
+// builder = StringBuilder{
+//      length = 3,
+//      capacity = ???, // Greater than length
+//      string = "0.3\0", // string_builder_append_double() would give "0.30000001192092896"
+// }
+void string_builder_append_float(StringBuilder *builder, float value);
+
+// Appends `value` with exactly `precision` digits after the decimal point,
+// like `printf("%.*f", precision, value)`. The exact binary value is rounded,
+// ties go to the even digit. `precision` must be between 0 and
+// STRING_BUILDER_MAX_FIXED_PRECISION.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_double_fixed(builder, 2.675, 2);
+// builder = StringBuilder{
+//      length = 4,
+//      capacity = ???, // Greater than length
+//      string = "2.67\0", // 2.675 is really 2.67499999999999982236431605997495353221893310546875
+// }
+void string_builder_append_double_fixed(StringBuilder *builder, double value, int precision);
+
+// Appends a bit representation of an integer to the end of the string
+// being built. Only `bit_count` bits are appended, starting from the
+// low-order byte. The string representation of bits is not reversed.
+// Memory is not allocated for the bit to string conversion, but
+// allocated for the string being built if needed.
+//
+//
+// Examples:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_bits(builder, 49, 8);
+// builder = StringBuilder{
+//      length = 8,
+//      capacity = ???, // Greater than length
+//      string = "00110001\0",
+// }
+void string_builder_append_bits(StringBuilder *builder, int64_t value, int bit_count);
+
+// Appends the bits of `size` bytes starting at `data`, 8 characters per
+// byte. Bytes are written in memory order, the bits of each byte
+// from the most significant one.
+// Memory is reserved once for the whole output.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// const unsigned char frame[] = { 0x81, 0x0f };
+// string_builder_append_bits_bytes(builder, frame, 2);
+// builder = StringBuilder{
+//      length = 16,
+//      capacity = ???, // Greater than length
+//      string = "1000000100001111\0",
+// }
+void string_builder_append_bits_bytes(StringBuilder *builder, const void *data, size_t size);
+
+// Appends `size` bytes starting at `data` as lowercase hexadecimal,
+// two characters per byte, in memory order.
+// Memory is reserved once and large inputs are encoded 16 or 32 bytes
+// at a time when the CPU supports SSSE3 or AVX2.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// const unsigned char frame[] = { 0xde, 0xad, 0xbe, 0xef };
+// string_builder_append_hex(builder, frame, 4);
+// builder = StringBuilder{
+//      length = 8,
+//      capacity = ???, // Greater than length
+//      string = "deadbeef\0",
+// }
+void string_builder_append_hex(StringBuilder *builder, const void *data, size_t size);
+
+// Appends `size` bytes starting at `data` encoded as standard base64
+// (RFC 4648, with '=' padding).
+// Memory is reserved once and large inputs are encoded 12 or 24 bytes
+// at a time when the CPU supports SSSE3 or AVX2.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_base64(builder, "hello", 5);
+// builder = StringBuilder{
+//      length = 8,
+//      capacity = ???, // Greater than length
+//      string = "aGVsbG8=\0",
+// }
+void string_builder_append_base64(StringBuilder *builder, const void *data, size_t size);
+
+// The escaping appenders reserve memory for the worst case once, look
+// for the characters that need escaping 16 or 32 bytes at a time, and
+// copy the runs between them with memcpy(). Text with nothing to escape
+// is appended at close to the speed of string_builder_append_n().
+
+// Appends `length` characters from `string` escaped for the inside of a
+// JSON string: '"' and '\' are escaped with a backslash, control
+// characters as \n, \t and so on or \u00XX. Other bytes, UTF-8
+// included, are copied as they are. The surrounding quotes aren't added.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_json_escaped(&builder, "say \"hi\"\n", 9);
+// builder = StringBuilder{
+//      length = 12,
+//      capacity = ???, // Greater than length
+//      string = "say \\\"hi\\\"\\n\0", // say \"hi\"\n
+// }
+void string_builder_append_json_escaped(StringBuilder *builder, const char *string, size_t length);
+
+// Appends `length` characters from `string` with '&', '<', '>', '"' and
+// '\'' replaced by character references, safe for HTML text and quoted
+// attribute values.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_html_escaped(&builder, "<b>Fish & Chips</b>", 19);
+// builder = StringBuilder{
+//      length = 35,
+//      capacity = ???, // Greater than length
+//      string = "&lt;b&gt;Fish &amp; Chips&lt;/b&gt;\0",
+// }
+void string_builder_append_html_escaped(StringBuilder *builder, const char *string, size_t length);
+
+// Appends `length` characters from `string` as a CSV field (RFC 4180).
+// Fields with a ',', '"', '\r' or '\n' are put in double quotes, with
+// the quotes inside doubled. Other fields are copied as they are.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_csv_field(&builder, "plain", 5);
+// string_builder_append_char(&builder, ',');
+// string_builder_append_csv_field(&builder, "say \"hi\", then go", 17);
+// builder = StringBuilder{
+//      length = 27,
+//      capacity = ???, // Greater than length
+//      string = "plain,\"say \"\"hi\"\", then go\"\0", // plain,"say ""hi"", then go"
+// }
+void string_builder_append_csv_field(StringBuilder *builder, const char *string, size_t length);
+
+// Appends `length` characters from `string` quoted as a single word for
+// a POSIX shell: the string is put in single quotes, and every ' in it
+// becomes '\''. The result never expands or splits.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("rm ");
+// string_builder_append_shell_quoted(&builder, "it's here", 9);
+// builder = StringBuilder{
+//      length = 17,
+//      capacity = ???, // Greater than length
+//      string = "rm 'it'\\''s here'\0", // rm 'it'\''s here'
+// }
+void string_builder_append_shell_quoted(StringBuilder *builder, const char *string, size_t length);
+
+// Appends `length` characters from `string` if they are valid UTF-8.
+// Returns 0 if they are, and 1 otherwise. Overlong forms, surrogates and
+// code points past U+10FFFF are invalid, like truncated sequences.
+//
+// With STRING_BUILDER_UTF8_REJECT, nothing is appended for an invalid
+// string. With STRING_BUILDER_UTF8_REPLACE, every invalid sequence
+// becomes U+FFFD, one for each maximal invalid part as the Unicode
+// standard recommends, and the rest is appended as is.
+//
+// The string is validated while it's copied, 16 (SSSE3) or 32 (AVX2)
+// bytes at a time, with the lookup tables of simdutf. ASCII blocks are
+// only copied.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_utf8_validated(&builder, "caf\xc3\xa9", 5, STRING_BUILDER_UTF8_REJECT);     // 0
+// string_builder_append_utf8_validated(&builder, " \xff!", 3, STRING_BUILDER_UTF8_REJECT);          // 1
+// string_builder_append_utf8_validated(&builder, " \xe2\x82!", 4, STRING_BUILDER_UTF8_REPLACE);    // 1
+// builder = StringBuilder{
+//      length = 10,
+//      capacity = ???, // Greater than length
+//      string = "caf\xc3\xa9 \xef\xbf\xbd!\0", // café �!
+// }
+int  string_builder_append_utf8_validated(StringBuilder *builder, const char *string, size_t length, int mode);
+
+// Appends `codepoint` encoded in UTF-8. Surrogates and code points past
+// U+10FFFF are appended as U+FFFD.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_codepoint(&builder, 0x1F600);
+// builder = StringBuilder{
+//      length = 4,
+//      capacity = ???, // Greater than length
+//      string = "\xf0\x9f\x98\x80\0", // 😀
+// }
+void string_builder_append_codepoint(StringBuilder *builder, uint32_t codepoint);
+
+// Appends `length` UTF-16 code units of native byte order from `string`,
+// converted to UTF-8 right in the string being built. Unpaired surrogates
+// become U+FFFD. Runs of ASCII are converted 16 or 32 units at a time.
+//
+//
+// Example:
+//
+// const uint16_t units[] = { 'h', 'i', ' ', 0xD83D, 0xDE00 };
+// StringBuilder builder = string_builder_new();
+// string_builder_append_utf16(&builder, units, 5);
+// builder = StringBuilder{
+//      length = 7,
+//      capacity = ???, // Greater than length
+//      string = "hi \xf0\x9f\x98\x80\0", // hi 😀
+// }
+void string_builder_append_utf16(StringBuilder *builder, const uint16_t *string, size_t length);
+
+// Appends `length` characters of ISO-8859-1 from `string`, converted to
+// UTF-8. Runs of ASCII are copied 16 or 32 bytes at a time.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_latin1(&builder, "na\xefve", 5);
+// builder = StringBuilder{
+//      length = 6,
+//      capacity = ???, // Greater than length
+//      string = "na\xc3\xafve\0", // naïve
+// }
+void string_builder_append_latin1(StringBuilder *builder, const char *string, size_t length);
+
+// Returns the number of code points in the string being built, which is
+// the number of bytes that aren't UTF-8 continuation bytes. The count is
+// kept in the builder, so only what was appended since the last call is
+// counted, 16 or 32 bytes at a time. Other changes to the string make the
+// next call count it all again.
+//
+// A streaming builder counts the characters it hasn't written out yet.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("caf\xc3\xa9");
+// string_builder_codepoint_count(&builder); // 4
+// string_builder_append(&builder, " au lait");
+// string_builder_codepoint_count(&builder); // 12, only " au lait" was counted
+size_t string_builder_codepoint_count(StringBuilder *builder);
+
+// Appends a formatted string to the end of the string being built.
+// The formats are the same formats that are supported in `printf``
+// No memory is allocated for integer to string conversion.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append_format(builder, "%d * %.2f = %s", 5, 5.4, "27.0");
+// builder = StringBuilder{
+//      length = 15,
+//      capacity = ???, // Greater than length
+//      string = "5 * 5.40 = 27.0\0",
+// }
+void string_builder_append_format(StringBuilder *builder, const char *format, ...);
+
+// Appends a string formatted with a format compiled by
+// string_builder_format_compile(). The format string isn't parsed again
+// and `vsnprintf` isn't used: an upper bound of the length is reserved
+// once, then every field is written straight into the string.
+//
+// The arguments must match the conversions of the format, as in `printf`.
+//
+//
+// Example:
+//
+// StringBuilderFormat format = string_builder_format_compile("[%-5s] %s: %08x");
+// StringBuilder builder = string_builder_new();
+// string_builder_append_compiled(&builder, &format, "WARN", "checksum", 0xbeefu);
+// builder = StringBuilder{
+//      length = 26,
+//      capacity = ???, // Greater than length
+//      string = "[WARN ] checksum: 0000beef\0",
+// }
+void string_builder_append_compiled(StringBuilder *builder, const StringBuilderFormat *format, ...);
+
+// Same as string_builder_append_compiled(), but takes a `va_list`.
+void string_builder_append_compiled_v(StringBuilder *builder, const StringBuilderFormat *format, va_list arg_list);
+
+// Inserts `insertion` at `insert_index` in the string being built.
+// All the string after `insert_index` is moved to accomodate the inserted
+// string.
+//
+// Memory is allocated if needed for the string being built.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new();
+// string_builder_append(&builder, "world")
+// string_builder_insert(&builder, 0, "hello");
+// string_builder_insert(&builder, 5, " ");
+// builder = StringBuilder{
+//      length = 11,
+//      capacity = ???, // Greater than length
+//      string = "hello world\0",
+// }
+void string_builder_insert(StringBuilder *builder, size_t insert_index, const char *insertion);
+
+// Inserts `count` strings at once. The indices are in the string as it
+// is before the call, so they don't have to be adjusted for the strings
+// inserted before them, and can be given in any order. Strings with the
+// same index are inserted in the order they're given.
+//
+// Memory is reserved once, and the string is rewritten from its end in a
+// single pass, so every character is moved at most once instead of once
+// per string_builder_insert().
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("fish and chips");
+// StringBuilderInsertion markers[] = {
+//     { 14, "</i>" },
+//     { 9, "<i>" },
+//     { 0, "<b>" },
+//     { 4, "</b>" },
+// };
+// string_builder_insert_many(&builder, markers, 4);
+// builder = StringBuilder{
+//      length = 28,
+//      capacity = ???, // Greater than length
+//      string = "<b>fish</b> and <i>chips</i>\0",
+// }
+void string_builder_insert_many(StringBuilder *builder, const StringBuilderInsertion *insertions, size_t count);
+
+// Replaces all entries of `string_to_replace` in the string being built with
 // `replacement`.
 // No memory is allocated for any temporary strings / replacement needs, but
 // memory is allocated if needed for the string being built.
@@ -270,324 +1555,5499 @@ void string_builder_insert(StringBuilder *builder, size_t insert_index, const ch
 // }
 void string_builder_replace(StringBuilder *builder, const char *string_to_replace, const char *replacement);
 
-#ifdef STRING_BUILDER_IMPLEMENTATION
+// Same as string_builder_replace(), with a pattern compiled by
+// string_builder_searcher_new(), so a pattern that is replaced in many
+// builders is compiled once.
+//
+//
+// Example:
+//
+// StringBuilderSearcher tab = string_builder_searcher_new("\t");
+// for (size_t i = 0; i < line_count; i++) {
+//     string_builder_replace_searched(&lines[i], &tab, "    ");
+// }
+void string_builder_replace_searched(StringBuilder *builder, const StringBuilderSearcher *searcher, const char *replacement);
+
+// Replaces `length` characters starting at `start` with `replacement`.
+// `replacement` may be shorter or longer than the replaced range. With
+// string_builder_find(), it replaces a single match.
+//
+// Memory is allocated if needed for the string being built.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("hello world");
+// string_builder_replace_range(&builder, 0, 5, "goodbye");
+// builder = StringBuilder{
+//      length = 13,
+//      capacity = ???, // Greater than length
+//      string = "goodbye world\0",
+// }
+void string_builder_replace_range(StringBuilder *builder, size_t start, size_t length, const char *replacement);
+
+// Returns the number of times `substring` occurs in the string being
+// built. Matches don't overlap, so "aa" occurs twice in "aaaaa".
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("one fish, two fish");
+// string_builder_count_substrings(&builder, "fish"); // 2
+int  string_builder_count_substrings(StringBuilder *builder, const char *substring);
+
+// Parallel versions of string_builder_count_substrings() and
+// string_builder_replace() for strings of hundreds of megabytes and more.
+// The results are the same, byte for byte.
+//
+// The string is split into one chunk per thread. The chunk borders are
+// moved so that no match straddles them, which makes every chunk
+// searchable on its own. The threads count the matches of their chunks,
+// a prefix sum of the counts gives each chunk its place in the result,
+// and the threads then write their chunks there at the same time.
+//
+// Unlike string_builder_replace(), the result is written into a new
+// buffer, so the old and the new string are in memory together for a
+// moment. `thread_count` of 0 uses one thread per online processor.
+// Chunks are at least STRING_BUILDER_PARALLEL_MIN_CHUNK bytes, so short
+// strings, streaming and file-backed builders use a single thread and
+// are replaced in place.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from(four_gigabytes_of_logs);
+// size_t error_count = string_builder_count_substrings_parallel(&builder, "ERROR", 8);
+// string_builder_replace_parallel(&builder, "password=hunter2", "password=***", 8);
+// builder = StringBuilder{
+//      length = ???, // 4 bytes shorter for every password
+//      capacity = ???, // Greater than length
+//      string = "...",
+// }
+#ifdef STRING_BUILDER_THREADS
+size_t string_builder_count_substrings_parallel(StringBuilder *builder, const char *substring, int thread_count);
+void   string_builder_replace_parallel(StringBuilder *builder, const char *string_to_replace, const char *replacement, int thread_count);
+#endif // STRING_BUILDER_THREADS
+
+// Replaces all entries of every pattern in `automaton` with the matching
+// replacement in time linear in the length of the string being built.
+//
+// The string is rewritten from left to right. At every position the
+// leftmost match wins, and of the patterns starting there the longest one
+// wins. Replacements are never scanned again, so unlike several calls to
+// string_builder_replace() the order of the pairs doesn't matter.
+//
+// The automaton runs over the string from the end, 4 KiB at a time, and
+// finds the longest pattern that starts at each position. Every character
+// goes through it once, plus the longest pattern's length per 4 KiB.
+//
+// When no replacement is longer than its pattern, the string is rewritten
+// in place without allocating. Otherwise a first pass finds the longest the
+// string gets while it's rewritten from the start, the capacity is grown to
+// that, and the string is moved forward by the difference and rewritten in
+// place from the start. No second buffer is needed, which is what keeps a
+// mapped builder in a single mapping.
+//
+//
+// Example:
+//
+// StringBuilderReplacement pairs[] = {
+//      { "..", "." },
+//      { ".",  " " },
+//      { "#",  "##" },
+// };
+// StringBuilderAutomaton automaton = string_builder_automaton_new(pairs, 3);
+//
+// StringBuilder builder = string_builder_new_from("...#.");
+// string_builder_replace_many(&builder, &automaton);
+// builder = StringBuilder{
+//      length = 5,
+//      capacity = ???, // Greater than length
+//      string = ". ## \0",
+// }
+void string_builder_replace_many(StringBuilder *builder, const StringBuilderAutomaton *automaton);
+
+// Compiles `count` (pattern, replacement) pairs into an Aho-Corasick
+// automaton of the reversed patterns for string_builder_replace_many().
+// The patterns and replacements are copied, and the automaton doesn't
+// depend on any builder, so it can be built once and reused.
+// Patterns must not be empty. If the same pattern is given twice,
+// the first pair is used.
+//
+//
+// Example:
+//
+// StringBuilderReplacement pairs[] = {
+//      { "&", "&amp;" },
+//      { "<", "&lt;" },
+//      { ">", "&gt;" },
+// };
+// StringBuilderAutomaton automaton = string_builder_automaton_new(pairs, 3);
+StringBuilderAutomaton string_builder_automaton_new(const StringBuilderReplacement *replacements, size_t count);
+
+// Frees the memory allocated for the automaton.
+// After calling string_builder_automaton_free(), the automaton
+// should not be used anymore.
+void                   string_builder_automaton_free(StringBuilderAutomaton *automaton);
+
+// Compiles `pattern` for string_builder_find(), string_builder_rfind(),
+// string_builder_find_all() and string_builder_replace_searched(), so
+// a pattern that is searched for many times is compiled once.
+//
+// Single characters are searched with memchr(), patterns of up to 16
+// characters by comparing their first and last character with 16 (SSE2)
+// or 32 (AVX2) positions at once. Longer patterns are found by their
+// first 16 characters the same way, until so many of those turn out not
+// to be followed by the rest of the pattern that the search goes on with
+// Two-Way, which the searcher is compiled for. Either way, the search time
+// is linear in the length of the string, whatever the pattern.
+//
+// The pattern is not copied, so it must outlive the searcher. Nothing is
+// allocated, so there's nothing to free. The pattern must not be empty.
+//
+//
+// Example:
+//
+// StringBuilderSearcher fish = string_builder_searcher_new("fish");
+StringBuilderSearcher string_builder_searcher_new(const char *pattern);
+
+// Returns the index of the first match of the searcher's pattern that
+// starts at `from` or after it, or STRING_BUILDER_NOT_FOUND.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("one fish, two fish");
+// StringBuilderSearcher fish = string_builder_searcher_new("fish");
+// string_builder_find(&builder, &fish, 0);  // 4
+// string_builder_find(&builder, &fish, 5);  // 14
+// string_builder_find(&builder, &fish, 15); // STRING_BUILDER_NOT_FOUND
+size_t                string_builder_find(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t from);
+
+// Returns the index of the last match of the searcher's pattern that ends
+// at `end` or before it, or STRING_BUILDER_NOT_FOUND. An `end` past the
+// length of the string searches the whole string.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("one fish, two fish");
+// StringBuilderSearcher fish = string_builder_searcher_new("fish");
+// string_builder_rfind(&builder, &fish, builder.length); // 14
+// string_builder_rfind(&builder, &fish, 14);             // 4
+// string_builder_rfind(&builder, &fish, 7);              // STRING_BUILDER_NOT_FOUND
+size_t                string_builder_rfind(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t end);
+
+// Puts the indices of the first `max_offsets` matches of the searcher's
+// pattern into `offsets`, and returns the number of all matches, so
+// a call with `max_offsets` of 0 counts them. Matches don't overlap.
+//
+//
+// Example:
+//
+// StringBuilder builder = string_builder_new_from("one fish, two fish, red fish");
+// StringBuilderSearcher fish = string_builder_searcher_new("fish");
+// size_t offsets[2];
+// size_t count = string_builder_find_all(&builder, &fish, offsets, 2);
+// count = 3, offsets = { 4, 14 }
+size_t                string_builder_find_all(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t *offsets, size_t max_offsets);
+
+// Compiles a `printf`-style format string into literal runs and typed
+// conversions for string_builder_append_compiled().
+// The format string is copied, so it doesn't have to outlive the result.
+//
+// Supported conversions are %d, %i, %u, %x, %X, %c, %s and %%, with the
+// `-` and `0` flags, a width, a precision, and the `l`, `ll` and `z` length
+// modifiers. As with `printf`, the precision is the maximum length of a %s
+// and the minimum number of digits of an integer, which then ignores the `0`
+// flag. Anything else, including a precision on %c, fails an assertion.
+//
+//
+// Example:
+//
+// StringBuilderFormat format = string_builder_format_compile("%s took %lu ms\n");
+// format = StringBuilderFormat{
+//      literals = " took  ms\n",
+//      fields = {
+//          { literal = "",       conversion = 's' },
+//          { literal = " took ", conversion = 'u', length_modifier = 'l' },
+//          { literal = " ms\n",  conversion = 0 },
+//      },
+// }
+StringBuilderFormat string_builder_format_compile(const char *format);
+
+// Frees the memory allocated for the compiled format.
+void                string_builder_format_free(StringBuilderFormat *format);
+
+// StringBuilderIov builds a string out of (pointer, length) segments
+// instead of one contiguous buffer, for output that is mostly made of data
+// that already sits in memory: cached headers, templates, parsed payloads.
+// Such data is appended by reference with string_builder_iov_append_ref()
+// and is never copied, it is handed to `writev` as is.
+//
+// Pieces shorter than STRING_BUILDER_IOV_COPY_THRESHOLD, and everything
+// added with the other append functions, are copied into a scratch arena
+// owned by the builder. Consecutive copies share one segment, so small
+// pieces don't turn into a long list of tiny writes.
+//
+//
+// Example:
+//
+// StringBuilderIov iov = string_builder_iov_new();
+// string_builder_iov_append_ref(&iov, cached_headers, cached_headers_length);
+// string_builder_iov_append(&iov, "Content-Length: ");
+// string_builder_iov_append_int(&iov, body_length);
+// string_builder_iov_append(&iov, "\r\n\r\n");
+// string_builder_iov_append_ref(&iov, body, body_length);
+// iov = StringBuilderIov{
+//      segments = {
+//          { data = cached_headers, length = cached_headers_length },
+//          { data = ???, length = 24 }, // "Content-Length: 1234\r\n\r\n" in the scratch arena
+//          { data = body, length = body_length },
+//      },
+//      segment_count = 3,
+//      length = cached_headers_length + 24 + body_length,
+// }
+// string_builder_iov_write(&iov, socket_fd);
+StringBuilderIov string_builder_iov_new();
+
+// Frees the segments and the scratch arena. The data appended by
+// reference belongs to the caller and isn't touched.
+void             string_builder_iov_free(StringBuilderIov *iov);
+
+// Empties the builder in O(1), keeping its memory for the next string.
+void             string_builder_iov_reset(StringBuilderIov *iov);
+
+// Copies `append_string` into the scratch arena and appends it.
+void             string_builder_iov_append(StringBuilderIov *iov, const char *append_string);
+
+// Copies `length` characters from `append_string` into the scratch arena
+// and appends them.
+void             string_builder_iov_append_n(StringBuilderIov *iov, const char *append_string, size_t length);
+
+// Appends `length` bytes at `data` without copying them, so they have to
+// stay alive and unchanged until the builder is written, flattened or
+// reset. Pieces shorter than STRING_BUILDER_IOV_COPY_THRESHOLD are copied
+// anyway, since a segment of their own would cost more than the copy.
+void             string_builder_iov_append_ref(StringBuilderIov *iov, const char *data, size_t length);
+
+// Appends a character `c`, see string_builder_iov_append_n().
+void             string_builder_iov_append_char(StringBuilderIov *iov, char c);
+
+// Appends the decimal representation of `value`, see string_builder_iov_append_n().
+void             string_builder_iov_append_int(StringBuilderIov *iov, int value);
+
+// Copies all the segments into a new StringBuilder with a single
+// allocation of exactly `iov.length + 1` bytes.
+StringBuilder    string_builder_iov_flatten(const StringBuilderIov *iov);
+
+// Writes all the segments to `fd` with `writev`, STRING_BUILDER_IOV_MAX
+// segments per call, and continues after partial writes.
+// Returns 0 on success or the `errno` of the failed write.
+#ifdef STRING_BUILDER_POSIX
+int              string_builder_iov_write(const StringBuilderIov *iov, int fd);
+#endif // STRING_BUILDER_POSIX
+
+// StringBuilderConcurrent is a builder that many threads append to at the
+// same time without a lock, for example a log buffer shared by workers.
+//
+// A producer reserves the bytes of its record with one atomic add and
+// copies the record into them while other producers copy theirs. The
+// bytes live in segments that double in size and are never moved, so a
+// producer that needs a new segment doesn't disturb the ones still
+// writing to the old ones.
+//
+// Readers only see `committed` bytes: a record becomes visible once it and
+// every record reserved before it are completely written, so half-written
+// records are never exposed. A producer marks the bytes it wrote in a
+// bitmap and then moves `committed` past every marked byte that follows
+// it. It never waits for other producers: when the one ahead of it hasn't
+// finished yet, that one will move `committed` past both records when it
+// does. The bitmap costs one byte of memory for every 8 bytes of records.
+//
+// Only appending and reading are thread-safe. Create the builder before
+// the producers start and free it after they are done. Declared where the
+// GCC/Clang __atomic builtins are available.
+//
+//
+// Example:
+//
+// StringBuilderConcurrent log = string_builder_concurrent_new();
+// // In every worker thread:
+// string_builder_concurrent_append(&log, "worker 1: done\n");
+// // In the thread that ships the log:
+// shipped = string_builder_concurrent_read(&log, shipped, &batch);
+// log = StringBuilderConcurrent{
+//      segments = { ???, NULL, ... }, // STRING_BUILDER_CONCURRENT_SEGMENT_SIZE bytes, then twice as many
+//      reserved = 15,
+//      committed = 15,
+// }
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilderConcurrent string_builder_concurrent_new();
+
+// Frees all the segments. No producer or reader may use the builder anymore.
+void                    string_builder_concurrent_free(StringBuilderConcurrent *builder);
+
+// Appends `append_string` as one record, see string_builder_concurrent_append_n().
+void                    string_builder_concurrent_append(StringBuilderConcurrent *builder, const char *append_string);
+
+// Appends `length` characters from `append_string` as one record: the
+// characters are contiguous in the result and never mixed with the ones
+// of other producers. Doesn't wait for other producers, so the record may
+// still be invisible to readers when this returns, until the records
+// reserved before it are written too.
+void                    string_builder_concurrent_append_n(StringBuilderConcurrent *builder, const char *append_string, size_t length);
+
+// Returns how many bytes are committed and can be read.
+size_t                  string_builder_concurrent_committed(const StringBuilderConcurrent *builder);
+
+// Appends the committed bytes from offset `from` on to `destination` and
+// returns the offset where they end, which is where the next read starts.
+// Can be called while producers are appending.
+size_t                  string_builder_concurrent_read(const StringBuilderConcurrent *builder, size_t from, StringBuilder *destination);
+
+// Copies the committed bytes into a new StringBuilder.
+StringBuilder           string_builder_concurrent_flatten(const StringBuilderConcurrent *builder);
+#endif // STRING_BUILDER_CONCURRENT
+
+// StringRope is an alternative to StringBuilder for strings that are edited
+// in the middle a lot. The text is kept in chunks of STRING_ROPE_CHUNK_SIZE
+// bytes that form a balanced tree (a treap ordered by text position), so
+// inserting or replacing anywhere costs O(log n) chunk operations instead of
+// moving the whole tail of the string.
+//
+// The string_rope_* functions mirror the string_builder_* ones. The text
+// isn't contiguous, so use string_rope_flatten() to get a StringBuilder
+// when a `char *` is needed.
+
+// Creates a new empty StringRope. No memory is allocated until
+// something is appended.
+//
+//
+// Example:
+//
+// StringRope rope = string_rope_new();
+// rope = StringRope{
+//      length = 0,
+//      root = NULL,
+// }
+StringRope    string_rope_new();
+
+// Creates a new StringRope holding a copy of `string`.
+//
+//
+// Example:
+//
+// StringRope rope = string_rope_new_from("Hello");
+// rope = StringRope{
+//      length = 5,
+//      root = ???, // One chunk with "Hello"
+// }
+StringRope    string_rope_new_from(const char *string);
+
+// Frees all the chunks of the rope and resets the length.
+// After calling string_rope_free(), the freed rope should
+// not be used anymore.
+void          string_rope_free(StringRope *rope);
+
+// Copies the text of the rope into a new StringBuilder.
+// Exactly `rope->length + 1` bytes are allocated.
+// The rope is left unchanged and still has to be freed.
+//
+//
+// Example:
+//
+// StringRope rope = string_rope_new_from("world");
+// string_rope_insert(&rope, 0, "hello ");
+// StringBuilder builder = string_rope_flatten(&rope);
+// builder = StringBuilder{
+//      length = 11,
+//      capacity = 12,
+//      string = "hello world\0",
+// }
+StringBuilder string_rope_flatten(const StringRope *rope);
+
+// Appends the `append_string` to the end of the rope.
+// Same as string_rope_insert(rope, rope->length, append_string).
+void string_rope_append(StringRope *rope, const char *append_string);
+
+// Appends `length` characters from `append_string` to the end of the rope.
+void string_rope_append_n(StringRope *rope, const char *append_string, size_t length);
+
+// Appends a character `c` to the end of the rope.
+void string_rope_append_char(StringRope *rope, char c);
+
+// Appends the string representation of an integer to the end of the rope.
+void string_rope_append_int(StringRope *rope, int value);
+
+// Appends a formatted string to the end of the rope.
+// The formats are the same formats that are supported in `printf`.
+// Short results are formatted on the stack; longer ones need a
+// temporary allocation.
+void string_rope_append_format(StringRope *rope, const char *format, ...);
+
+// Inserts `insertion` at `insert_index` in the rope.
+// Only the chunk that contains `insert_index` is split, the rest
+// of the text isn't moved.
+//
+//
+// Example:
+//
+// StringRope rope = string_rope_new();
+// string_rope_append(&rope, "world");
+// string_rope_insert(&rope, 0, "hello");
+// string_rope_insert(&rope, 5, " ");
+// rope = StringRope{
+//      length = 11,
+//      root = ???, // "hello world"
+// }
+void string_rope_insert(StringRope *rope, size_t insert_index, const char *insertion);
+
+// Inserts `length` characters from `insertion` at `insert_index` in the rope.
+void string_rope_insert_n(StringRope *rope, size_t insert_index, const char *insertion, size_t length);
+
+// Replaces `length` characters starting at `start` with `replacement`.
+// `replacement` may be shorter or longer than the replaced range.
+//
+//
+// Example:
+//
+// StringRope rope = string_rope_new_from("hello world");
+// string_rope_replace_range(&rope, 0, 5, "goodbye");
+// rope = StringRope{
+//      length = 13,
+//      root = ???, // "goodbye world"
+// }
+void string_rope_replace_range(StringRope *rope, size_t start, size_t length, const char *replacement);
+
+#ifdef STRING_BUILDER_IMPLEMENTATION
+
+#ifdef STRING_BUILDER_X86_SIMD
+// Picks the widest instruction set the CPU supports, once. Threads that
+// race to pick it all store the same value, so relaxed atomics are enough.
+int string_builder_simd_level() {
+    static int cached_level = -1;
+    int level = __atomic_load_n(&cached_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            level = STRING_BUILDER_SIMD_AVX2;
+        } else if (__builtin_cpu_supports("ssse3")) {
+            level = STRING_BUILDER_SIMD_SSSE3;
+        } else {
+            level = STRING_BUILDER_SIMD_SSE2;
+        }
+        __atomic_store_n(&cached_level, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+#ifdef STRING_BUILDER_STATS
+StringBuilderStats string_builder_global_stats;
+StringBuilderStatsCallback string_builder_stats_callback;
+void *string_builder_stats_callback_context;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STRING_BUILDER_ATOMIC_ADD(counter, amount) __atomic_fetch_add(&(counter), (amount), __ATOMIC_RELAXED)
+#define STRING_BUILDER_ATOMIC_LOAD(counter)        __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STRING_BUILDER_ATOMIC_STORE(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+#else
+// Without the builtins the process-wide counters are only exact in
+// single-threaded programs.
+#define STRING_BUILDER_ATOMIC_ADD(counter, amount) ((counter) += (amount))
+#define STRING_BUILDER_ATOMIC_LOAD(counter)        (counter)
+#define STRING_BUILDER_ATOMIC_STORE(counter, value) ((counter) = (value))
+#endif // __GNUC__ || __clang__
+
+#define STRING_BUILDER_STATS_INIT(builder) memset(&(builder)->stats, 0, sizeof (builder)->stats)
+#define STRING_BUILDER_STATS_ADD(builder, counter, amount) \
+    ((builder)->stats.counter += (amount), STRING_BUILDER_ATOMIC_ADD(string_builder_global_stats.counter, (uint64_t)(amount)))
+#define STRING_BUILDER_STATS_CAPACITY(builder) string_builder_stats_capacity(builder)
+#define STRING_BUILDER_STATS_TIMER(timer) uint64_t timer = string_builder_stats_now()
+#define STRING_BUILDER_STATS_ELAPSED(builder, counter, timer) STRING_BUILDER_STATS_ADD(builder, counter, string_builder_stats_now() - (timer))
+
+uint64_t string_builder_stats_now() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif // CLOCK_MONOTONIC
+}
+
+void string_builder_stats_capacity(StringBuilder *builder) {
+    uint64_t capacity = builder->capacity;
+    if (capacity > builder->stats.peak_capacity) {
+        builder->stats.peak_capacity = capacity;
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    uint64_t peak = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.peak_capacity);
+    while (capacity > peak && !__atomic_compare_exchange_n(&string_builder_global_stats.peak_capacity, &peak, capacity, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    if (capacity > string_builder_global_stats.peak_capacity) {
+        string_builder_global_stats.peak_capacity = capacity;
+    }
+#endif // __GNUC__ || __clang__
+}
+
+StringBuilderStats string_builder_stats_global() {
+    StringBuilderStats stats;
+    stats.allocations = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.allocations);
+    stats.reallocations = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.reallocations);
+    stats.growths = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.growths);
+    stats.bytes_copied = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.bytes_copied);
+    stats.bytes_moved = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.bytes_moved);
+    stats.replace_passes = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.replace_passes);
+    stats.peak_capacity = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.peak_capacity);
+    stats.replace_nanoseconds = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.replace_nanoseconds);
+    stats.format_nanoseconds = STRING_BUILDER_ATOMIC_LOAD(string_builder_global_stats.format_nanoseconds);
+    return stats;
+}
+
+void string_builder_stats_reset_global() {
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.allocations, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.reallocations, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.growths, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.bytes_copied, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.bytes_moved, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.replace_passes, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.peak_capacity, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.replace_nanoseconds, 0);
+    STRING_BUILDER_ATOMIC_STORE(string_builder_global_stats.format_nanoseconds, 0);
+}
+
+void string_builder_stats_set_callback(StringBuilderStatsCallback callback, void *context) {
+    string_builder_stats_callback = callback;
+    string_builder_stats_callback_context = context;
+}
+#else
+#define STRING_BUILDER_STATS_INIT(builder)                    ((void)0)
+#define STRING_BUILDER_STATS_ADD(builder, counter, amount)    ((void)0)
+#define STRING_BUILDER_STATS_CAPACITY(builder)                ((void)0)
+#define STRING_BUILDER_STATS_TIMER(timer)
+#define STRING_BUILDER_STATS_ELAPSED(builder, counter, timer) ((void)0)
+#endif // STRING_BUILDER_STATS
+
+// Makes the next string_builder_codepoint_count() count the whole string,
+// for the changes to it that aren't appends.
+void string_builder_forget_codepoints(StringBuilder *builder) {
+    builder->counted_length = 0;
+    builder->codepoint_count = 0;
+}
+
+void *string_builder_allocate(StringBuilder *builder, size_t size) {
+    STRING_BUILDER_STATS_ADD(builder, allocations, 1);
+    const StringBuilderAllocator *allocator = builder->allocator;
+    if (allocator == NULL) {
+        return STRING_BUILDER_MALLOC(size);
+    }
+    return allocator->allocate(allocator->context, size);
+}
+
+void *string_builder_reallocate(StringBuilder *builder, void *pointer, size_t old_size, size_t new_size) {
+    STRING_BUILDER_STATS_ADD(builder, reallocations, 1);
+    const StringBuilderAllocator *allocator = builder->allocator;
+    if (allocator == NULL) {
+        return STRING_BUILDER_REALLOC(pointer, new_size);
+    }
+    return allocator->reallocate(allocator->context, pointer, old_size, new_size);
+}
+
+void string_builder_deallocate(StringBuilder *builder, void *pointer, size_t size) {
+    const StringBuilderAllocator *allocator = builder->allocator;
+    if (allocator == NULL) {
+        STRING_BUILDER_FREE(pointer);
+    } else {
+        allocator->deallocate(allocator->context, pointer, size);
+    }
+}
+
+StringBuilder string_builder_new_with_allocator_and_capacity(const StringBuilderAllocator *allocator, size_t capacity) {
+    STRING_BUILDER_ASSERT(capacity > 0);
+
+    StringBuilder builder;
+    builder.length = 0;
+    builder.capacity = capacity;
+    builder.allocator = allocator;
+    builder.flags = 0;
+    builder.sink = NULL;
+    builder.growth = NULL;
+    builder.counted_length = 0;
+    builder.codepoint_count = 0;
+    STRING_BUILDER_STATS_INIT(&builder);
+
+    char *inner = (char *)string_builder_allocate(&builder, capacity * sizeof *inner);
+    *inner = '\0';
+    builder.string = inner;
+    STRING_BUILDER_STATS_CAPACITY(&builder);
+    return builder;
+}
+
+StringBuilder string_builder_new() {
+    return string_builder_new_with_capacity(STRING_BUILDER_DEFAULT_CAPACITY);
+}
+
+StringBuilder string_builder_new_with_capacity(size_t capacity) {
+    return string_builder_new_with_allocator_and_capacity(NULL, capacity);
+}
+
+StringBuilder string_builder_new_with_allocator(const StringBuilderAllocator *allocator) {
+    return string_builder_new_with_allocator_and_capacity(allocator, STRING_BUILDER_DEFAULT_CAPACITY);
+}
+
+StringBuilder string_builder_new_from_buffer(char *buffer, size_t capacity) {
+    STRING_BUILDER_ASSERT(capacity > 0);
+    *buffer = '\0';
+
+    StringBuilder builder;
+    builder.length = 0;
+    builder.capacity = capacity;
+    builder.string = buffer;
+    builder.allocator = NULL;
+    builder.flags = STRING_BUILDER_FLAG_BORROWED;
+    builder.sink = NULL;
+    builder.growth = NULL;
+    builder.counted_length = 0;
+    builder.codepoint_count = 0;
+    STRING_BUILDER_STATS_INIT(&builder);
+    STRING_BUILDER_STATS_CAPACITY(&builder);
+    return builder;
+}
+
+StringBuilder string_builder_new_streaming_to(int fd, void *file, size_t high_water_mark) {
+    STRING_BUILDER_ASSERT(high_water_mark > 0);
+
+    StringBuilder builder = string_builder_new_with_capacity(high_water_mark + 1);
+    StringBuilderSink *sink = (StringBuilderSink *)STRING_BUILDER_MALLOC(sizeof *sink);
+    sink->fd = fd;
+    sink->file = file;
+    sink->high_water_mark = high_water_mark;
+    sink->flushed_length = 0;
+    sink->error = 0;
+    builder.sink = sink;
+    return builder;
+}
+
+#ifdef STRING_BUILDER_POSIX
+StringBuilder string_builder_new_streaming(int fd, size_t high_water_mark) {
+    return string_builder_new_streaming_to(fd, NULL, high_water_mark);
+}
+#endif // STRING_BUILDER_POSIX
+
+#ifndef STRING_BUILDER_NO_FORMAT
+StringBuilder string_builder_new_streaming_file(FILE *file, size_t high_water_mark) {
+    return string_builder_new_streaming_to(-1, file, high_water_mark);
+}
+#endif // STRING_BUILDER_NO_FORMAT
+
+// Writes `first` and then `second` to the sink, with a single system call
+// when possible. Nothing is written after a write has failed.
+void string_builder_sink_write(StringBuilderSink *sink, const char *first, size_t first_length, const char *second, size_t second_length) {
+    if (sink->error != 0) {
+        return;
+    }
+
+#ifndef STRING_BUILDER_NO_FORMAT
+    if (sink->file != NULL) {
+        FILE *file = (FILE *)sink->file;
+        if (fwrite(first, 1, first_length, file) != first_length ||
+            (second_length > 0 && fwrite(second, 1, second_length, file) != second_length)) {
+            sink->error = -1;
+            return;
+        }
+        sink->flushed_length += first_length + second_length;
+        return;
+    }
+#endif // STRING_BUILDER_NO_FORMAT
+
+#ifdef STRING_BUILDER_POSIX
+    struct iovec pieces[2];
+    pieces[0].iov_base = (void *)first;
+    pieces[0].iov_len = first_length;
+    pieces[1].iov_base = (void *)second;
+    pieces[1].iov_len = second_length;
+
+    struct iovec *piece = pieces;
+    int piece_count = 2;
+    while (piece_count > 0) {
+        if (piece->iov_len == 0) {
+            piece++;
+            piece_count--;
+            continue;
+        }
+
+        ssize_t written = writev(sink->fd, piece, piece_count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sink->error = errno;
+            return;
+        }
+
+        // Partial writes leave the rest for the next round.
+        sink->flushed_length += written;
+        while (piece_count > 0 && (size_t)written >= piece->iov_len) {
+            written -= piece->iov_len;
+            piece++;
+            piece_count--;
+        }
+        if (piece_count > 0) {
+            piece->iov_base = (char *)piece->iov_base + written;
+            piece->iov_len -= written;
+        }
+    }
+#endif // STRING_BUILDER_POSIX
+}
+
+#ifdef STRING_BUILDER_MAPPED
+#define STRING_BUILDER_MAPPED_CAPACITY (64 * 1024)
+void *string_builder_mapping_allocate(void *context, size_t size) {
+    StringBuilderMapping *mapping = (StringBuilderMapping *)context;
+    STRING_BUILDER_ASSERT(mapping->data == NULL && "a mapped builder can only map one string at a time");
+
+    if (ftruncate(mapping->fd, size) != 0) {
+        return NULL;
+    }
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapping->fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    mapping->data = (char *)data;
+    mapping->size = size;
+    return data;
+}
+
+void *string_builder_mapping_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+    StringBuilderMapping *mapping = (StringBuilderMapping *)context;
+    if (ftruncate(mapping->fd, new_size) != 0) {
+        return NULL;
+    }
+
+    // The contents are in the file, so even without mremap()
+    // nothing has to be copied.
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+    void *data = mremap(pointer, old_size, new_size, MREMAP_MAYMOVE);
+#else
+    munmap(pointer, old_size);
+    void *data = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, mapping->fd, 0);
+#endif // __linux__ && MREMAP_MAYMOVE
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    mapping->data = (char *)data;
+    mapping->size = new_size;
+    return data;
+}
+
+void string_builder_mapping_deallocate(void *context, void *pointer, size_t size) {
+    StringBuilderMapping *mapping = (StringBuilderMapping *)context;
+    munmap(pointer, size);
+    mapping->data = NULL;
+    mapping->size = 0;
+}
+
+int string_builder_is_mapped(const StringBuilder *builder) {
+    return builder->allocator != NULL && builder->allocator->allocate == string_builder_mapping_allocate;
+}
+
+StringBuilder string_builder_new_mapped(const char *path) {
+    StringBuilder builder;
+    builder.length = 0;
+    builder.capacity = 0;
+    builder.string = NULL;
+    builder.allocator = NULL;
+    builder.flags = 0;
+    builder.sink = NULL;
+    builder.growth = NULL;
+    builder.counted_length = 0;
+    builder.codepoint_count = 0;
+    STRING_BUILDER_STATS_INIT(&builder);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return builder;
+    }
+
+    StringBuilderMapping *mapping = (StringBuilderMapping *)STRING_BUILDER_MALLOC(sizeof *mapping);
+    mapping->allocator.allocate = string_builder_mapping_allocate;
+    mapping->allocator.reallocate = string_builder_mapping_reallocate;
+    mapping->allocator.deallocate = string_builder_mapping_deallocate;
+    mapping->allocator.context = mapping;
+    mapping->fd = fd;
+    mapping->data = NULL;
+    mapping->size = 0;
+
+    char *inner = (char *)string_builder_mapping_allocate(mapping, STRING_BUILDER_MAPPED_CAPACITY);
+    if (inner == NULL) {
+        close(fd);
+        STRING_BUILDER_FREE(mapping);
+        return builder;
+    }
+
+    *inner = '\0';
+    builder.capacity = STRING_BUILDER_MAPPED_CAPACITY;
+    builder.string = inner;
+    builder.allocator = &mapping->allocator;
+    STRING_BUILDER_STATS_ADD(&builder, allocations, 1);
+    STRING_BUILDER_STATS_CAPACITY(&builder);
+    return builder;
+}
+
+int string_builder_mapped_sync(StringBuilder *builder) {
+    STRING_BUILDER_ASSERT(string_builder_is_mapped(builder));
+    if (builder->string != NULL && msync(builder->string, builder->capacity, MS_SYNC) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
+int string_builder_mapped_finish(StringBuilder *builder) {
+    STRING_BUILDER_ASSERT(string_builder_is_mapped(builder));
+    StringBuilderMapping *mapping = (StringBuilderMapping *)builder->allocator->context;
+    int error = 0;
+
+    if (mapping->data != NULL && munmap(mapping->data, mapping->size) != 0) {
+        error = errno;
+    }
+    if (ftruncate(mapping->fd, builder->length) != 0 && error == 0) {
+        error = errno;
+    }
+    if (close(mapping->fd) != 0 && error == 0) {
+        error = errno;
+    }
+    STRING_BUILDER_FREE(mapping);
+
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->string = NULL;
+    builder->allocator = NULL;
+    string_builder_forget_codepoints(builder);
+    return error;
+}
+#endif // STRING_BUILDER_MAPPED
+
+int string_builder_flush(StringBuilder *builder) {
+    StringBuilderSink *sink = builder->sink;
+    if (sink == NULL) {
+        return 0;
+    }
+
+    string_builder_sink_write(sink, builder->string, builder->length, NULL, 0);
+    builder->length = 0;
+    builder->string[0] = '\0';
+    string_builder_forget_codepoints(builder);
+    return sink->error;
+}
+
+StringBuilder string_builder_new_from(const char *string) {
+    size_t length = strlen(string);
+    StringBuilder builder = string_builder_new_with_capacity(length + 1);
+    memcpy(builder.string, string, length + 1);
+    builder.length = length;
+    return builder;
+}
+
+#ifdef STRING_BUILDER_CONCURRENT
+// Kept in the buffer of a shared string, right after the part of it that
+// the sharing builders see.
+typedef struct {
+    size_t references; // Builders sharing the string
+    size_t capacity;   // Of the whole buffer
+} StringBuilderShared;
+
+StringBuilderShared *string_builder_shared(const StringBuilder *builder) {
+    // The capacity of a sharing builder is its length, so this is after
+    // the null terminator.
+    uintptr_t end = (uintptr_t)(builder->string + builder->capacity + 1);
+    return (StringBuilderShared *)((end + sizeof(size_t) - 1) & ~(uintptr_t)(sizeof(size_t) - 1));
+}
+
+// Stops sharing the string, and frees it if no other builder shares it.
+void string_builder_unreference(StringBuilder *builder) {
+    StringBuilderShared *shared = string_builder_shared(builder);
+    // Read first, the buffer may be freed by another builder right after.
+    size_t capacity = shared->capacity;
+    if (__atomic_sub_fetch(&shared->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        string_builder_deallocate(builder, builder->string, capacity);
+    }
+    builder->flags &= ~STRING_BUILDER_FLAG_SHARED;
+}
+
+// Takes the whole buffer of a shared string back if the builders it was
+// shared with are gone. Returns 0 if they aren't.
+int string_builder_reclaim(StringBuilder *builder) {
+    StringBuilderShared *shared = string_builder_shared(builder);
+    if (__atomic_load_n(&shared->references, __ATOMIC_ACQUIRE) != 1) {
+        return 0;
+    }
+    builder->capacity = shared->capacity;
+    builder->flags &= ~STRING_BUILDER_FLAG_SHARED;
+    return 1;
+}
+#endif // STRING_BUILDER_CONCURRENT
+
+// Gives the memory of the string back, unless it belongs to the caller
+// or has already been released.
+void string_builder_deallocate_string(StringBuilder *builder) {
+#ifdef STRING_BUILDER_CONCURRENT
+    if (builder->flags & STRING_BUILDER_FLAG_SHARED) {
+        string_builder_unreference(builder);
+        return;
+    }
+#endif // STRING_BUILDER_CONCURRENT
+    if (builder->string != NULL && !(builder->flags & STRING_BUILDER_FLAG_BORROWED)) {
+        string_builder_deallocate(builder, builder->string, builder->capacity);
+    }
+    builder->flags &= ~STRING_BUILDER_FLAG_BORROWED;
+}
+
+void string_builder_free(StringBuilder *builder) {
+#ifdef STRING_BUILDER_STATS
+    if (string_builder_stats_callback != NULL) {
+        string_builder_stats_callback(builder, string_builder_stats_callback_context);
+    }
+#endif // STRING_BUILDER_STATS
+
+#ifdef STRING_BUILDER_MAPPED
+    if (string_builder_is_mapped(builder)) {
+        string_builder_mapped_finish(builder);
+        return;
+    }
+#endif // STRING_BUILDER_MAPPED
+
+    if (builder->sink != NULL) {
+        string_builder_flush(builder);
+        STRING_BUILDER_FREE(builder->sink);
+        builder->sink = NULL;
+    }
+
+    string_builder_deallocate_string(builder);
+    builder->length = 0;
+    builder->capacity = 0;
+    string_builder_forget_codepoints(builder);
+}
+
+void string_builder_clear(StringBuilder *builder) {
+    builder->length = 0;
+    string_builder_forget_codepoints(builder);
+#ifdef STRING_BUILDER_CONCURRENT
+    if ((builder->flags & STRING_BUILDER_FLAG_SHARED) && !string_builder_reclaim(builder)) {
+        // None of the shared string is kept, so none of it is copied.
+        string_builder_unreference(builder);
+        builder->string = (char *)string_builder_allocate(builder, STRING_BUILDER_DEFAULT_CAPACITY);
+        builder->capacity = STRING_BUILDER_DEFAULT_CAPACITY;
+        STRING_BUILDER_STATS_CAPACITY(builder);
+    }
+#endif // STRING_BUILDER_CONCURRENT
+    if (builder->string != NULL) {
+        builder->string[0] = '\0';
+    }
+}
+
+char *string_builder_release(StringBuilder *builder) {
+    STRING_BUILDER_ASSERT(builder->sink == NULL && "a streaming builder doesn't have the whole string");
+#ifdef STRING_BUILDER_MAPPED
+    STRING_BUILDER_ASSERT(!string_builder_is_mapped(builder) && "the string of a mapped builder is the file");
+#endif // STRING_BUILDER_MAPPED
+
+    char *string = builder->string;
+    if (builder->flags & (STRING_BUILDER_FLAG_BORROWED | STRING_BUILDER_FLAG_SHARED)) {
+        string = (char *)string_builder_allocate(builder, builder->length + 1);
+        memcpy(string, builder->string, builder->length + 1);
+        STRING_BUILDER_STATS_ADD(builder, bytes_copied, builder->length + 1);
+        string_builder_deallocate_string(builder);
+    }
+
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->string = NULL;
+    string_builder_forget_codepoints(builder);
+    return string;
+}
+
+size_t string_builder_growth_geometric(size_t capacity, size_t expected_length) {
+    if (capacity == 0) {
+        // A released or moved-from builder starts over.
+        capacity = STRING_BUILDER_DEFAULT_CAPACITY;
+    }
+    while (expected_length >= capacity) {
+        capacity *= STRING_BUILDER_RESIZE_FACTOR;
+    }
+    return capacity;
+}
+
+size_t string_builder_growth_one_and_half(size_t capacity, size_t expected_length) {
+    if (capacity < STRING_BUILDER_DEFAULT_CAPACITY) {
+        // Small capacities would barely grow.
+        capacity = STRING_BUILDER_DEFAULT_CAPACITY;
+    }
+    while (expected_length >= capacity) {
+        capacity += capacity / 2;
+    }
+    return capacity;
+}
+
+size_t string_builder_growth_paged(size_t capacity, size_t expected_length) {
+    capacity = string_builder_growth_geometric(capacity, expected_length);
+    if (capacity < STRING_BUILDER_PAGE_SIZE) {
+        return capacity;
+    }
+
+    size_t page_size = capacity >= STRING_BUILDER_HUGE_PAGE_SIZE ? STRING_BUILDER_HUGE_PAGE_SIZE : STRING_BUILDER_PAGE_SIZE;
+    return (capacity + page_size - 1) & ~(page_size - 1);
+}
+
+// Moves the string into `new_capacity` bytes, which must fit it.
+void string_builder_resize(StringBuilder *builder, size_t new_capacity) {
+    if (new_capacity > builder->capacity) {
+        STRING_BUILDER_STATS_ADD(builder, growths, 1);
+    }
+
+#ifdef STRING_BUILDER_CONCURRENT
+    if ((builder->flags & STRING_BUILDER_FLAG_SHARED) && !string_builder_reclaim(builder)) {
+        char *new_string = (char *)string_builder_allocate(builder, new_capacity);
+        memcpy(new_string, builder->string, builder->length + 1);
+        STRING_BUILDER_STATS_ADD(builder, bytes_copied, builder->length + 1);
+        string_builder_unreference(builder);
+        builder->capacity = new_capacity;
+        builder->string = new_string;
+        STRING_BUILDER_STATS_CAPACITY(builder);
+        return;
+    }
+#endif // STRING_BUILDER_CONCURRENT
+
+    char *new_string;
+    if (builder->flags & STRING_BUILDER_FLAG_BORROWED) {
+        // The caller's buffer can't be resized, move the string to the heap.
+        new_string = (char *)string_builder_allocate(builder, new_capacity);
+        memcpy(new_string, builder->string, builder->length + 1);
+        STRING_BUILDER_STATS_ADD(builder, bytes_copied, builder->length + 1);
+        builder->flags &= ~STRING_BUILDER_FLAG_BORROWED;
+    } else if (builder->string == NULL) {
+        new_string = (char *)string_builder_allocate(builder, new_capacity);
+        *new_string = '\0';
+    } else {
+#ifdef STRING_BUILDER_STATS
+        // Only the address can be compared once the old buffer is freed.
+        uintptr_t old_address = (uintptr_t)builder->string;
+#endif // STRING_BUILDER_STATS
+        new_string = (char *)string_builder_reallocate(builder, builder->string, builder->capacity, new_capacity);
+#ifdef STRING_BUILDER_STATS
+        if ((uintptr_t)new_string != old_address) {
+            STRING_BUILDER_STATS_ADD(builder, bytes_copied, builder->length + 1);
+        }
+#endif // STRING_BUILDER_STATS
+    }
+
+    builder->capacity = new_capacity;
+    builder->string = new_string;
+    STRING_BUILDER_STATS_CAPACITY(builder);
+}
+
+void string_builder_ensure_capacity(StringBuilder *builder, size_t expected_length) {
+    // Kept small so that it's inlined into the appends, and the ones that
+    // fit don't make a single call.
+    if (expected_length < builder->capacity) {
+        return;
+    }
+#ifdef STRING_BUILDER_CONCURRENT
+    if ((builder->flags & STRING_BUILDER_FLAG_SHARED) && string_builder_reclaim(builder) && expected_length < builder->capacity) {
+        // The other builders are gone and the whole buffer has room.
+        return;
+    }
+#endif // STRING_BUILDER_CONCURRENT
+
+    StringBuilderGrowthPolicy growth = builder->growth != NULL ? builder->growth : string_builder_growth_geometric;
+    string_builder_resize(builder, growth(builder->capacity, expected_length));
+}
+
+void string_builder_reserve_exact(StringBuilder *builder, size_t expected_length) {
+    if (expected_length >= builder->capacity) {
+        string_builder_resize(builder, expected_length + 1);
+    }
+}
+
+void string_builder_shrink_to_fit(StringBuilder *builder) {
+    if (builder->string != NULL && !(builder->flags & STRING_BUILDER_FLAG_BORROWED) && builder->capacity > builder->length + 1) {
+        string_builder_resize(builder, builder->length + 1);
+    }
+}
+
+// Prepares the string to be changed in place rather than appended to:
+// a builder that shares it gets a copy of its own, and the code points
+// are counted again.
+void string_builder_begin_edit(StringBuilder *builder) {
+    string_builder_forget_codepoints(builder);
+#ifdef STRING_BUILDER_CONCURRENT
+    if ((builder->flags & STRING_BUILDER_FLAG_SHARED) && !string_builder_reclaim(builder)) {
+        string_builder_resize(builder, builder->length + 1);
+    }
+#endif // STRING_BUILDER_CONCURRENT
+}
+
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilder string_builder_snapshot(StringBuilder *builder) {
+    STRING_BUILDER_ASSERT(builder->sink == NULL && "a streaming builder doesn't have the whole string");
+#ifdef STRING_BUILDER_MAPPED
+    STRING_BUILDER_ASSERT(!string_builder_is_mapped(builder) && "a mapped builder can't share its file");
+#endif // STRING_BUILDER_MAPPED
+
+    if (!(builder->flags & STRING_BUILDER_FLAG_SHARED)) {
+        // Room for the string, the reference count after it and the
+        // padding in between. Released strings and the ones in the
+        // caller's buffers are moved to a buffer of the builder's own.
+        size_t shared_capacity = builder->length + 1 + sizeof(size_t) - 1 + sizeof(StringBuilderShared);
+        if (builder->string == NULL || (builder->flags & STRING_BUILDER_FLAG_BORROWED) || builder->capacity < shared_capacity) {
+            string_builder_resize(builder, shared_capacity);
+        }
+        size_t capacity = builder->capacity;
+        builder->capacity = builder->length;
+        StringBuilderShared *shared = string_builder_shared(builder);
+        shared->references = 1;
+        shared->capacity = capacity;
+        builder->flags |= STRING_BUILDER_FLAG_SHARED;
+    }
+
+    // The caller holds a reference already, so nothing can free the string
+    // in between and the order doesn't matter.
+    __atomic_fetch_add(&string_builder_shared(builder)->references, 1, __ATOMIC_RELAXED);
+    StringBuilder snapshot = *builder;
+    STRING_BUILDER_STATS_INIT(&snapshot);
+    return snapshot;
+}
+#endif // STRING_BUILDER_CONCURRENT
+
+#ifdef STRING_BUILDER_PAGES
+void *string_builder_pages_allocate(void *context, size_t size) {
+    (void)context;
+    void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return pages != MAP_FAILED ? pages : NULL;
+}
+
+void *string_builder_pages_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+    (void)context;
+    void *pages = mremap(pointer, old_size, new_size, MREMAP_MAYMOVE);
+    return pages != MAP_FAILED ? pages : NULL;
+#else
+    void *pages = string_builder_pages_allocate(context, new_size);
+    if (pages != NULL) {
+        memcpy(pages, pointer, old_size < new_size ? old_size : new_size);
+        munmap(pointer, old_size);
+    }
+    return pages;
+#endif // __linux__ && MREMAP_MAYMOVE
+}
+
+void string_builder_pages_deallocate(void *context, void *pointer, size_t size) {
+    (void)context;
+    munmap(pointer, size);
+}
+
+const StringBuilderAllocator string_builder_page_allocator = {
+    string_builder_pages_allocate,
+    string_builder_pages_reallocate,
+    string_builder_pages_deallocate,
+    NULL,
+};
+#endif // STRING_BUILDER_PAGES
+
+size_t string_builder_align(size_t size) {
+    return (size + STRING_BUILDER_ARENA_ALIGNMENT - 1) & ~(size_t)(STRING_BUILDER_ARENA_ALIGNMENT - 1);
+}
+
+// The usable memory of a block starts right after its (aligned) header.
+char *string_builder_arena_block_data(StringBuilderArenaBlock *block) {
+    return (char *)block + string_builder_align(sizeof *block);
+}
+
+void *string_builder_arena_allocate(void *context, size_t size) {
+    StringBuilderArena *arena = (StringBuilderArena *)context;
+    size_t offset = string_builder_align(arena->offset);
+
+    if (offset + size > arena->current->capacity) {
+        // Reuse the blocks kept by string_builder_arena_reset() when they
+        // are big enough, otherwise put a new block right after the current one.
+        StringBuilderArenaBlock *next = arena->current->next;
+        if (next == NULL || next->capacity < size) {
+            size_t capacity = size > arena->block_size ? size : arena->block_size;
+            StringBuilderArenaBlock *block = (StringBuilderArenaBlock *)STRING_BUILDER_MALLOC(string_builder_align(sizeof *block) + capacity);
+            block->capacity = capacity;
+            block->next = next;
+            arena->current->next = block;
+            next = block;
+        }
+        arena->current = next;
+        offset = 0;
+    }
+
+    char *allocation = string_builder_arena_block_data(arena->current) + offset;
+    arena->offset = offset + size;
+    arena->last_allocation = allocation;
+    return allocation;
+}
+
+void *string_builder_arena_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+    StringBuilderArena *arena = (StringBuilderArena *)context;
+
+    if (pointer == arena->last_allocation) {
+        size_t offset = (char *)pointer - string_builder_arena_block_data(arena->current);
+        if (offset + new_size <= arena->current->capacity) {
+            arena->offset = offset + new_size;
+            return pointer;
+        }
+    }
+
+    void *allocation = string_builder_arena_allocate(context, new_size);
+    memcpy(allocation, pointer, old_size < new_size ? old_size : new_size);
+    return allocation;
+}
+
+void string_builder_arena_deallocate(void *context, void *pointer, size_t size) {
+    StringBuilderArena *arena = (StringBuilderArena *)context;
+    (void)size;
+
+    if (pointer == arena->last_allocation) {
+        arena->offset = (char *)pointer - string_builder_arena_block_data(arena->current);
+        arena->last_allocation = NULL;
+    }
+}
+
+StringBuilderArena *string_builder_arena_new(size_t block_size) {
+    STRING_BUILDER_ASSERT(block_size > 0);
+
+    // The arena and its first block share one allocation.
+    size_t header_size = string_builder_align(sizeof(StringBuilderArena));
+    StringBuilderArena *arena = (StringBuilderArena *)STRING_BUILDER_MALLOC(header_size + string_builder_align(sizeof(StringBuilderArenaBlock)) + block_size);
+    StringBuilderArenaBlock *first = (StringBuilderArenaBlock *)((char *)arena + header_size);
+    first->next = NULL;
+    first->capacity = block_size;
+
+    arena->allocator.allocate = string_builder_arena_allocate;
+    arena->allocator.reallocate = string_builder_arena_reallocate;
+    arena->allocator.deallocate = string_builder_arena_deallocate;
+    arena->allocator.context = arena;
+    arena->first = first;
+    arena->current = first;
+    arena->offset = 0;
+    arena->last_allocation = NULL;
+    arena->block_size = block_size;
+    return arena;
+}
+
+void string_builder_arena_reset(StringBuilderArena *arena) {
+    arena->current = arena->first;
+    arena->offset = 0;
+    arena->last_allocation = NULL;
+}
+
+void string_builder_arena_free(StringBuilderArena *arena) {
+    StringBuilderArenaBlock *block = arena->first->next;
+    while (block != NULL) {
+        StringBuilderArenaBlock *next = block->next;
+        STRING_BUILDER_FREE(block);
+        block = next;
+    }
+    STRING_BUILDER_FREE(arena);
+}
+
+#ifdef STRING_BUILDER_THREADS
+StringBuilder *string_builder_pool_cache_builders(StringBuilderPoolCache *cache) {
+    return (StringBuilder *)(cache + 1);
+}
+
+void string_builder_pool_add_stats(StringBuilderPoolStats *total, const StringBuilderPoolStats *stats) {
+    total->hits += __atomic_load_n(&stats->hits, __ATOMIC_RELAXED);
+    total->misses += __atomic_load_n(&stats->misses, __ATOMIC_RELAXED);
+    total->trims += __atomic_load_n(&stats->trims, __ATOMIC_RELAXED);
+    total->discards += __atomic_load_n(&stats->discards, __ATOMIC_RELAXED);
+}
+
+// Counters are written by their thread only, and read by
+// string_builder_pool_stats() from any thread.
+#define STRING_BUILDER_POOL_COUNT(cache, counter) \
+    __atomic_store_n(&(cache)->stats.counter, (cache)->stats.counter + 1, __ATOMIC_RELAXED)
+
+void string_builder_pool_cache_free(StringBuilderPoolCache *cache) {
+    StringBuilder *builders = string_builder_pool_cache_builders(cache);
+    for (size_t i = 0; i < cache->count; i++) {
+        string_builder_free(&builders[i]);
+    }
+    STRING_BUILDER_FREE(cache);
+}
+
+// Runs when a thread that used the pool exits.
+void string_builder_pool_cache_exit(void *argument) {
+    StringBuilderPoolCache *cache = (StringBuilderPoolCache *)argument;
+    StringBuilderPool *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (cache->previous != NULL) {
+        cache->previous->next = cache->next;
+    } else {
+        pool->caches = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->previous = cache->previous;
+    }
+    string_builder_pool_add_stats(&pool->exited_stats, &cache->stats);
+    pthread_mutex_unlock(&pool->mutex);
+
+    string_builder_pool_cache_free(cache);
+}
+
+StringBuilderPoolCache *string_builder_pool_cache(StringBuilderPool *pool) {
+    StringBuilderPoolCache *cache = (StringBuilderPoolCache *)pthread_getspecific(pool->key);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = (StringBuilderPoolCache *)STRING_BUILDER_MALLOC(sizeof *cache + pool->cache_size * sizeof(StringBuilder));
+    memset(cache, 0, sizeof *cache);
+    cache->pool = pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    cache->next = pool->caches;
+    if (pool->caches != NULL) {
+        pool->caches->previous = cache;
+    }
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_setspecific(pool->key, cache);
+    return cache;
+}
+
+StringBuilderPool *string_builder_pool_new(size_t initial_capacity, size_t max_capacity, size_t cache_size) {
+    STRING_BUILDER_ASSERT(initial_capacity > 0 && initial_capacity <= max_capacity);
+
+    StringBuilderPool *pool = (StringBuilderPool *)STRING_BUILDER_MALLOC(sizeof *pool);
+    pool->initial_capacity = initial_capacity;
+    pool->max_capacity = max_capacity;
+    pool->cache_size = cache_size;
+    pthread_key_create(&pool->key, string_builder_pool_cache_exit);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->caches = NULL;
+    memset(&pool->exited_stats, 0, sizeof pool->exited_stats);
+    return pool;
+}
+
+void string_builder_pool_free(StringBuilderPool *pool) {
+    // Without the key the exit handlers don't run anymore, so the caches
+    // of the threads that are still alive are freed here too.
+    pthread_key_delete(pool->key);
+
+    StringBuilderPoolCache *cache = pool->caches;
+    while (cache != NULL) {
+        StringBuilderPoolCache *next = cache->next;
+        string_builder_pool_cache_free(cache);
+        cache = next;
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    STRING_BUILDER_FREE(pool);
+}
+
+StringBuilder string_builder_pool_acquire(StringBuilderPool *pool) {
+    StringBuilderPoolCache *cache = string_builder_pool_cache(pool);
+    if (cache->count == 0) {
+        STRING_BUILDER_POOL_COUNT(cache, misses);
+        return string_builder_new_with_capacity(pool->initial_capacity);
+    }
+
+    STRING_BUILDER_POOL_COUNT(cache, hits);
+    cache->count--;
+    return string_builder_pool_cache_builders(cache)[cache->count];
+}
+
+void string_builder_pool_release(StringBuilderPool *pool, StringBuilder *builder) {
+    StringBuilderPoolCache *cache = string_builder_pool_cache(pool);
+    int reusable = builder->string != NULL && builder->allocator == NULL && builder->sink == NULL && !(builder->flags & (STRING_BUILDER_FLAG_BORROWED | STRING_BUILDER_FLAG_SHARED));
+    if (!reusable || cache->count == cache->pool->cache_size) {
+        STRING_BUILDER_POOL_COUNT(cache, discards);
+        string_builder_free(builder);
+        builder->string = NULL;
+        return;
+    }
+
+    if (builder->capacity > pool->max_capacity) {
+        STRING_BUILDER_POOL_COUNT(cache, trims);
+        builder->length = 0;
+        string_builder_resize(builder, pool->max_capacity);
+    }
+    string_builder_clear(builder);
+    builder->growth = NULL;
+
+    string_builder_pool_cache_builders(cache)[cache->count++] = *builder;
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->string = NULL;
+}
+
+StringBuilderPoolStats string_builder_pool_stats(StringBuilderPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    StringBuilderPoolStats stats = pool->exited_stats;
+    for (StringBuilderPoolCache *cache = pool->caches; cache != NULL; cache = cache->next) {
+        string_builder_pool_add_stats(&stats, &cache->stats);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return stats;
+}
+#endif // STRING_BUILDER_THREADS
+
+void string_builder_append(StringBuilder *builder, const char *string) {
+    string_builder_append_n(builder, string, strlen(string));
+}
+
+// Makes room for `appended_length` more characters. A streaming builder
+// writes its string out first if it would pass the high-water mark, so
+// builder->length has to be read after the call.
+void string_builder_reserve_append(StringBuilder *builder, size_t appended_length) {
+    StringBuilderSink *sink = builder->sink;
+    if (sink != NULL && builder->length + appended_length > sink->high_water_mark) {
+        string_builder_flush(builder);
+    }
+    string_builder_ensure_capacity(builder, builder->length + appended_length);
+}
+
+void string_builder_append_n(StringBuilder *builder, const char *string, size_t length) {
+    StringBuilderSink *sink = builder->sink;
+    if (sink != NULL && length >= sink->high_water_mark) {
+        // Copying it into the buffer would only make the buffer grow.
+        string_builder_sink_write(sink, builder->string, builder->length, string, length);
+        builder->length = 0;
+        builder->string[0] = '\0';
+        string_builder_forget_codepoints(builder);
+        return;
+    }
+
+    string_builder_reserve_append(builder, length);
+    size_t old_length = builder->length;
+    size_t new_length = old_length + length;
+
+    char *inner_end = builder->string + old_length;
+    memcpy(inner_end, string, length);
+
+    builder->string[new_length] = '\0';
+    builder->length = new_length;
+}
+
+void string_builder_append_char(StringBuilder *builder, char c) {
+    string_builder_reserve_append(builder, 1);
+    size_t old_length = builder->length;
+    size_t new_length = old_length + 1;
+
+    char *inner = builder->string;
+    inner[old_length] = c;
+    inner[new_length] = '\0';
+    builder->length = new_length;
+}
+
+// Grows the string by `length` characters and returns a pointer to them,
+// so they can be written in place. The new characters are uninitialized,
+// but the string is already null terminated after them.
+char *string_builder_extend(StringBuilder *builder, size_t length) {
+    string_builder_reserve_append(builder, length);
+    size_t old_length = builder->length;
+    size_t new_length = old_length + length;
+
+    builder->string[new_length] = '\0';
+    builder->length = new_length;
+    return builder->string + old_length;
+}
+
+StringSlice string_slice_from(const char *string) {
+    StringSlice slice = { string, strlen(string) };
+    return slice;
+}
+
+// Appends the slices with `separator` between them, after reserving
+// memory for all of them at once.
+void string_builder_join_n(StringBuilder *builder, const StringSlice *slices, size_t count, const char *separator, size_t separator_length) {
+    if (count == 0) {
+        return;
+    }
+    size_t length = separator_length * (count - 1);
+    for (size_t i = 0; i < count; i++) {
+        length += slices[i].length;
+    }
+
+    StringBuilderSink *sink = builder->sink;
+    if (sink != NULL && length >= sink->high_water_mark) {
+        // Let string_builder_append_n() write the large ones straight out.
+        for (size_t i = 0; i < count; i++) {
+            if (i != 0) {
+                string_builder_append_n(builder, separator, separator_length);
+            }
+            string_builder_append_n(builder, slices[i].data, slices[i].length);
+        }
+        return;
+    }
+
+    char *destination = string_builder_extend(builder, length);
+    memcpy(destination, slices[0].data, slices[0].length);
+    destination += slices[0].length;
+    if (separator_length == 0) {
+        for (size_t i = 1; i < count; i++) {
+            memcpy(destination, slices[i].data, slices[i].length);
+            destination += slices[i].length;
+        }
+        return;
+    }
+    for (size_t i = 1; i < count; i++) {
+        memcpy(destination, separator, separator_length);
+        destination += separator_length;
+        memcpy(destination, slices[i].data, slices[i].length);
+        destination += slices[i].length;
+    }
+}
+
+void string_builder_append_many(StringBuilder *builder, const StringSlice *slices, size_t count) {
+    string_builder_join_n(builder, slices, count, "", 0);
+}
+
+void string_builder_join(StringBuilder *builder, const StringSlice *slices, size_t count, const char *separator) {
+    string_builder_join_n(builder, slices, count, separator, strlen(separator));
+}
+
+// The strings passed to string_builder_append_strings() are measured and
+// appended this many at a time.
+#define STRING_BUILDER_STRINGS_BATCH 16
+
+void string_builder_append_strings(StringBuilder *builder, ...) {
+    StringSlice slices[STRING_BUILDER_STRINGS_BATCH];
+    size_t count = 0;
+
+    va_list arg_list;
+    va_start(arg_list, builder);
+    for (const char *string = va_arg(arg_list, const char *); string != NULL; string = va_arg(arg_list, const char *)) {
+        if (count == STRING_BUILDER_STRINGS_BATCH) {
+            string_builder_append_many(builder, slices, count);
+            count = 0;
+        }
+        slices[count++] = string_slice_from(string);
+    }
+    va_end(arg_list);
+
+    string_builder_append_many(builder, slices, count);
+}
+
+// -2147483648
+#define STRING_BUILDER_MAX_CHARS_IN_INT 11
+void string_builder_append_int(StringBuilder *builder, int value) {
+    string_builder_append_i64(builder, value);
+}
+
+int string_builder_bit_width(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 64 - __builtin_clzll(value | 1);
+#else
+    int width = 1;
+    while (value >>= 1) {
+        width++;
+    }
+    return width;
+#endif
+}
+
+const uint64_t string_builder_powers_of_10[20] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+const char string_builder_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+const char string_builder_hex_digits[17] = "0123456789abcdef";
+
+// Returns the number of decimal digits of `value`.
+// 1233 / 4096 is a close enough approximation of log10(2) to
+// estimate the digit count from the bit width, and the table fixes
+// the estimate when it's off by one.
+int string_builder_count_digits(uint64_t value) {
+    value |= 1;
+    int estimate = (string_builder_bit_width(value) * 1233) >> 12;
+    return estimate + 1 - (value < string_builder_powers_of_10[estimate]);
+}
+
+// Writes exactly `digit_count` decimal digits of `value` to `destination`.
+void string_builder_write_u64(char *destination, uint64_t value, int digit_count) {
+    char *iterator = destination + digit_count;
+
+    while (value >= 100) {
+        const char *pair = &string_builder_digit_pairs[(value % 100) * 2];
+        value /= 100;
+        *--iterator = pair[1];
+        *--iterator = pair[0];
+    }
+
+    if (value >= 10) {
+        const char *pair = &string_builder_digit_pairs[value * 2];
+        *--iterator = pair[1];
+        *--iterator = pair[0];
+    } else {
+        *--iterator = (char)('0' + value);
+    }
+}
+
+void string_builder_append_i64(StringBuilder *builder, int64_t value) {
+    // Negating in unsigned arithmetic is fine for INT64_MIN too.
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    int digit_count = string_builder_count_digits(magnitude);
+
+    if (value < 0) {
+        char *destination = string_builder_extend(builder, digit_count + 1);
+        *destination = '-';
+        string_builder_write_u64(destination + 1, magnitude, digit_count);
+    } else {
+        string_builder_write_u64(string_builder_extend(builder, digit_count), magnitude, digit_count);
+    }
+}
+
+void string_builder_append_u64(StringBuilder *builder, uint64_t value) {
+    int digit_count = string_builder_count_digits(value);
+    string_builder_write_u64(string_builder_extend(builder, digit_count), value, digit_count);
+}
+
+void string_builder_append_u64_hex(StringBuilder *builder, uint64_t value) {
+    int digit_count = (string_builder_bit_width(value) + 3) / 4;
+    char *iterator = string_builder_extend(builder, digit_count) + digit_count;
+
+    do {
+        *--iterator = string_builder_hex_digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+}
+
+void string_builder_append_u64_oct(StringBuilder *builder, uint64_t value) {
+    int digit_count = (string_builder_bit_width(value) + 2) / 3;
+    char *iterator = string_builder_extend(builder, digit_count) + digit_count;
+
+    do {
+        *--iterator = (char)('0' + (value & 7));
+        value >>= 3;
+    } while (value != 0);
+}
+
+// Floating point formatting.
+//
+// Everything here works on integers: a double is f * 2^e, and the exact
+// decimal digits come from comparing big integers scaled by powers of 2 and
+// 10. The largest numbers involved are around 2^1400 (the largest double
+// times 10^STRING_BUILDER_MAX_FIXED_PRECISION), which fits in 48 words.
+
+#define STRING_BUILDER_MAX_FIXED_PRECISION 100
+#define STRING_BUILDER_BIGNUM_WORDS 48
+
+typedef struct {
+    uint32_t words[STRING_BUILDER_BIGNUM_WORDS];
+    int      size;
+} StringBuilderBignum;
+
+void string_builder_bignum_set(StringBuilderBignum *number, uint64_t value) {
+    number->words[0] = (uint32_t)value;
+    number->words[1] = (uint32_t)(value >> 32);
+    number->size = number->words[1] != 0 ? 2 : number->words[0] != 0 ? 1 : 0;
+}
+
+void string_builder_bignum_multiply(StringBuilderBignum *number, uint32_t factor) {
+    uint64_t carry = 0;
+    for (int i = 0; i < number->size; i++) {
+        uint64_t product = (uint64_t)number->words[i] * factor + carry;
+        number->words[i] = (uint32_t)product;
+        carry = product >> 32;
+    }
+    if (carry != 0) {
+        STRING_BUILDER_ASSERT(number->size < STRING_BUILDER_BIGNUM_WORDS);
+        number->words[number->size++] = (uint32_t)carry;
+    }
+}
+
+void string_builder_bignum_multiply_pow10(StringBuilderBignum *number, int exponent) {
+    for (; exponent >= 9; exponent -= 9) {
+        string_builder_bignum_multiply(number, 1000000000u);
+    }
+    if (exponent > 0) {
+        string_builder_bignum_multiply(number, (uint32_t)string_builder_powers_of_10[exponent]);
+    }
+}
+
+void string_builder_bignum_shift_left(StringBuilderBignum *number, int shift) {
+    if (number->size == 0) {
+        return;
+    }
+
+    int word_shift = shift / 32;
+    int bit_shift = shift % 32;
+    STRING_BUILDER_ASSERT(number->size + word_shift < STRING_BUILDER_BIGNUM_WORDS);
+
+    number->words[number->size + word_shift] = 0;
+    for (int i = number->size - 1; i >= 0; i--) {
+        uint32_t word = number->words[i];
+        if (bit_shift != 0) {
+            number->words[i + word_shift + 1] |= word >> (32 - bit_shift);
+        }
+        number->words[i + word_shift] = word << bit_shift;
+    }
+    for (int i = 0; i < word_shift; i++) {
+        number->words[i] = 0;
+    }
+
+    number->size += word_shift + 1;
+    while (number->size > 0 && number->words[number->size - 1] == 0) {
+        number->size--;
+    }
+}
+
+int string_builder_bignum_compare(const StringBuilderBignum *left, const StringBuilderBignum *right) {
+    if (left->size != right->size) {
+        return left->size < right->size ? -1 : 1;
+    }
+    for (int i = left->size - 1; i >= 0; i--) {
+        if (left->words[i] != right->words[i]) {
+            return left->words[i] < right->words[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+void string_builder_bignum_add(StringBuilderBignum *result, const StringBuilderBignum *left, const StringBuilderBignum *right) {
+    int size = left->size > right->size ? left->size : right->size;
+    uint64_t carry = 0;
+    for (int i = 0; i < size; i++) {
+        uint64_t sum = carry;
+        sum += i < left->size ? left->words[i] : 0;
+        sum += i < right->size ? right->words[i] : 0;
+        result->words[i] = (uint32_t)sum;
+        carry = sum >> 32;
+    }
+    if (carry != 0) {
+        STRING_BUILDER_ASSERT(size < STRING_BUILDER_BIGNUM_WORDS);
+        result->words[size++] = (uint32_t)carry;
+    }
+    result->size = size;
+}
+
+// `left` must not be smaller than `right`.
+void string_builder_bignum_subtract(StringBuilderBignum *left, const StringBuilderBignum *right) {
+    int64_t borrow = 0;
+    for (int i = 0; i < left->size; i++) {
+        int64_t difference = (int64_t)left->words[i] - borrow - (i < right->size ? right->words[i] : 0);
+        borrow = difference < 0;
+        left->words[i] = (uint32_t)(difference + (borrow << 32));
+    }
+    while (left->size > 0 && left->words[left->size - 1] == 0) {
+        left->size--;
+    }
+}
+
+// Shifts right by `shift` bits, rounding the discarded part half to even.
+void string_builder_bignum_shift_right_rounded(StringBuilderBignum *number, int shift) {
+    int word_shift = shift / 32;
+    int bit_shift = shift % 32;
+    if (word_shift >= number->size) {
+        // Only a number of at least half of 2^shift would round up,
+        // and that has a set bit at `shift - 1` or above.
+        int half_word = (shift - 1) / 32;
+        int round_up = 0;
+        if (half_word < number->size && half_word == number->size - 1) {
+            uint32_t half_bit = (uint32_t)1 << ((shift - 1) % 32);
+            uint32_t word = number->words[half_word];
+            int sticky = (word & (half_bit - 1)) != 0;
+            for (int i = 0; i < half_word; i++) {
+                sticky |= number->words[i] != 0;
+            }
+            round_up = (word & half_bit) && sticky;
+        }
+        string_builder_bignum_set(number, round_up);
+        return;
+    }
+
+    int half_index = shift - 1;
+    uint32_t half = (number->words[half_index / 32] >> (half_index % 32)) & 1;
+    int sticky = 0;
+    for (int i = 0; i < half_index / 32; i++) {
+        sticky |= number->words[i] != 0;
+    }
+    sticky |= (number->words[half_index / 32] & (((uint32_t)1 << (half_index % 32)) - 1)) != 0;
+
+    for (int i = 0; i + word_shift < number->size; i++) {
+        uint32_t word = number->words[i + word_shift] >> bit_shift;
+        if (bit_shift != 0 && i + word_shift + 1 < number->size) {
+            word |= number->words[i + word_shift + 1] << (32 - bit_shift);
+        }
+        number->words[i] = word;
+    }
+    number->size -= word_shift;
+    while (number->size > 0 && number->words[number->size - 1] == 0) {
+        number->size--;
+    }
+
+    if (half && (sticky || (number->size > 0 && (number->words[0] & 1)))) {
+        StringBuilderBignum one;
+        string_builder_bignum_set(&one, 1);
+        string_builder_bignum_add(number, number, &one);
+    }
+}
+
+// Divides by `divisor` in place and returns the remainder.
+uint32_t string_builder_bignum_divide(StringBuilderBignum *number, uint32_t divisor) {
+    uint64_t remainder = 0;
+    for (int i = number->size - 1; i >= 0; i--) {
+        uint64_t current = (remainder << 32) | number->words[i];
+        number->words[i] = (uint32_t)(current / divisor);
+        remainder = current % divisor;
+    }
+    while (number->size > 0 && number->words[number->size - 1] == 0) {
+        number->size--;
+    }
+    return (uint32_t)remainder;
+}
+
+// floor(exponent * log10(2)), exact for |exponent| < 1650.
+int string_builder_floor_log10_pow2(int exponent) {
+    if (exponent >= 0) {
+        return (exponent * 78913) >> 18;
+    }
+    return -((-exponent * 78913 + (1 << 18) - 1) >> 18);
+}
+
+// Generates the shortest digits of `mantissa * 2^exponent` that still round
+// to it, for a format with `mantissa_bits` bits of mantissa (counting the
+// hidden bit) and `min_exponent` as the exponent of the subnormals.
+// The result is 0.digits * 10^decimal_exponent, the digit count is returned.
+int string_builder_shortest_digits(uint64_t mantissa, int exponent, int mantissa_bits, int min_exponent, char *digits, int *decimal_exponent) {
+    StringBuilderBignum r, s, m_plus, m_minus, sum;
+    int even = (mantissa & 1) == 0;
+    int unequal_gaps = mantissa == (uint64_t)1 << (mantissa_bits - 1) && exponent > min_exponent;
+
+    // v = r / s, the neighbours of v are (r - m_minus) / s and (r + m_plus) / s
+    // but halfway, so all four values are doubled to stay integers.
+    string_builder_bignum_set(&r, mantissa);
+    string_builder_bignum_shift_left(&r, unequal_gaps ? 2 : 1);
+    string_builder_bignum_set(&s, unequal_gaps ? 4 : 2);
+    string_builder_bignum_set(&m_minus, 1);
+    string_builder_bignum_set(&m_plus, unequal_gaps ? 2 : 1);
+    if (exponent >= 0) {
+        string_builder_bignum_shift_left(&r, exponent);
+        string_builder_bignum_shift_left(&m_minus, exponent);
+        string_builder_bignum_shift_left(&m_plus, exponent);
+    } else {
+        string_builder_bignum_shift_left(&s, -exponent);
+    }
+
+    int log2 = exponent + string_builder_bit_width(mantissa) - 1;
+    int k = log2 == 0 ? 0 : string_builder_floor_log10_pow2(log2) + 1;
+    if (k >= 0) {
+        string_builder_bignum_multiply_pow10(&s, k);
+    } else {
+        string_builder_bignum_multiply_pow10(&r, -k);
+        string_builder_bignum_multiply_pow10(&m_minus, -k);
+        string_builder_bignum_multiply_pow10(&m_plus, -k);
+    }
+
+    // The estimate of k can be one too small.
+    while (1) {
+        string_builder_bignum_add(&sum, &r, &m_plus);
+        int comparison = string_builder_bignum_compare(&sum, &s);
+        if (even ? comparison < 0 : comparison <= 0) {
+            break;
+        }
+        string_builder_bignum_multiply(&s, 10);
+        k++;
+    }
+
+    int digit_count = 0;
+    while (1) {
+        string_builder_bignum_multiply(&r, 10);
+        string_builder_bignum_multiply(&m_minus, 10);
+        string_builder_bignum_multiply(&m_plus, 10);
+
+        int digit = 0;
+        while (string_builder_bignum_compare(&r, &s) >= 0) {
+            string_builder_bignum_subtract(&r, &s);
+            digit++;
+        }
+
+        int low_comparison = string_builder_bignum_compare(&r, &m_minus);
+        int low = even ? low_comparison <= 0 : low_comparison < 0;
+        string_builder_bignum_add(&sum, &r, &m_plus);
+        int high_comparison = string_builder_bignum_compare(&sum, &s);
+        int high = even ? high_comparison >= 0 : high_comparison > 0;
+
+        if (!low && !high) {
+            digits[digit_count++] = (char)('0' + digit);
+            continue;
+        }
+
+        if (low && high) {
+            string_builder_bignum_add(&sum, &r, &r);
+            int half_comparison = string_builder_bignum_compare(&sum, &s);
+            if (half_comparison > 0 || (half_comparison == 0 && (digit & 1))) {
+                digit++;
+            }
+        } else if (high) {
+            digit++;
+        }
+        digits[digit_count++] = (char)('0' + digit);
+        break;
+    }
+
+    *decimal_exponent = k;
+    return digit_count;
+}
+
+// The shortest digits are first tried with Grisu3 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers"), which only
+// needs 64-bit integers and a table of cached powers of 10. It rounds its way
+// through an approximation, and gives up in the rare cases (about 0.5% of
+// doubles) where it can't prove that its digits are the shortest and closest
+// ones; those go through string_builder_shortest_digits() above.
+
+// A number f * 2^e, with more precision than a double but no rounding control.
+typedef struct {
+    uint64_t f;
+    int      e;
+} StringBuilderDiyFp;
+
+// The upper 64 bits of the product, rounded.
+StringBuilderDiyFp string_builder_diy_fp_multiply(StringBuilderDiyFp x, StringBuilderDiyFp y) {
+    uint64_t a = x.f >> 32, b = x.f & 0xffffffffu;
+    uint64_t c = y.f >> 32, d = y.f & 0xffffffffu;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & 0xffffffffu) + (bc & 0xffffffffu) + ((uint64_t)1 << 31);
+
+    StringBuilderDiyFp result;
+    result.f = ac + (ad >> 32) + (bc >> 32) + (middle >> 32);
+    result.e = x.e + y.e + 64;
+    return result;
+}
+
+StringBuilderDiyFp string_builder_diy_fp_normalize(uint64_t f, int e) {
+    StringBuilderDiyFp result;
+    int shift = 64 - string_builder_bit_width(f);
+    result.f = f << shift;
+    result.e = e - shift;
+    return result;
+}
+
+typedef struct {
+    uint64_t f;
+    int16_t  e;
+    int16_t  decimal_exponent;
+} StringBuilderCachedPower;
+
+// 10^decimal_exponent ~ f * 2^e, for every 8th power of 10 from 10^-348 to 10^340.
+const StringBuilderCachedPower string_builder_cached_powers[87] = {
+    {0xfa8fd5a0081c0288ull, -1220, -348}, {0xbaaee17fa23ebf76ull, -1193, -340},
+    {0x8b16fb203055ac76ull, -1166, -332}, {0xcf42894a5dce35eaull, -1140, -324},
+    {0x9a6bb0aa55653b2dull, -1113, -316}, {0xe61acf033d1a45dfull, -1087, -308},
+    {0xab70fe17c79ac6caull, -1060, -300}, {0xff77b1fcbebcdc4full, -1034, -292},
+    {0xbe5691ef416bd60cull, -1007, -284}, {0x8dd01fad907ffc3cull, -980, -276},
+    {0xd3515c2831559a83ull, -954, -268}, {0x9d71ac8fada6c9b5ull, -927, -260},
+    {0xea9c227723ee8bcbull, -901, -252}, {0xaecc49914078536dull, -874, -244},
+    {0x823c12795db6ce57ull, -847, -236}, {0xc21094364dfb5637ull, -821, -228},
+    {0x9096ea6f3848984full, -794, -220}, {0xd77485cb25823ac7ull, -768, -212},
+    {0xa086cfcd97bf97f4ull, -741, -204}, {0xef340a98172aace5ull, -715, -196},
+    {0xb23867fb2a35b28eull, -688, -188}, {0x84c8d4dfd2c63f3bull, -661, -180},
+    {0xc5dd44271ad3cdbaull, -635, -172}, {0x936b9fcebb25c996ull, -608, -164},
+    {0xdbac6c247d62a584ull, -582, -156}, {0xa3ab66580d5fdaf6ull, -555, -148},
+    {0xf3e2f893dec3f126ull, -529, -140}, {0xb5b5ada8aaff80b8ull, -502, -132},
+    {0x87625f056c7c4a8bull, -475, -124}, {0xc9bcff6034c13053ull, -449, -116},
+    {0x964e858c91ba2655ull, -422, -108}, {0xdff9772470297ebdull, -396, -100},
+    {0xa6dfbd9fb8e5b88full, -369, -92}, {0xf8a95fcf88747d94ull, -343, -84},
+    {0xb94470938fa89bcfull, -316, -76}, {0x8a08f0f8bf0f156bull, -289, -68},
+    {0xcdb02555653131b6ull, -263, -60}, {0x993fe2c6d07b7facull, -236, -52},
+    {0xe45c10c42a2b3b06ull, -210, -44}, {0xaa242499697392d3ull, -183, -36},
+    {0xfd87b5f28300ca0eull, -157, -28}, {0xbce5086492111aebull, -130, -20},
+    {0x8cbccc096f5088ccull, -103, -12}, {0xd1b71758e219652cull, -77, -4},
+    {0x9c40000000000000ull, -50, 4}, {0xe8d4a51000000000ull, -24, 12},
+    {0xad78ebc5ac620000ull, 3, 20}, {0x813f3978f8940984ull, 30, 28},
+    {0xc097ce7bc90715b3ull, 56, 36}, {0x8f7e32ce7bea5c70ull, 83, 44},
+    {0xd5d238a4abe98068ull, 109, 52}, {0x9f4f2726179a2245ull, 136, 60},
+    {0xed63a231d4c4fb27ull, 162, 68}, {0xb0de65388cc8ada8ull, 189, 76},
+    {0x83c7088e1aab65dbull, 216, 84}, {0xc45d1df942711d9aull, 242, 92},
+    {0x924d692ca61be758ull, 269, 100}, {0xda01ee641a708deaull, 295, 108},
+    {0xa26da3999aef774aull, 322, 116}, {0xf209787bb47d6b85ull, 348, 124},
+    {0xb454e4a179dd1877ull, 375, 132}, {0x865b86925b9bc5c2ull, 402, 140},
+    {0xc83553c5c8965d3dull, 428, 148}, {0x952ab45cfa97a0b3ull, 455, 156},
+    {0xde469fbd99a05fe3ull, 481, 164}, {0xa59bc234db398c25ull, 508, 172},
+    {0xf6c69a72a3989f5cull, 534, 180}, {0xb7dcbf5354e9beceull, 561, 188},
+    {0x88fcf317f22241e2ull, 588, 196}, {0xcc20ce9bd35c78a5ull, 614, 204},
+    {0x98165af37b2153dfull, 641, 212}, {0xe2a0b5dc971f303aull, 667, 220},
+    {0xa8d9d1535ce3b396ull, 694, 228}, {0xfb9b7cd9a4a7443cull, 720, 236},
+    {0xbb764c4ca7a44410ull, 747, 244}, {0x8bab8eefb6409c1aull, 774, 252},
+    {0xd01fef10a657842cull, 800, 260}, {0x9b10a4e5e9913129ull, 827, 268},
+    {0xe7109bfba19c0c9dull, 853, 276}, {0xac2820d9623bf429ull, 880, 284},
+    {0x80444b5e7aa7cf85ull, 907, 292}, {0xbf21e44003acdd2dull, 933, 300},
+    {0x8e679c2f5e44ff8full, 960, 308}, {0xd433179d9c8cb841ull, 986, 316},
+    {0x9e19db92b4e31ba9ull, 1013, 324}, {0xeb96bf6ebadf77d9ull, 1039, 332},
+    {0xaf87023b9bf0ee6bull, 1066, 340},
+};
+
+// Returns a cached power of 10 that, multiplied by 2^(exponent + 64), gives
+// a binary exponent between -60 and -32. So the product of a normalized
+// number with 2^exponent and the power has 4 to 32 integer bits, and the
+// integer part fits in 32 bits.
+StringBuilderCachedPower string_builder_cached_power(int exponent) {
+    int minimal_exponent = -60 - (exponent + 64);
+    // k = ceil((minimal_exponent + 63) * log10(2)), the smallest power of 10 that gets there.
+    int scaled_exponent = minimal_exponent + 63;
+    int k = scaled_exponent == 0 ? 0 : string_builder_floor_log10_pow2(scaled_exponent) + 1;
+    int index = (348 + k - 1) / 8 + 1;
+    return string_builder_cached_powers[index];
+}
+
+// Moves the last digit down while that brings it closer to the value, then
+// checks that the digits are inside the interval and that no other digits
+// could be closer, accounting for the error of the approximations. Returns
+// 0 when it can't tell.
+int string_builder_grisu_round(char *digits, int digit_count, uint64_t distance_to_high, uint64_t interval, uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small_distance = distance_to_high - unit;
+    uint64_t big_distance = distance_to_high + unit;
+
+    while (rest < small_distance && interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[digit_count - 1]--;
+        rest += ten_kappa;
+    }
+
+    if (rest < big_distance && interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return 0;
+    }
+
+    return 2 * unit <= rest && rest <= interval - 4 * unit;
+}
+
+// Same as string_builder_shortest_digits(), but returns 0 when Grisu3 fails.
+int string_builder_grisu_digits(uint64_t mantissa, int exponent, int mantissa_bits, int min_exponent, char *digits, int *decimal_exponent) {
+    int unequal_gaps = mantissa == (uint64_t)1 << (mantissa_bits - 1) && exponent > min_exponent;
+
+    // The value and the halfway points to its neighbours, with the same exponent.
+    StringBuilderDiyFp w = string_builder_diy_fp_normalize(mantissa, exponent);
+    StringBuilderDiyFp high = string_builder_diy_fp_normalize((mantissa << 1) + 1, exponent - 1);
+    StringBuilderDiyFp low;
+    if (unequal_gaps) {
+        low.f = ((mantissa << 2) - 1) << (exponent - 2 - high.e);
+    } else {
+        low.f = ((mantissa << 1) - 1) << (exponent - 1 - high.e);
+    }
+    low.e = high.e;
+
+    StringBuilderCachedPower cached = string_builder_cached_power(w.e);
+    StringBuilderDiyFp power = { cached.f, cached.e };
+    w = string_builder_diy_fp_multiply(w, power);
+    low = string_builder_diy_fp_multiply(low, power);
+    high = string_builder_diy_fp_multiply(high, power);
+
+    // Each product is off by less than one unit, so digits between too_low
+    // and too_high might be outside the interval, and the ones that are
+    // within one unit of it have to be checked.
+    uint64_t unit = 1;
+    uint64_t too_low = low.f - unit;
+    uint64_t too_high = high.f + unit;
+    uint64_t interval = too_high - too_low;
+
+    int shift = -w.e;
+    uint64_t one = (uint64_t)1 << shift;
+    uint32_t integrals = (uint32_t)(too_high >> shift);
+    uint64_t fractionals = too_high & (one - 1);
+
+    int kappa = string_builder_count_digits(integrals);
+    uint32_t divisor = (uint32_t)string_builder_powers_of_10[kappa - 1];
+    int digit_count = 0;
+
+    while (kappa > 0) {
+        digits[digit_count++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        kappa--;
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < interval) {
+            *decimal_exponent = digit_count + kappa - cached.decimal_exponent;
+            return string_builder_grisu_round(digits, digit_count, too_high - w.f, interval, rest, (uint64_t)divisor << shift, unit) ? digit_count : 0;
+        }
+        divisor /= 10;
+    }
+
+    while (1) {
+        fractionals *= 10;
+        unit *= 10;
+        interval *= 10;
+        digits[digit_count++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        kappa--;
+        if (fractionals < interval) {
+            *decimal_exponent = digit_count + kappa - cached.decimal_exponent;
+            return string_builder_grisu_round(digits, digit_count, (too_high - w.f) * unit, interval, fractionals, one, unit) ? digit_count : 0;
+        }
+    }
+}
+
+// Writes 0.digits * 10^decimal_exponent the way string_builder_append_double() documents.
+void string_builder_append_decimal(StringBuilder *builder, int negative, const char *digits, int digit_count, int decimal_exponent) {
+    // Longest case: "-0.000000" followed by 17 digits.
+    char buffer[32];
+    char *iterator = buffer;
+
+    if (negative) {
+        *iterator++ = '-';
+    }
+
+    if (digit_count <= decimal_exponent && decimal_exponent <= 21) {
+        memcpy(iterator, digits, digit_count);
+        iterator += digit_count;
+        for (int i = digit_count; i < decimal_exponent; i++) {
+            *iterator++ = '0';
+        }
+    } else if (0 < decimal_exponent && decimal_exponent <= 21) {
+        memcpy(iterator, digits, decimal_exponent);
+        iterator += decimal_exponent;
+        *iterator++ = '.';
+        memcpy(iterator, digits + decimal_exponent, digit_count - decimal_exponent);
+        iterator += digit_count - decimal_exponent;
+    } else if (-6 < decimal_exponent && decimal_exponent <= 0) {
+        *iterator++ = '0';
+        *iterator++ = '.';
+        for (int i = decimal_exponent; i < 0; i++) {
+            *iterator++ = '0';
+        }
+        memcpy(iterator, digits, digit_count);
+        iterator += digit_count;
+    } else {
+        *iterator++ = digits[0];
+        if (digit_count > 1) {
+            *iterator++ = '.';
+            memcpy(iterator, digits + 1, digit_count - 1);
+            iterator += digit_count - 1;
+        }
+        int exponent = decimal_exponent - 1;
+        *iterator++ = 'e';
+        *iterator++ = exponent < 0 ? '-' : '+';
+        exponent = exponent < 0 ? -exponent : exponent;
+        int exponent_digits = string_builder_count_digits((uint64_t)exponent);
+        string_builder_write_u64(iterator, (uint64_t)exponent, exponent_digits);
+        iterator += exponent_digits;
+    }
+
+    string_builder_append_n(builder, buffer, iterator - buffer);
+}
+
+// Splits an IEEE 754 number into sign, integer mantissa and exponent.
+// Returns 0 for infinities and NaNs, which are appended right away.
+int string_builder_decompose(StringBuilder *builder, uint64_t bits, int mantissa_bits, int exponent_bits, int *negative, uint64_t *mantissa, int *exponent) {
+    int stored_bits = mantissa_bits - 1;
+    int bias = (1 << (exponent_bits - 1)) - 1;
+    uint64_t fraction = bits & (((uint64_t)1 << stored_bits) - 1);
+    int biased_exponent = (int)((bits >> stored_bits) & ((1u << exponent_bits) - 1));
+    *negative = (int)(bits >> (stored_bits + exponent_bits)) & 1;
+
+    if (biased_exponent == (1 << exponent_bits) - 1) {
+        if (fraction != 0) {
+            string_builder_append(builder, "nan");
+        } else {
+            string_builder_append(builder, *negative ? "-inf" : "inf");
+        }
+        return 0;
+    }
+
+    if (biased_exponent == 0) {
+        *mantissa = fraction;
+        *exponent = 1 - bias - stored_bits;
+    } else {
+        *mantissa = fraction | ((uint64_t)1 << stored_bits);
+        *exponent = biased_exponent - bias - stored_bits;
+    }
+    return 1;
+}
+
+void string_builder_append_shortest(StringBuilder *builder, uint64_t bits, int mantissa_bits, int exponent_bits) {
+    int negative;
+    uint64_t mantissa;
+    int exponent;
+    if (!string_builder_decompose(builder, bits, mantissa_bits, exponent_bits, &negative, &mantissa, &exponent)) {
+        return;
+    }
+
+    if (mantissa == 0) {
+        string_builder_append(builder, negative ? "-0" : "0");
+        return;
+    }
+
+    // Small integers are exact, so their shortest digits are just their digits.
+    if (exponent <= 0 && exponent > -mantissa_bits && (mantissa & ((((uint64_t)1) << -exponent) - 1)) == 0) {
+        if (negative) {
+            string_builder_append_char(builder, '-');
+        }
+        string_builder_append_u64(builder, mantissa >> -exponent);
+        return;
+    }
+
+    int min_exponent = 2 - (1 << (exponent_bits - 1)) - (mantissa_bits - 1);
+    char digits[20];
+    int decimal_exponent;
+    int digit_count = string_builder_grisu_digits(mantissa, exponent, mantissa_bits, min_exponent, digits, &decimal_exponent);
+    if (digit_count == 0) {
+        digit_count = string_builder_shortest_digits(mantissa, exponent, mantissa_bits, min_exponent, digits, &decimal_exponent);
+    }
+    string_builder_append_decimal(builder, negative, digits, digit_count, decimal_exponent);
+}
+
+void string_builder_append_double(StringBuilder *builder, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    string_builder_append_shortest(builder, bits, 53, 11);
+}
+
+void string_builder_append_float(StringBuilder *builder, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    string_builder_append_shortest(builder, bits, 24, 8);
+}
+
+void string_builder_append_double_fixed(StringBuilder *builder, double value, int precision) {
+    STRING_BUILDER_ASSERT(precision >= 0 && precision <= STRING_BUILDER_MAX_FIXED_PRECISION);
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+
+    int negative;
+    uint64_t mantissa;
+    int exponent;
+    if (!string_builder_decompose(builder, bits, 53, 11, &negative, &mantissa, &exponent)) {
+        return;
+    }
+
+    // scaled = round(value * 10^precision), the digits of the result.
+    StringBuilderBignum scaled;
+    string_builder_bignum_set(&scaled, mantissa);
+    string_builder_bignum_multiply_pow10(&scaled, precision);
+    if (exponent >= 0) {
+        string_builder_bignum_shift_left(&scaled, exponent);
+    } else {
+        string_builder_bignum_shift_right_rounded(&scaled, -exponent);
+    }
+
+    // At most 309 integer digits, plus the fractional ones.
+    char digits[320 + STRING_BUILDER_MAX_FIXED_PRECISION];
+    char *digits_end = digits + sizeof digits;
+    char *iterator = digits_end;
+    while (scaled.size > 0) {
+        uint32_t chunk = string_builder_bignum_divide(&scaled, 1000000000u);
+        for (int i = 0; i < 9; i++) {
+            *--iterator = (char)('0' + chunk % 10);
+            chunk /= 10;
+        }
+    }
+    while (iterator < digits_end && *iterator == '0') {
+        iterator++;
+    }
+    while (digits_end - iterator < precision + 1) {
+        *--iterator = '0';
+    }
+
+    size_t integer_length = (digits_end - iterator) - precision;
+    size_t length = negative + integer_length + (precision > 0 ? 1 + precision : 0);
+    char *destination = string_builder_extend(builder, length);
+    if (negative) {
+        *destination++ = '-';
+    }
+    memcpy(destination, iterator, integer_length);
+    if (precision > 0) {
+        destination[integer_length] = '.';
+        memcpy(destination + integer_length + 1, iterator + integer_length, precision);
+    }
+}
+
+#ifndef STRING_BUILDER_NO_FORMAT
+void string_builder_append_format(StringBuilder *builder, const char *format, ...) {
+    STRING_BUILDER_STATS_TIMER(start);
+    va_list arg_list;
+
+    va_start(arg_list, format);
+    size_t appended_length = vsnprintf(NULL, 0, format, arg_list);
+    va_end(arg_list);
+
+    string_builder_reserve_append(builder, appended_length);
+    size_t old_length = builder->length;
+    size_t new_length = old_length + appended_length;
+
+    char *string_end = builder->string + old_length;
+    va_start(arg_list, format);
+    vsnprintf(string_end, appended_length + 1, format, arg_list);
+    va_end(arg_list);
+
+    builder->length = new_length;
+    STRING_BUILDER_STATS_ELAPSED(builder, format_nanoseconds, start);
+}
+#endif // STRING_BUILDER_NO_FORMAT
+
+StringBuilderFormat string_builder_format_compile(const char *format) {
+    size_t format_length = strlen(format);
+    size_t max_fields = 1;
+    for (const char *iterator = format; *iterator != '\0'; iterator++) {
+        max_fields += *iterator == '%';
+    }
+
+    StringBuilderFormat compiled;
+    compiled.literals = (char *)STRING_BUILDER_MALLOC(format_length + 1);
+    compiled.literals_length = 0;
+    compiled.fields = (StringBuilderFormatField *)STRING_BUILDER_MALLOC(max_fields * sizeof *compiled.fields);
+    compiled.field_count = 0;
+
+    StringBuilderFormatField field;
+    field.literal_start = 0;
+    field.literal_length = 0;
+
+    while (1) {
+        // Copy the literal run up to the next conversion. "%%" stays in the run.
+        while (*format != '\0' && !(format[0] == '%' && format[1] != '%')) {
+            compiled.literals[compiled.literals_length++] = *format;
+            field.literal_length++;
+            format += *format == '%' ? 2 : 1;
+        }
+
+        field.conversion = 0;
+        field.length_modifier = 0;
+        field.flags = 0;
+        field.width = 0;
+        field.precision = -1;
+
+        if (*format == '\0') {
+            compiled.fields[compiled.field_count++] = field;
+            break;
+        }
+
+        format++;
+        for (;; format++) {
+            if (*format == '-') {
+                field.flags |= STRING_BUILDER_FORMAT_LEFT;
+            } else if (*format == '0') {
+                field.flags |= STRING_BUILDER_FORMAT_ZERO;
+            } else {
+                break;
+            }
+        }
+        while (*format >= '0' && *format <= '9') {
+            field.width = field.width * 10 + (*format++ - '0');
+        }
+        if (*format == '.') {
+            format++;
+            field.precision = 0;
+            while (*format >= '0' && *format <= '9') {
+                field.precision = field.precision * 10 + (*format++ - '0');
+            }
+        }
+        if (format[0] == 'l' && format[1] == 'l') {
+            field.length_modifier = 'L';
+            format += 2;
+        } else if (*format == 'l' || *format == 'z') {
+            field.length_modifier = *format++;
+        }
+
+        switch (*format) {
+            case 'd': case 'i': case 'u': case 'x': case 'X':
+                // The digits are padded with zeros up to the precision instead.
+                if (field.precision >= 0) {
+                    field.flags &= ~STRING_BUILDER_FORMAT_ZERO;
+                }
+                field.conversion = *format++;
+                break;
+            case 'c':
+                STRING_BUILDER_ASSERT(field.precision < 0 && "precision on %c in string_builder_format_compile()");
+                field.conversion = *format++;
+                break;
+            case 's':
+                field.conversion = *format++;
+                break;
+            default:
+                STRING_BUILDER_ASSERT(0 && "unsupported conversion in string_builder_format_compile()");
+                break;
+        }
+
+        compiled.fields[compiled.field_count++] = field;
+        field.literal_start = compiled.literals_length;
+        field.literal_length = 0;
+    }
+
+    compiled.literals[compiled.literals_length] = '\0';
+    return compiled;
+}
+
+void string_builder_format_free(StringBuilderFormat *format) {
+    STRING_BUILDER_FREE(format->literals);
+    STRING_BUILDER_FREE(format->fields);
+    format->literals_length = 0;
+    format->field_count = 0;
+}
+
+// Takes the next integer argument of the size given by `length_modifier`.
+// Signed values are returned as their two's complement bits.
+uint64_t string_builder_format_next_integer(va_list *arg_list, const StringBuilderFormatField *field) {
+    int is_signed = field->conversion == 'd' || field->conversion == 'i';
+    switch (field->length_modifier) {
+        case 'l':
+            return is_signed ? (uint64_t)va_arg(*arg_list, long) : va_arg(*arg_list, unsigned long);
+        case 'L':
+            return is_signed ? (uint64_t)va_arg(*arg_list, long long) : va_arg(*arg_list, unsigned long long);
+        case 'z':
+            return is_signed ? (uint64_t)va_arg(*arg_list, ptrdiff_t) : va_arg(*arg_list, size_t);
+        default:
+            return is_signed ? (uint64_t)(int64_t)va_arg(*arg_list, int) : va_arg(*arg_list, unsigned int);
+    }
+}
+
+// Writes `body` (with its `prefix`, a sign, and `zeros` leading zeros)
+// padded to the field's width.
+char *string_builder_format_write_padded(char *destination, const StringBuilderFormatField *field, char prefix, size_t zeros, const char *body, size_t body_length) {
+    size_t length = body_length + zeros + (prefix != 0);
+    size_t padding = (size_t)field->width > length ? (size_t)field->width - length : 0;
+
+    if (!(field->flags & STRING_BUILDER_FORMAT_LEFT) && !(field->flags & STRING_BUILDER_FORMAT_ZERO)) {
+        memset(destination, ' ', padding);
+        destination += padding;
+    }
+    if (prefix != 0) {
+        *destination++ = prefix;
+    }
+    if (!(field->flags & STRING_BUILDER_FORMAT_LEFT) && (field->flags & STRING_BUILDER_FORMAT_ZERO)) {
+        memset(destination, '0', padding);
+        destination += padding;
+    }
+    memset(destination, '0', zeros);
+    destination += zeros;
+    memcpy(destination, body, body_length);
+    destination += body_length;
+    if (field->flags & STRING_BUILDER_FORMAT_LEFT) {
+        memset(destination, ' ', padding);
+        destination += padding;
+    }
+
+    return destination;
+}
+
+#define STRING_BUILDER_FORMAT_CACHED_LENGTHS 16
+void string_builder_append_compiled_v(StringBuilder *builder, const StringBuilderFormat *format, va_list arg_list) {
+    STRING_BUILDER_STATS_TIMER(start);
+    // The lengths of the first strings are kept so that the writing
+    // pass doesn't call strlen() on them again.
+    size_t string_lengths[STRING_BUILDER_FORMAT_CACHED_LENGTHS];
+    size_t string_count = 0;
+    size_t max_length = format->literals_length;
+    va_list measure_list;
+
+    va_copy(measure_list, arg_list);
+    for (size_t i = 0; i < format->field_count; i++) {
+        const StringBuilderFormatField *field = &format->fields[i];
+        size_t field_length;
+        switch (field->conversion) {
+            case 0:
+                field_length = 0;
+                break;
+            case 'c':
+                va_arg(measure_list, int);
+                field_length = 1;
+                break;
+            case 's': {
+                const char *string = va_arg(measure_list, const char *);
+                if (field->precision >= 0) {
+                    const char *end = (const char *)memchr(string, '\0', field->precision);
+                    field_length = end != NULL ? (size_t)(end - string) : (size_t)field->precision;
+                } else {
+                    field_length = strlen(string);
+                }
+                if (string_count < STRING_BUILDER_FORMAT_CACHED_LENGTHS) {
+                    string_lengths[string_count] = field_length;
+                }
+                string_count++;
+                break;
+            }
+            default:
+                string_builder_format_next_integer(&measure_list, field);
+                // "-9223372036854775808", or a sign and `precision` digits.
+                field_length = field->precision >= 20 ? (size_t)field->precision + 1 : 20;
+                break;
+        }
+        max_length += (size_t)field->width > field_length ? (size_t)field->width : field_length;
+    }
+    va_end(measure_list);
+
+    string_builder_reserve_append(builder, max_length);
+
+    char *destination = builder->string + builder->length;
+    va_list write_list;
+    va_copy(write_list, arg_list);
+    string_count = 0;
+    for (size_t i = 0; i < format->field_count; i++) {
+        const StringBuilderFormatField *field = &format->fields[i];
+        memcpy(destination, format->literals + field->literal_start, field->literal_length);
+        destination += field->literal_length;
+
+        char digits[20];
+        switch (field->conversion) {
+            case 0:
+                break;
+            case 'c': {
+                char c = (char)va_arg(write_list, int);
+                destination = string_builder_format_write_padded(destination, field, 0, 0, &c, 1);
+                break;
+            }
+            case 's': {
+                const char *string = va_arg(write_list, const char *);
+                size_t length;
+                if (string_count < STRING_BUILDER_FORMAT_CACHED_LENGTHS) {
+                    length = string_lengths[string_count];
+                } else if (field->precision >= 0) {
+                    const char *end = (const char *)memchr(string, '\0', field->precision);
+                    length = end != NULL ? (size_t)(end - string) : (size_t)field->precision;
+                } else {
+                    length = strlen(string);
+                }
+                string_count++;
+
+                StringBuilderFormatField padding = *field;
+                padding.flags &= ~STRING_BUILDER_FORMAT_ZERO;
+                destination = string_builder_format_write_padded(destination, &padding, 0, 0, string, length);
+                break;
+            }
+            case 'x':
+            case 'X': {
+                uint64_t value = string_builder_format_next_integer(&write_list, field);
+                const char *hex_digits = field->conversion == 'x' ? "0123456789abcdef" : "0123456789ABCDEF";
+                // Like printf, a precision of 0 writes no digits for zero.
+                int digit_count = value == 0 && field->precision == 0 ? 0 : (string_builder_bit_width(value) + 3) / 4;
+                for (int j = digit_count - 1; j >= 0; j--) {
+                    digits[j] = hex_digits[value & 0xf];
+                    value >>= 4;
+                }
+                size_t zeros = field->precision > digit_count ? (size_t)(field->precision - digit_count) : 0;
+                destination = string_builder_format_write_padded(destination, field, 0, zeros, digits, digit_count);
+                break;
+            }
+            default: {
+                uint64_t value = string_builder_format_next_integer(&write_list, field);
+                char sign = 0;
+                if (field->conversion != 'u' && (int64_t)value < 0) {
+                    sign = '-';
+                    value = 0 - value;
+                }
+                int digit_count = value == 0 && field->precision == 0 ? 0 : string_builder_count_digits(value);
+                if (digit_count > 0) {
+                    string_builder_write_u64(digits, value, digit_count);
+                }
+                size_t zeros = field->precision > digit_count ? (size_t)(field->precision - digit_count) : 0;
+                destination = string_builder_format_write_padded(destination, field, sign, zeros, digits, digit_count);
+                break;
+            }
+        }
+    }
+    va_end(write_list);
+
+    *destination = '\0';
+    builder->length = destination - builder->string;
+    STRING_BUILDER_STATS_ELAPSED(builder, format_nanoseconds, start);
+}
+
+void string_builder_append_compiled(StringBuilder *builder, const StringBuilderFormat *format, ...) {
+    va_list arg_list;
+    va_start(arg_list, format);
+    string_builder_append_compiled_v(builder, format, arg_list);
+    va_end(arg_list);
+}
+
+// Writes the 8 bits of `byte` as '0' and '1', the most significant one first.
+// The byte is copied into every byte of a 64-bit word and each copy keeps
+// only the bit it is responsible for; adding 0x7f then carries that bit
+// into the top of its own byte without touching the neighbours.
+void string_builder_write_byte_bits(char *destination, unsigned char byte) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const uint64_t bit_per_byte = 0x8040201008040201ull;
+#else
+    const uint64_t bit_per_byte = 0x0102040810204080ull;
+#endif
+    uint64_t bits = (byte * 0x0101010101010101ull) & bit_per_byte;
+    bits = ((bits + 0x7f7f7f7f7f7f7f7full) >> 7) & 0x0101010101010101ull;
+    bits += 0x3030303030303030ull;
+    memcpy(destination, &bits, sizeof bits);
+}
+
+void string_builder_append_bits(StringBuilder *builder, int64_t value, int bit_count) {
+    STRING_BUILDER_ASSERT((bit_count > 0) && (bit_count <= 64));
+
+    uint64_t bits = (uint64_t)value;
+    char *destination = string_builder_extend(builder, bit_count);
+
+    int leading_bits = bit_count % 8;
+    while (leading_bits--) {
+        bit_count--;
+        *destination++ = (bits >> bit_count) & 1 ? '1' : '0';
+    }
+
+    while (bit_count > 0) {
+        bit_count -= 8;
+        string_builder_write_byte_bits(destination, (unsigned char)(bits >> bit_count));
+        destination += 8;
+    }
+}
+
+void string_builder_append_bits_bytes(StringBuilder *builder, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    char *destination = string_builder_extend(builder, size * 8);
+
+    for (size_t i = 0; i < size; i++) {
+        string_builder_write_byte_bits(destination, bytes[i]);
+        destination += 8;
+    }
+}
+
+void string_builder_write_hex_scalar(char *destination, const unsigned char *bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        *destination++ = string_builder_hex_digits[bytes[i] >> 4];
+        *destination++ = string_builder_hex_digits[bytes[i] & 0xf];
+    }
+}
+
+const char string_builder_base64_digits[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void string_builder_write_base64_scalar(char *destination, const unsigned char *bytes, size_t size) {
+    for (; size >= 3; size -= 3) {
+        uint32_t group = (uint32_t)bytes[0] << 16 | (uint32_t)bytes[1] << 8 | bytes[2];
+        destination[0] = string_builder_base64_digits[group >> 18];
+        destination[1] = string_builder_base64_digits[(group >> 12) & 63];
+        destination[2] = string_builder_base64_digits[(group >> 6) & 63];
+        destination[3] = string_builder_base64_digits[group & 63];
+        destination += 4;
+        bytes += 3;
+    }
+
+    if (size > 0) {
+        uint32_t group = (uint32_t)bytes[0] << 16 | (size > 1 ? (uint32_t)bytes[1] << 8 : 0);
+        destination[0] = string_builder_base64_digits[group >> 18];
+        destination[1] = string_builder_base64_digits[(group >> 12) & 63];
+        destination[2] = size > 1 ? string_builder_base64_digits[(group >> 6) & 63] : '=';
+        destination[3] = '=';
+    }
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+// Both encoders turn 4 or 6 bit values into characters with pshufb, which
+// looks up 16 bytes at a time in a 16 entry table.
+//
+// The base64 kernels follow Muła and Lemire, "Faster Base64 Encoding and
+// Decoding using AVX2 Instructions": every 3 input bytes are spread over
+// a 32-bit word, the four 6-bit fields are moved into separate bytes with
+// two multiplications, and each field gets the offset of its range of the
+// alphabet added to it.
+
+__attribute__((target("ssse3")))
+size_t string_builder_write_hex_ssse3(char *destination, const unsigned char *bytes, size_t size) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i input = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+        __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(input, low_nibble));
+        _mm_storeu_si128((__m128i *)(destination + i * 2), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(destination + i * 2 + 16), _mm_unpackhi_epi8(high, low));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_write_hex_avx2(char *destination, const unsigned char *bytes, size_t size) {
+    const __m256i digits = _mm256_setr_epi8(
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+        __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(input, low_nibble));
+        // Unpacking works inside 128-bit lanes, so the halves have to be put back in order.
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i *)(destination + i * 2), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(destination + i * 2 + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+__m128i string_builder_base64_encode_ssse3(__m128i input) {
+    input = _mm_shuffle_epi8(input, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i indices = _mm_or_si128(t1, t3);
+
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    __m128i ranges = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i uppercase = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    ranges = _mm_or_si128(ranges, _mm_and_si128(uppercase, _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, ranges), indices);
+}
+
+__attribute__((target("ssse3")))
+size_t string_builder_write_base64_ssse3(char *destination, const unsigned char *bytes, size_t size) {
+    size_t i = 0;
+
+    // Each step reads 16 bytes but only encodes the first 12.
+    for (; i + 16 <= size; i += 12) {
+        __m128i input = _mm_loadu_si128((const __m128i *)(bytes + i));
+        _mm_storeu_si128((__m128i *)(destination + i / 3 * 4), string_builder_base64_encode_ssse3(input));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_write_base64_avx2(char *destination, const unsigned char *bytes, size_t size) {
+    const __m256i shuffle = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+
+    // Each lane encodes 12 bytes, so the lanes are loaded separately
+    // 12 bytes apart. Each step reads 28 bytes but only encodes 24.
+    for (; i + 28 <= size; i += 24) {
+        __m128i low_lane = _mm_loadu_si128((const __m128i *)(bytes + i));
+        __m128i high_lane = _mm_loadu_si128((const __m128i *)(bytes + i + 12));
+        __m256i input = _mm256_inserti128_si256(_mm256_castsi128_si256(low_lane), high_lane, 1);
+
+        input = _mm256_shuffle_epi8(input, shuffle);
+        const __m256i t0 = _mm256_and_si256(input, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(input, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i ranges = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i uppercase = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        ranges = _mm256_or_si256(ranges, _mm256_and_si256(uppercase, _mm256_set1_epi8(13)));
+        __m256i encoded = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, ranges), indices);
+
+        _mm256_storeu_si256((__m256i *)(destination + i / 3 * 4), encoded);
+    }
+
+    return i;
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+void string_builder_append_hex(StringBuilder *builder, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    char *destination = string_builder_extend(builder, size * 2);
+    size_t encoded = 0;
+
+#ifdef STRING_BUILDER_X86_SIMD
+    int simd_level = string_builder_simd_level();
+    if (simd_level >= STRING_BUILDER_SIMD_AVX2) {
+        encoded = string_builder_write_hex_avx2(destination, bytes, size);
+    }
+    if (simd_level >= STRING_BUILDER_SIMD_SSSE3) {
+        encoded += string_builder_write_hex_ssse3(destination + encoded * 2, bytes + encoded, size - encoded);
+    }
+#endif // STRING_BUILDER_X86_SIMD
+
+    string_builder_write_hex_scalar(destination + encoded * 2, bytes + encoded, size - encoded);
+}
+
+// Finds the first character of `string` that is one of `special_count`
+// `specials`, or a control character below 0x20 if `controls` is set.
+// Returns `length` if there's none.
+size_t string_builder_scan_scalar(const char *string, size_t length, const char *specials, size_t special_count, int controls) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)string[i];
+        if (controls && c < 0x20) {
+            return i;
+        }
+        for (size_t j = 0; j < special_count; j++) {
+            if (string[i] == specials[j]) {
+                return i;
+            }
+        }
+    }
+    return length;
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+#define STRING_BUILDER_MAX_SPECIALS 5
+
+size_t string_builder_scan_sse2(const char *string, size_t length, const char *specials, size_t special_count, int controls) {
+    __m128i special_vectors[STRING_BUILDER_MAX_SPECIALS];
+    for (size_t j = 0; j < special_count; j++) {
+        special_vectors[j] = _mm_set1_epi8(specials[j]);
+    }
+    // Unsigned x <= 0x1f is max(x, 0x1f) == 0x1f.
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        __m128i found = controls ? _mm_cmpeq_epi8(_mm_max_epu8(block, last_control), last_control) : _mm_setzero_si128();
+        for (size_t j = 0; j < special_count; j++) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, special_vectors[j]));
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(found);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + string_builder_scan_scalar(string + i, length - i, specials, special_count, controls);
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_scan_avx2(const char *string, size_t length, const char *specials, size_t special_count, int controls) {
+    __m256i special_vectors[STRING_BUILDER_MAX_SPECIALS];
+    for (size_t j = 0; j < special_count; j++) {
+        special_vectors[j] = _mm256_set1_epi8(specials[j]);
+    }
+    const __m256i last_control = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(string + i));
+        __m256i found = controls ? _mm256_cmpeq_epi8(_mm256_max_epu8(block, last_control), last_control) : _mm256_setzero_si256();
+        for (size_t j = 0; j < special_count; j++) {
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi8(block, special_vectors[j]));
+        }
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(found);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + string_builder_scan_sse2(string + i, length - i, specials, special_count, controls);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+size_t string_builder_scan(const char *string, size_t length, const char *specials, size_t special_count, int controls) {
+#ifdef STRING_BUILDER_X86_SIMD
+    STRING_BUILDER_ASSERT(special_count <= STRING_BUILDER_MAX_SPECIALS);
+    if (string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2) {
+        return string_builder_scan_avx2(string, length, specials, special_count, controls);
+    }
+    return string_builder_scan_sse2(string, length, specials, special_count, controls);
+#else
+    return string_builder_scan_scalar(string, length, specials, special_count, controls);
+#endif // STRING_BUILDER_X86_SIMD
+}
+
+// Which characters an escaping appender looks for, and how it writes
+// them. `escape` writes the escaped form of `c` to `destination` and
+// returns the end of what it wrote.
+typedef struct {
+    const char *specials;
+    size_t      special_count;
+    int         controls; // Characters below 0x20 are special too
+    char     *(*escape)(char *destination, char c);
+} StringBuilderEscaper;
+
+// Writes `length` characters from `string` to `destination` with the
+// special ones escaped, and returns the end of the output.
+char *string_builder_escape_scalar(char *destination, const char *string, size_t length, const StringBuilderEscaper *escaper) {
+    while (length > 0) {
+        size_t clean_length = string_builder_scan_scalar(string, length, escaper->specials, escaper->special_count, escaper->controls);
+        memcpy(destination, string, clean_length);
+        destination += clean_length;
+        if (clean_length == length) {
+            break;
+        }
+        destination = escaper->escape(destination, string[clean_length]);
+        string += clean_length + 1;
+        length -= clean_length + 1;
+    }
+    return destination;
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+// Escapes the specials of a block whose special characters are the set
+// bits of `mask`, and returns the end of the output.
+char *string_builder_escape_block(char *destination, const char *block, size_t block_size, uint32_t mask, const StringBuilderEscaper *escaper) {
+    size_t copied = 0;
+    while (mask != 0) {
+        size_t special = __builtin_ctz(mask);
+        memcpy(destination, block + copied, special - copied);
+        destination += special - copied;
+        destination = escaper->escape(destination, block[special]);
+        copied = special + 1;
+        mask &= mask - 1;
+    }
+    memcpy(destination, block + copied, block_size - copied);
+    return destination + block_size - copied;
+}
+
+// Blocks without specials are stored as they are. The worst case is
+// reserved, so the output always has room for a whole block.
+char *string_builder_escape_sse2(char *destination, const char *string, size_t length, const StringBuilderEscaper *escaper) {
+    // Kept in locals, the stores through `destination` could alias the escaper.
+    const size_t special_count = escaper->special_count;
+    const int controls = escaper->controls;
+    __m128i special_vectors[STRING_BUILDER_MAX_SPECIALS];
+    for (size_t j = 0; j < special_count; j++) {
+        special_vectors[j] = _mm_set1_epi8(escaper->specials[j]);
+    }
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        __m128i found = controls ? _mm_cmpeq_epi8(_mm_max_epu8(block, last_control), last_control) : _mm_setzero_si128();
+        for (size_t j = 0; j < special_count; j++) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(block, special_vectors[j]));
+        }
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(found);
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)destination, block);
+            destination += 16;
+        } else {
+            destination = string_builder_escape_block(destination, string + i, 16, mask, escaper);
+        }
+    }
+
+    return string_builder_escape_scalar(destination, string + i, length - i, escaper);
+}
+
+__attribute__((target("avx2")))
+char *string_builder_escape_avx2(char *destination, const char *string, size_t length, const StringBuilderEscaper *escaper) {
+    // Kept in locals, the stores through `destination` could alias the escaper.
+    const size_t special_count = escaper->special_count;
+    const int controls = escaper->controls;
+    __m256i special_vectors[STRING_BUILDER_MAX_SPECIALS];
+    for (size_t j = 0; j < special_count; j++) {
+        special_vectors[j] = _mm256_set1_epi8(escaper->specials[j]);
+    }
+    const __m256i last_control = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+
+    // Two blocks per iteration, so that clean text costs one branch per
+    // 64 bytes.
+    for (; i + 64 <= length; i += 64) {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(string + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(string + i + 32));
+        __m256i first_found = controls ? _mm256_cmpeq_epi8(_mm256_max_epu8(first, last_control), last_control) : _mm256_setzero_si256();
+        __m256i second_found = controls ? _mm256_cmpeq_epi8(_mm256_max_epu8(second, last_control), last_control) : _mm256_setzero_si256();
+        for (size_t j = 0; j < special_count; j++) {
+            first_found = _mm256_or_si256(first_found, _mm256_cmpeq_epi8(first, special_vectors[j]));
+            second_found = _mm256_or_si256(second_found, _mm256_cmpeq_epi8(second, special_vectors[j]));
+        }
+        if (_mm256_testz_si256(_mm256_or_si256(first_found, second_found), _mm256_or_si256(first_found, second_found))) {
+            _mm256_storeu_si256((__m256i *)destination, first);
+            _mm256_storeu_si256((__m256i *)(destination + 32), second);
+            destination += 64;
+        } else {
+            destination = string_builder_escape_block(destination, string + i, 32, (uint32_t)_mm256_movemask_epi8(first_found), escaper);
+            destination = string_builder_escape_block(destination, string + i + 32, 32, (uint32_t)_mm256_movemask_epi8(second_found), escaper);
+        }
+    }
+
+    return string_builder_escape_sse2(destination, string + i, length - i, escaper);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+// Appends `length` characters from `string` escaped by `escaper`, with
+// `max_escape_length` characters reserved for every one of them.
+void string_builder_append_escaped(StringBuilder *builder, const char *string, size_t length, const StringBuilderEscaper *escaper, size_t max_escape_length) {
+    string_builder_reserve_append(builder, length * max_escape_length);
+    char *destination = builder->string + builder->length;
+
+#ifdef STRING_BUILDER_X86_SIMD
+    STRING_BUILDER_ASSERT(escaper->special_count <= STRING_BUILDER_MAX_SPECIALS);
+    if (string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2) {
+        destination = string_builder_escape_avx2(destination, string, length, escaper);
+    } else {
+        destination = string_builder_escape_sse2(destination, string, length, escaper);
+    }
+#else
+    destination = string_builder_escape_scalar(destination, string, length, escaper);
+#endif // STRING_BUILDER_X86_SIMD
+
+    *destination = '\0';
+    builder->length = destination - builder->string;
+}
+
+char *string_builder_escape_json(char *destination, char c) {
+    *destination++ = '\\';
+    switch (c) {
+        case '"':  *destination++ = '"';  break;
+        case '\\': *destination++ = '\\'; break;
+        case '\b': *destination++ = 'b';  break;
+        case '\f': *destination++ = 'f';  break;
+        case '\n': *destination++ = 'n';  break;
+        case '\r': *destination++ = 'r';  break;
+        case '\t': *destination++ = 't';  break;
+        default:
+            memcpy(destination, "u00", 3);
+            destination[3] = string_builder_hex_digits[(unsigned char)c >> 4];
+            destination[4] = string_builder_hex_digits[c & 0xf];
+            destination += 5;
+            break;
+    }
+    return destination;
+}
+
+void string_builder_append_json_escaped(StringBuilder *builder, const char *string, size_t length) {
+    static const StringBuilderEscaper escaper = { "\"\\", 2, 1, string_builder_escape_json };
+    // \u00XX is the longest escape.
+    string_builder_append_escaped(builder, string, length, &escaper, 6);
+}
+
+char *string_builder_escape_html(char *destination, char c) {
+    const char *reference;
+    switch (c) {
+        case '&': reference = "&amp;";  break;
+        case '<': reference = "&lt;";   break;
+        case '>': reference = "&gt;";   break;
+        case '"': reference = "&quot;"; break;
+        default:  reference = "&#39;";  break;
+    }
+    size_t reference_length = strlen(reference);
+    memcpy(destination, reference, reference_length);
+    return destination + reference_length;
+}
+
+void string_builder_append_html_escaped(StringBuilder *builder, const char *string, size_t length) {
+    static const StringBuilderEscaper escaper = { "&<>\"'", 5, 0, string_builder_escape_html };
+    // &quot; is the longest reference.
+    string_builder_append_escaped(builder, string, length, &escaper, 6);
+}
+
+char *string_builder_escape_doubled(char *destination, char c) {
+    destination[0] = c;
+    destination[1] = c;
+    return destination + 2;
+}
+
+void string_builder_append_csv_field(StringBuilder *builder, const char *string, size_t length) {
+    if (string_builder_scan(string, length, ",\"\r\n", 4, 0) == length) {
+        string_builder_append_n(builder, string, length);
+        return;
+    }
+
+    static const StringBuilderEscaper escaper = { "\"", 1, 0, string_builder_escape_doubled };
+    string_builder_append_char(builder, '"');
+    string_builder_append_escaped(builder, string, length, &escaper, 2);
+    string_builder_append_char(builder, '"');
+}
+
+char *string_builder_escape_single_quote(char *destination, char c) {
+    (void)c;
+    memcpy(destination, "'\\''", 4);
+    return destination + 4;
+}
+
+void string_builder_append_shell_quoted(StringBuilder *builder, const char *string, size_t length) {
+    static const StringBuilderEscaper escaper = { "'", 1, 0, string_builder_escape_single_quote };
+    string_builder_append_char(builder, '\'');
+    // A quote becomes '\''.
+    string_builder_append_escaped(builder, string, length, &escaper, 4);
+    string_builder_append_char(builder, '\'');
+}
+
+// UTF-8.
+//
+// The validation follows "Validating UTF-8 In Less Than One Instruction
+// Per Byte" (Keiser and Lemire), which simdutf uses: three table lookups,
+// on the high and low nibble of each byte's predecessor and on the high
+// nibble of the byte itself, flag every invalid pair of bytes. Then the
+// bytes that must continue a three or four-byte sequence are checked
+// against the positions of the lead bytes two and three bytes before.
+
+#define STRING_BUILDER_UTF8_TOO_SHORT  (1 << 0) // A lead byte not followed by a continuation
+#define STRING_BUILDER_UTF8_TOO_LONG   (1 << 1) // A continuation after ASCII
+#define STRING_BUILDER_UTF8_OVERLONG_3 (1 << 2) // E0 80..9F
+#define STRING_BUILDER_UTF8_TOO_LARGE  (1 << 3) // F4 90..BF, F5..FF
+#define STRING_BUILDER_UTF8_SURROGATE  (1 << 4) // ED A0..BF
+#define STRING_BUILDER_UTF8_OVERLONG_2 (1 << 5) // C0, C1
+#define STRING_BUILDER_UTF8_TOO_LARGE_1000 (1 << 6) // F5..FF 80..8F
+#define STRING_BUILDER_UTF8_OVERLONG_4 (1 << 6) // F0 80..8F
+#define STRING_BUILDER_UTF8_TWO_CONTS  (1 << 7) // Two continuations, valid only inside longer sequences
+#define STRING_BUILDER_UTF8_CARRY (STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_TWO_CONTS)
+
+// Returns the length of the valid UTF-8 sequence at the start of `string`,
+// or 0 if there is none. Then `*invalid_length` is the length of the
+// maximal invalid part, which is replaced by one U+FFFD.
+size_t string_builder_utf8_sequence(const unsigned char *string, size_t length, size_t *invalid_length) {
+    unsigned char lead = string[0];
+    unsigned char lower = 0x80;
+    unsigned char upper = 0xBF;
+    size_t sequence_length;
+    if (lead < 0x80) {
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        sequence_length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        sequence_length = 3;
+        lower = lead == 0xE0 ? 0xA0 : 0x80; // Overlong
+        upper = lead == 0xED ? 0x9F : 0xBF; // Surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        sequence_length = 4;
+        lower = lead == 0xF0 ? 0x90 : 0x80; // Overlong
+        upper = lead == 0xF4 ? 0x8F : 0xBF; // Past U+10FFFF
+    } else {
+        *invalid_length = 1;
+        return 0;
+    }
+
+    for (size_t i = 1; i < sequence_length; i++) {
+        if (i >= length || string[i] < lower || string[i] > upper) {
+            *invalid_length = i;
+            return 0;
+        }
+        lower = 0x80;
+        upper = 0xBF;
+    }
+    return sequence_length;
+}
+
+// Copies `length` bytes and returns 0 if they are valid UTF-8.
+int string_builder_utf8_copy_scalar(char *destination, const char *string, size_t length) {
+    memcpy(destination, string, length);
+    const unsigned char *input = (const unsigned char *)string;
+    size_t i = 0;
+    while (i < length) {
+        uint64_t word;
+        if (i + 8 <= length && (memcpy(&word, input + i, 8), (word & 0x8080808080808080ull) == 0)) {
+            i += 8;
+            continue;
+        }
+        size_t invalid_length;
+        size_t sequence_length = string_builder_utf8_sequence(input + i, length - i, &invalid_length);
+        if (sequence_length == 0) {
+            return 1;
+        }
+        i += sequence_length;
+    }
+    return 0;
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+__attribute__((target("ssse3")))
+__m128i string_builder_utf8_errors_ssse3(__m128i input, __m128i previous) {
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        // 0_______: ASCII
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        // 10______: continuation
+        (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS,
+        // 1100____, 1101____: two-byte lead
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_2,
+        STRING_BUILDER_UTF8_TOO_SHORT,
+        // 1110____: three-byte lead
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_SURROGATE,
+        // 1111____: four-byte lead
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_OVERLONG_4),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_OVERLONG_2),
+        (char)STRING_BUILDER_UTF8_CARRY,
+        (char)STRING_BUILDER_UTF8_CARRY,
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_SURROGATE),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000));
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        // 0_______: ASCII
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT,
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT,
+        // 1000____
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_OVERLONG_4),
+        // 1001____
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_TOO_LARGE),
+        // 101_____
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_SURROGATE | STRING_BUILDER_UTF8_TOO_LARGE),
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_SURROGATE | STRING_BUILDER_UTF8_TOO_LARGE),
+        // 11______: lead
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT);
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+
+    __m128i previous_1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(previous_1, 4), low_nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(previous_1, low_nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // The high bit is set where a lead byte two or three bytes back
+    // requires a continuation; special_cases flags exactly the
+    // continuations that follow another one, so the two must agree.
+    __m128i is_third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i is_fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must_continue, special_cases);
+}
+
+// Nonzero where a block ends in the middle of a sequence.
+__attribute__((target("ssse3")))
+__m128i string_builder_utf8_incomplete_ssse3(__m128i input) {
+    const __m128i max_complete = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm_subs_epu8(input, max_complete);
+}
+
+__attribute__((target("ssse3")))
+int string_builder_utf8_copy_ssse3(char *destination, const char *string, size_t length) {
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();
+    __m128i previous_incomplete = _mm_setzero_si128();
+    size_t i = 0;
+    for (;;) {
+        __m128i input;
+        int last = i + 16 > length;
+        if (!last) {
+            input = _mm_loadu_si128((const __m128i *)(string + i));
+            _mm_storeu_si128((__m128i *)(destination + i), input);
+        } else {
+            // The zeros after the end are ASCII, so a sequence cut off by
+            // the end is too short.
+            char tail[16] = {0};
+            memcpy(tail, string + i, length - i);
+            memcpy(destination + i, tail, length - i);
+            input = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, previous_incomplete);
+        } else {
+            error = _mm_or_si128(error, string_builder_utf8_errors_ssse3(input, previous));
+            previous_incomplete = string_builder_utf8_incomplete_ssse3(input);
+        }
+        previous = input;
+        if (last) {
+            break;
+        }
+        i += 16;
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+__m256i string_builder_utf8_errors_avx2(__m256i input, __m256i previous) {
+    // The tables of string_builder_utf8_errors_ssse3() in both lanes.
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_2,
+        STRING_BUILDER_UTF8_TOO_SHORT,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_SURROGATE,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_OVERLONG_4,
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG, STRING_BUILDER_UTF8_TOO_LONG,
+        (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS, (char)STRING_BUILDER_UTF8_TWO_CONTS,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_2,
+        STRING_BUILDER_UTF8_TOO_SHORT,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_SURROGATE,
+        STRING_BUILDER_UTF8_TOO_SHORT | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_OVERLONG_4);
+    const __m256i byte_1_low_table = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_OVERLONG_4),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_OVERLONG_2),
+        (char)STRING_BUILDER_UTF8_CARRY,
+        (char)STRING_BUILDER_UTF8_CARRY,
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_SURROGATE),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000),
+        (char)(STRING_BUILDER_UTF8_CARRY | STRING_BUILDER_UTF8_TOO_LARGE | STRING_BUILDER_UTF8_TOO_LARGE_1000)));
+    const __m256i byte_2_high_table = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT,
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT,
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_TOO_LARGE_1000 | STRING_BUILDER_UTF8_OVERLONG_4),
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_OVERLONG_3 | STRING_BUILDER_UTF8_TOO_LARGE),
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_SURROGATE | STRING_BUILDER_UTF8_TOO_LARGE),
+        (char)(STRING_BUILDER_UTF8_TOO_LONG | STRING_BUILDER_UTF8_OVERLONG_2 | STRING_BUILDER_UTF8_TWO_CONTS | STRING_BUILDER_UTF8_SURROGATE | STRING_BUILDER_UTF8_TOO_LARGE),
+        STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT, STRING_BUILDER_UTF8_TOO_SHORT));
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+
+    // The bytes before each byte, across the middle of the register too.
+    __m256i before = _mm256_permute2x128_si256(previous, input, 0x21);
+    __m256i previous_1 = _mm256_alignr_epi8(input, before, 15);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(previous_1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(previous_1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    __m256i is_third = _mm256_subs_epu8(_mm256_alignr_epi8(input, before, 14), _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth = _mm256_subs_epu8(_mm256_alignr_epi8(input, before, 13), _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special_cases);
+}
+
+__attribute__((target("avx2")))
+int string_builder_utf8_copy_avx2(char *destination, const char *string, size_t length) {
+    const __m256i max_complete = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i error = _mm256_setzero_si256();
+    __m256i previous = _mm256_setzero_si256();
+    __m256i previous_incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+    for (;;) {
+        __m256i input;
+        int last = i + 32 > length;
+        if (!last) {
+            input = _mm256_loadu_si256((const __m256i *)(string + i));
+            _mm256_storeu_si256((__m256i *)(destination + i), input);
+        } else {
+            char tail[32] = {0};
+            memcpy(tail, string + i, length - i);
+            memcpy(destination + i, tail, length - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, previous_incomplete);
+        } else {
+            error = _mm256_or_si256(error, string_builder_utf8_errors_avx2(input, previous));
+            previous_incomplete = _mm256_subs_epu8(input, max_complete);
+        }
+        previous = input;
+        if (last) {
+            break;
+        }
+        i += 32;
+    }
+    return !_mm256_testz_si256(error, error);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+int string_builder_utf8_copy(char *destination, const char *string, size_t length) {
+#ifdef STRING_BUILDER_X86_SIMD
+    int simd_level = string_builder_simd_level();
+    if (simd_level >= STRING_BUILDER_SIMD_AVX2) {
+        return string_builder_utf8_copy_avx2(destination, string, length);
+    } else if (simd_level >= STRING_BUILDER_SIMD_SSSE3) {
+        return string_builder_utf8_copy_ssse3(destination, string, length);
+    }
+#endif // STRING_BUILDER_X86_SIMD
+    return string_builder_utf8_copy_scalar(destination, string, length);
+}
+
+// Copies `length` bytes, with U+FFFD for each maximal invalid part, and
+// returns the end of the copy.
+char *string_builder_utf8_replace(char *destination, const char *string, size_t length) {
+    const unsigned char *input = (const unsigned char *)string;
+    size_t i = 0;
+    while (i < length) {
+        size_t invalid_length;
+        size_t sequence_length = string_builder_utf8_sequence(input + i, length - i, &invalid_length);
+        if (sequence_length == 0) {
+            memcpy(destination, "\xEF\xBF\xBD", 3);
+            destination += 3;
+            i += invalid_length;
+        } else {
+            memcpy(destination, input + i, sequence_length);
+            destination += sequence_length;
+            i += sequence_length;
+        }
+    }
+    return destination;
+}
+
+int string_builder_append_utf8_validated(StringBuilder *builder, const char *string, size_t length, int mode) {
+    STRING_BUILDER_ASSERT(mode == STRING_BUILDER_UTF8_REJECT || mode == STRING_BUILDER_UTF8_REPLACE);
+    string_builder_reserve_append(builder, length);
+    char *destination = builder->string + builder->length;
+
+    if (string_builder_utf8_copy(destination, string, length) == 0) {
+        destination[length] = '\0';
+        builder->length += length;
+        return 0;
+    }
+
+    if (mode == STRING_BUILDER_UTF8_REPLACE) {
+        // Invalid input is rare, it's copied again from the start. A byte
+        // is replaced by at most three, and the string may move.
+        string_builder_reserve_append(builder, length * 3);
+        destination = string_builder_utf8_replace(builder->string + builder->length, string, length);
+    }
+    *destination = '\0';
+    builder->length = destination - builder->string;
+    return 1;
+}
+
+// Writes `codepoint` in UTF-8, or U+FFFD if it isn't a valid scalar value,
+// and returns the end of it.
+char *string_builder_encode_codepoint(char *destination, uint32_t codepoint) {
+    if (codepoint < 0x80) {
+        *destination++ = (char)codepoint;
+    } else if (codepoint < 0x800) {
+        *destination++ = (char)(0xC0 | (codepoint >> 6));
+        *destination++ = (char)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+            codepoint = 0xFFFD;
+        }
+        *destination++ = (char)(0xE0 | (codepoint >> 12));
+        *destination++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        *destination++ = (char)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x110000) {
+        *destination++ = (char)(0xF0 | (codepoint >> 18));
+        *destination++ = (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        *destination++ = (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        *destination++ = (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        destination = string_builder_encode_codepoint(destination, 0xFFFD);
+    }
+    return destination;
+}
+
+void string_builder_append_codepoint(StringBuilder *builder, uint32_t codepoint) {
+    string_builder_reserve_append(builder, 4);
+    char *end = string_builder_encode_codepoint(builder->string + builder->length, codepoint);
+    *end = '\0';
+    builder->length = end - builder->string;
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+// Converts the leading blocks of `string` that are all ASCII, and returns
+// how many units that was.
+size_t string_builder_utf16_ascii_sse2(char *destination, const uint16_t *string, size_t length) {
+    const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i first = _mm_loadu_si128((const __m128i *)(string + i));
+        __m128i second = _mm_loadu_si128((const __m128i *)(string + i + 8));
+        __m128i high_bits = _mm_and_si128(_mm_or_si128(first, second), non_ascii);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, _mm_setzero_si128())) != 0xFFFF) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(destination + i), _mm_packus_epi16(first, second));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_utf16_ascii_avx2(char *destination, const uint16_t *string, size_t length) {
+    const __m256i non_ascii = _mm256_set1_epi16((short)0xFF80);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(string + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(string + i + 16));
+        __m256i high_bits = _mm256_and_si256(_mm256_or_si256(first, second), non_ascii);
+        if (!_mm256_testz_si256(high_bits, high_bits)) {
+            break;
+        }
+        // packus works within lanes, the permute puts the quarters in order.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(first, second), 0xD8);
+        _mm256_storeu_si256((__m256i *)(destination + i), packed);
+    }
+    return i + string_builder_utf16_ascii_sse2(destination + i, string + i, length - i);
+}
+
+size_t string_builder_latin1_ascii_sse2(char *destination, const char *string, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(string + i));
+        if (_mm_movemask_epi8(block) != 0) {
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(destination + i), block);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_latin1_ascii_avx2(char *destination, const char *string, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(string + i));
+        if (_mm256_movemask_epi8(block) != 0) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)(destination + i), block);
+    }
+    return i + string_builder_latin1_ascii_sse2(destination + i, string + i, length - i);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+// The scalar loops of the transcoders handle this many units after a
+// block that isn't all ASCII, before trying the vectorized ones again.
+#define STRING_BUILDER_TRANSCODE_STRIDE 32
+
+void string_builder_append_utf16(StringBuilder *builder, const uint16_t *string, size_t length) {
+    // A unit becomes at most three bytes, and a surrogate pair four.
+    string_builder_reserve_append(builder, length * 3);
+    char *destination = builder->string + builder->length;
+#ifdef STRING_BUILDER_X86_SIMD
+    int avx2 = string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2;
+#endif // STRING_BUILDER_X86_SIMD
+
+    size_t i = 0;
+    while (i < length) {
+#ifdef STRING_BUILDER_X86_SIMD
+        size_t ascii_length = avx2 ? string_builder_utf16_ascii_avx2(destination, string + i, length - i)
+                                   : string_builder_utf16_ascii_sse2(destination, string + i, length - i);
+        destination += ascii_length;
+        i += ascii_length;
+#endif // STRING_BUILDER_X86_SIMD
+        size_t stride_end = length - i > STRING_BUILDER_TRANSCODE_STRIDE ? i + STRING_BUILDER_TRANSCODE_STRIDE : length;
+        while (i < stride_end) {
+            uint32_t unit = string[i++];
+            if (unit >= 0xD800 && unit <= 0xDBFF && i < length && string[i] >= 0xDC00 && string[i] <= 0xDFFF) {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (string[i++] - 0xDC00);
+            }
+            // An unpaired surrogate is encoded as U+FFFD.
+            destination = string_builder_encode_codepoint(destination, unit);
+        }
+    }
+
+    *destination = '\0';
+    builder->length = destination - builder->string;
+}
+
+void string_builder_append_latin1(StringBuilder *builder, const char *string, size_t length) {
+    string_builder_reserve_append(builder, length * 2);
+    char *destination = builder->string + builder->length;
+#ifdef STRING_BUILDER_X86_SIMD
+    int avx2 = string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2;
+#endif // STRING_BUILDER_X86_SIMD
+
+    size_t i = 0;
+    while (i < length) {
+#ifdef STRING_BUILDER_X86_SIMD
+        size_t ascii_length = avx2 ? string_builder_latin1_ascii_avx2(destination, string + i, length - i)
+                                   : string_builder_latin1_ascii_sse2(destination, string + i, length - i);
+        destination += ascii_length;
+        i += ascii_length;
+#endif // STRING_BUILDER_X86_SIMD
+        size_t stride_end = length - i > STRING_BUILDER_TRANSCODE_STRIDE ? i + STRING_BUILDER_TRANSCODE_STRIDE : length;
+        for (; i < stride_end; i++) {
+            unsigned char c = (unsigned char)string[i];
+            if (c < 0x80) {
+                *destination++ = (char)c;
+            } else {
+                *destination++ = (char)(0xC0 | (c >> 6));
+                *destination++ = (char)(0x80 | (c & 0x3F));
+            }
+        }
+    }
+
+    *destination = '\0';
+    builder->length = destination - builder->string;
+}
+
+// Continuation bytes are 10xxxxxx, -128 to -65 as signed chars.
+size_t string_builder_count_codepoints_scalar(const char *string, size_t length) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        count += (signed char)string[i] > -65;
+    }
+    return count;
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+size_t string_builder_count_codepoints_sse2(const char *string, size_t length) {
+    const __m128i last_continuation = _mm_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= length) {
+        // Per-byte counters, summed before any of them can overflow.
+        __m128i counters = _mm_setzero_si128();
+        for (int block = 0; block < 255 && i + 16 <= length; block++, i += 16) {
+            __m128i input = _mm_loadu_si128((const __m128i *)(string + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpgt_epi8(input, last_continuation));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si64(sums) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    return count + string_builder_count_codepoints_scalar(string + i, length - i);
+}
+
+__attribute__((target("avx2")))
+size_t string_builder_count_codepoints_avx2(const char *string, size_t length) {
+    const __m256i last_continuation = _mm256_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 32 <= length) {
+        __m256i counters = _mm256_setzero_si256();
+        for (int block = 0; block < 255 && i + 32 <= length; block++, i += 32) {
+            __m256i input = _mm256_loadu_si256((const __m256i *)(string + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpgt_epi8(input, last_continuation));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+                 (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+    }
+    return count + string_builder_count_codepoints_sse2(string + i, length - i);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+size_t string_builder_codepoint_count(StringBuilder *builder) {
+    if (builder->counted_length > builder->length) {
+        string_builder_forget_codepoints(builder);
+    }
+
+    // Continuation bytes are never counted, so where the new part starts
+    // in the middle of a sequence doesn't matter.
+    const char *uncounted = builder->string + builder->counted_length;
+    size_t uncounted_length = builder->length - builder->counted_length;
+#ifdef STRING_BUILDER_X86_SIMD
+    if (string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2) {
+        builder->codepoint_count += string_builder_count_codepoints_avx2(uncounted, uncounted_length);
+    } else {
+        builder->codepoint_count += string_builder_count_codepoints_sse2(uncounted, uncounted_length);
+    }
+#else
+    builder->codepoint_count += string_builder_count_codepoints_scalar(uncounted, uncounted_length);
+#endif // STRING_BUILDER_X86_SIMD
+    builder->counted_length = builder->length;
+    return builder->codepoint_count;
+}
+
+void string_builder_append_base64(StringBuilder *builder, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    char *destination = string_builder_extend(builder, (size + 2) / 3 * 4);
+    size_t encoded = 0;
+
+#ifdef STRING_BUILDER_X86_SIMD
+    int simd_level = string_builder_simd_level();
+    if (simd_level >= STRING_BUILDER_SIMD_AVX2) {
+        encoded = string_builder_write_base64_avx2(destination, bytes, size);
+    }
+    if (simd_level >= STRING_BUILDER_SIMD_SSSE3) {
+        encoded += string_builder_write_base64_ssse3(destination + encoded / 3 * 4, bytes + encoded, size - encoded);
+    }
+#endif // STRING_BUILDER_X86_SIMD
+
+    string_builder_write_base64_scalar(destination + encoded / 3 * 4, bytes + encoded, size - encoded);
+}
+
+void string_builder_insert(StringBuilder *builder, size_t insert_index, const char *inserted_string) {
+    size_t old_length = builder->length;
+    STRING_BUILDER_ASSERT(insert_index <= old_length);
+    size_t inserted_length = strlen(inserted_string);
+    size_t new_length = old_length + inserted_length;
+    string_builder_ensure_capacity(builder, new_length);
+    string_builder_begin_edit(builder);
+
+    char *insert_at = builder->string + insert_index;
+    char *after_insert = insert_at + inserted_length;
+    memmove(after_insert, insert_at, old_length - insert_index + 1);
+    STRING_BUILDER_STATS_ADD(builder, bytes_moved, old_length - insert_index + 1);
+    memcpy(insert_at, inserted_string, inserted_length);
+
+    builder->length = new_length;
+}
+
+typedef struct {
+    size_t      index;
+    size_t      order; // In the caller's array, so that equal indices keep it
+    const char *string;
+    size_t      length;
+} StringBuilderSortedInsertion;
+
+int string_builder_compare_insertions(const void *left, const void *right) {
+    const StringBuilderSortedInsertion *a = (const StringBuilderSortedInsertion *)left;
+    const StringBuilderSortedInsertion *b = (const StringBuilderSortedInsertion *)right;
+    if (a->index != b->index) {
+        return a->index < b->index ? -1 : 1;
+    }
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+// Insertions up to this many are sorted on the stack.
+#define STRING_BUILDER_INSERTIONS_ON_STACK 32
+
+void string_builder_insert_many(StringBuilder *builder, const StringBuilderInsertion *insertions, size_t count) {
+    size_t old_length = builder->length;
+    StringBuilderSortedInsertion stack_insertions[STRING_BUILDER_INSERTIONS_ON_STACK];
+    StringBuilderSortedInsertion *sorted = stack_insertions;
+    if (count > STRING_BUILDER_INSERTIONS_ON_STACK) {
+        sorted = (StringBuilderSortedInsertion *)STRING_BUILDER_MALLOC(count * sizeof *sorted);
+    }
+
+    size_t new_length = old_length;
+    int in_order = 1;
+    for (size_t i = 0; i < count; i++) {
+        STRING_BUILDER_ASSERT(insertions[i].index <= old_length);
+        sorted[i].index = insertions[i].index;
+        sorted[i].order = i;
+        sorted[i].string = insertions[i].string;
+        sorted[i].length = strlen(insertions[i].string);
+        new_length += sorted[i].length;
+        in_order = in_order && (i == 0 || sorted[i - 1].index <= sorted[i].index);
+    }
+    if (!in_order) {
+        qsort(sorted, count, sizeof *sorted, string_builder_compare_insertions);
+    }
+
+    string_builder_ensure_capacity(builder, new_length);
+    string_builder_begin_edit(builder);
+
+    // From the end, move the text after each insertion to where it ends up,
+    // then write the insertion in front of it. Nothing is moved twice, and
+    // nothing is overwritten before it has been moved.
+    char *inner = builder->string;
+    size_t read = old_length;
+    size_t write = new_length;
+    inner[new_length] = '\0';
+    for (size_t i = count; i-- > 0;) {
+        const StringBuilderSortedInsertion *insertion = &sorted[i];
+        size_t moved_length = read - insertion->index;
+        write -= moved_length;
+        memmove(inner + write, inner + insertion->index, moved_length);
+        STRING_BUILDER_STATS_ADD(builder, bytes_moved, moved_length);
+        write -= insertion->length;
+        memcpy(inner + write, insertion->string, insertion->length);
+        read = insertion->index;
+    }
+
+    builder->length = new_length;
+    if (sorted != stack_insertions) {
+        STRING_BUILDER_FREE(sorted);
+    }
+}
+
+// Substring search.
+//
+// The vectorized kernels compare the first and the last byte of the
+// pattern against 16 (SSE2) or 32 (AVX2) positions of the string at once
+// and only check the bytes in between for the positions where both match.
+// string_builder_find_first() returns the first match in `haystack`,
+// string_builder_find_last() returns the last one. Both return NULL
+// if there is no match. They do up to `needle_length` comparisons per
+// position, so searchers use them only for short patterns.
+
+const char *string_builder_find_scalar(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    if (needle_length > haystack_length) {
+        return NULL;
+    }
+
+    const char *last_start = haystack + (haystack_length - needle_length);
+    while (haystack <= last_start) {
+        haystack = (const char *)memchr(haystack, *needle, last_start - haystack + 1);
+        if (haystack == NULL) {
+            return NULL;
+        }
+        if (memcmp(haystack + 1, needle + 1, needle_length - 1) == 0) {
+            return haystack;
+        }
+        haystack++;
+    }
+
+    return NULL;
+}
+
+const char *string_builder_find_last_scalar(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    if (needle_length > haystack_length) {
+        return NULL;
+    }
+
+    const char *candidate = haystack + (haystack_length - needle_length);
+    while (1) {
+        if (*candidate == *needle && memcmp(candidate + 1, needle + 1, needle_length - 1) == 0) {
+            return candidate;
+        }
+        if (candidate == haystack) {
+            return NULL;
+        }
+        candidate--;
+    }
+}
+
+#ifdef STRING_BUILDER_X86_SIMD
+// Checks the candidates in `mask` (bit i is the position `block + i`) from
+// the lowest one up. The first and the last byte are known to match.
+const char *string_builder_check_candidates(const char *block, uint32_t mask, const char *needle, size_t needle_length) {
+    while (mask != 0) {
+        const char *candidate = block + __builtin_ctz(mask);
+        if (memcmp(candidate + 1, needle + 1, needle_length - 2) == 0) {
+            return candidate;
+        }
+        mask &= mask - 1;
+    }
+    return NULL;
+}
+
+// Same as string_builder_check_candidates(), but from the highest one down.
+const char *string_builder_check_candidates_last(const char *block, uint32_t mask, const char *needle, size_t needle_length) {
+    while (mask != 0) {
+        int bit = 31 - __builtin_clz(mask);
+        const char *candidate = block + bit;
+        if (memcmp(candidate + 1, needle + 1, needle_length - 2) == 0) {
+            return candidate;
+        }
+        mask &= ~((uint32_t)1 << bit);
+    }
+    return NULL;
+}
+
+const char *string_builder_find_sse2(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    size_t positions = haystack_length - needle_length + 1;
+    size_t i = 0;
+
+    for (; i + 16 <= positions; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_length - 1));
+        __m128i equal = _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last));
+        const char *found = string_builder_check_candidates(haystack + i, (uint32_t)_mm_movemask_epi8(equal), needle, needle_length);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    return string_builder_find_scalar(haystack + i, haystack_length - i, needle, needle_length);
+}
+
+const char *string_builder_find_last_sse2(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    size_t positions = haystack_length - needle_length + 1;
+
+    for (; positions >= 16; positions -= 16) {
+        const char *block = haystack + positions - 16;
+        __m128i block_first = _mm_loadu_si128((const __m128i *)block);
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(block + needle_length - 1));
+        __m128i equal = _mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last));
+        const char *found = string_builder_check_candidates_last(block, (uint32_t)_mm_movemask_epi8(equal), needle, needle_length);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    return string_builder_find_last_scalar(haystack, positions + needle_length - 1, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+const char *string_builder_find_avx2(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    size_t positions = haystack_length - needle_length + 1;
+    size_t i = 0;
+
+    for (; i + 32 <= positions; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_length - 1));
+        __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last));
+        const char *found = string_builder_check_candidates(haystack + i, (uint32_t)_mm256_movemask_epi8(equal), needle, needle_length);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    return string_builder_find_sse2(haystack + i, haystack_length - i, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+const char *string_builder_find_last_avx2(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    size_t positions = haystack_length - needle_length + 1;
+
+    for (; positions >= 32; positions -= 32) {
+        const char *block = haystack + positions - 32;
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)block);
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(block + needle_length - 1));
+        __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first), _mm256_cmpeq_epi8(last, block_last));
+        const char *found = string_builder_check_candidates_last(block, (uint32_t)_mm256_movemask_epi8(equal), needle, needle_length);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    return string_builder_find_last_sse2(haystack, positions + needle_length - 1, needle, needle_length);
+}
+#endif // STRING_BUILDER_X86_SIMD
+
+const char *string_builder_find_first(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    if (needle_length > haystack_length) {
+        return NULL;
+    }
+    if (needle_length == 1) {
+        return (const char *)memchr(haystack, *needle, haystack_length);
+    }
+
+#ifdef STRING_BUILDER_X86_SIMD
+    if (string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2) {
+        return string_builder_find_avx2(haystack, haystack_length, needle, needle_length);
+    }
+    return string_builder_find_sse2(haystack, haystack_length, needle, needle_length);
+#else
+    return string_builder_find_scalar(haystack, haystack_length, needle, needle_length);
+#endif // STRING_BUILDER_X86_SIMD
+}
+
+const char *string_builder_find_last(const char *haystack, size_t haystack_length, const char *needle, size_t needle_length) {
+    if (needle_length > haystack_length) {
+        return NULL;
+    }
+
+#ifdef STRING_BUILDER_X86_SIMD
+    if (needle_length == 1) {
+        return string_builder_find_last_scalar(haystack, haystack_length, needle, needle_length);
+    }
+    if (string_builder_simd_level() >= STRING_BUILDER_SIMD_AVX2) {
+        return string_builder_find_last_avx2(haystack, haystack_length, needle, needle_length);
+    }
+    return string_builder_find_last_sse2(haystack, haystack_length, needle, needle_length);
+#else
+    return string_builder_find_last_scalar(haystack, haystack_length, needle, needle_length);
+#endif // STRING_BUILDER_X86_SIMD
+}
+
+// Patterns up to this long are searched with string_builder_find_first()
+// and string_builder_find_last(), longer ones with Two-Way.
+#define STRING_BUILDER_SEARCH_SHORT 16
+
+// Reads byte `index` of a string that is read in the direction of `step`,
+// 1 from its first byte or -1 from its last one.
+unsigned char string_builder_byte_at(const unsigned char *string, size_t index, ptrdiff_t step) {
+    return string[(ptrdiff_t)index * step];
+}
+
+// Returns the start of the maximal suffix of the pattern, one past it,
+// for the byte order given by `greater` (1) or its opposite (-1), and
+// puts the period of the suffix in `*period`.
+size_t string_builder_maximal_suffix(const unsigned char *pattern, size_t length, ptrdiff_t step, int greater, size_t *period) {
+    size_t suffix = 0;    // One past the start of the best suffix so far
+    size_t candidate = 1; // One past the start of the one compared with it
+    size_t offset = 1;
+    *period = 1;
+    while (candidate + offset <= length) {
+        unsigned char suffix_byte = string_builder_byte_at(pattern, suffix + offset - 1, step);
+        unsigned char candidate_byte = string_builder_byte_at(pattern, candidate + offset - 1, step);
+        if (suffix_byte == candidate_byte) {
+            if (offset == *period) {
+                candidate += *period;
+                offset = 1;
+            } else {
+                offset++;
+            }
+        } else if ((suffix_byte > candidate_byte) == (greater > 0)) {
+            candidate += offset;
+            offset = 1;
+            *period = candidate - suffix;
+        } else {
+            suffix = candidate++;
+            offset = 1;
+            *period = 1;
+        }
+    }
+    return suffix;
+}
+
+void string_builder_search_table_init(StringBuilderSearchTable *table, const unsigned char *pattern, size_t length, ptrdiff_t step) {
+    // The critical factorization splits the pattern at the later of the
+    // two maximal suffixes.
+    size_t period;
+    size_t opposite_period;
+    size_t split = string_builder_maximal_suffix(pattern, length, step, 1, &period);
+    size_t opposite_split = string_builder_maximal_suffix(pattern, length, step, -1, &opposite_period);
+    if (opposite_split > split) {
+        split = opposite_split;
+        period = opposite_period;
+    }
+
+    int periodic = 1;
+    for (size_t i = 0; i < split && periodic; i++) {
+        periodic = string_builder_byte_at(pattern, i, step) == string_builder_byte_at(pattern, i + period, step);
+    }
+    table->split = split;
+    if (periodic) {
+        // After a shift by the period, the first `length - period` bytes
+        // still match.
+        table->period = period;
+        table->memory = length - period;
+    } else {
+        table->period = (split - 1 > length - split ? split - 1 : length - split) + 1;
+        table->memory = 0;
+    }
+
+    // Horspool: how far the pattern can move so that the byte under its
+    // last byte meets the last occurrence of that byte in the pattern.
+    uint32_t longest_shift = length < UINT32_MAX ? (uint32_t)length : UINT32_MAX;
+    for (int byte = 0; byte < 256; byte++) {
+        table->shifts[byte] = longest_shift;
+    }
+    for (size_t i = 0; i < length; i++) {
+        size_t shift = length - 1 - i;
+        table->shifts[string_builder_byte_at(pattern, i, step)] = shift < UINT32_MAX ? (uint32_t)shift : UINT32_MAX;
+    }
+}
+
+// Two-Way (Crochemore and Perrin) with the Horspool shifts of musl: the
+// right half of the pattern is compared from the split forward, the left
+// half from the split back, and the shifts keep every byte of `text` from
+// being compared more than twice. Both are read in the direction of
+// `step`. Returns the position of the first match in that direction.
+size_t string_builder_two_way(const StringBuilderSearchTable *table, const unsigned char *pattern, size_t length, const unsigned char *text, size_t text_length, ptrdiff_t step) {
+    size_t position = 0;
+    size_t memory = 0; // Bytes at the start of the pattern known to match
+    while (text_length - position >= length) {
+        size_t shift = table->shifts[string_builder_byte_at(text, position + length - 1, step)];
+        if (shift != 0) {
+            position += shift > memory ? shift : memory;
+            memory = 0;
+            continue;
+        }
+
+        size_t i = table->split > memory ? table->split : memory;
+        while (i < length && string_builder_byte_at(pattern, i, step) == string_builder_byte_at(text, position + i, step)) {
+            i++;
+        }
+        if (i < length) {
+            position += i - table->split + 1;
+            memory = 0;
+            continue;
+        }
+
+        i = table->split;
+        while (i > memory && string_builder_byte_at(pattern, i - 1, step) == string_builder_byte_at(text, position + i - 1, step)) {
+            i--;
+        }
+        if (i <= memory) {
+            return position;
+        }
+        position += table->period;
+        memory = table->memory;
+    }
+    return STRING_BUILDER_NOT_FOUND;
+}
+
+StringBuilderSearcher string_builder_searcher_new(const char *pattern) {
+    StringBuilderSearcher searcher;
+    memset(&searcher, 0, sizeof searcher);
+    searcher.pattern = pattern;
+    searcher.length = strlen(pattern);
+    STRING_BUILDER_ASSERT(searcher.length > 0);
+
+    if (searcher.length > STRING_BUILDER_SEARCH_SHORT) {
+        const unsigned char *bytes = (const unsigned char *)pattern;
+        string_builder_search_table_init(&searcher.forward, bytes, searcher.length, 1);
+        string_builder_search_table_init(&searcher.backward, bytes + searcher.length - 1, searcher.length, -1);
+    }
+    return searcher;
+}
+
+// Returns the first match in the `length` characters of `text`, or NULL.
+//
+// A long pattern is found by its first STRING_BUILDER_SEARCH_SHORT
+// characters, which is much faster than Two-Way on most text, and the
+// rest of it is compared after them. Once those comparisons add up to
+// more than the text they got through, the rest of the text is searched
+// with Two-Way, so a pattern whose start is everywhere stays linear.
+const char *string_builder_searcher_next(const StringBuilderSearcher *searcher, const char *text, size_t length) {
+    if (searcher->length <= STRING_BUILDER_SEARCH_SHORT) {
+        return string_builder_find_first(text, length, searcher->pattern, searcher->length);
+    }
+
+    const char *const text_end = text + length;
+    const char *rest = searcher->pattern + STRING_BUILDER_SEARCH_SHORT;
+    size_t rest_length = searcher->length - STRING_BUILDER_SEARCH_SHORT;
+    const char *unsearched = text;
+    size_t compared = 0;
+    while (compared <= (size_t)(unsearched - text) + searcher->length) {
+        const char *candidate = string_builder_find_first(unsearched, text_end - unsearched, searcher->pattern, STRING_BUILDER_SEARCH_SHORT);
+        if (candidate == NULL || (size_t)(text_end - candidate) < searcher->length) {
+            return NULL;
+        }
+        if (memcmp(candidate + STRING_BUILDER_SEARCH_SHORT, rest, rest_length) == 0) {
+            return candidate;
+        }
+        compared += rest_length;
+        unsearched = candidate + 1;
+    }
+
+    size_t position = string_builder_two_way(&searcher->forward, (const unsigned char *)searcher->pattern, searcher->length,
+                                             (const unsigned char *)unsearched, text_end - unsearched, 1);
+    return position != STRING_BUILDER_NOT_FOUND ? unsearched + position : NULL;
+}
+
+// Returns the last match in the `length` characters of `text`, or NULL.
+// Same as string_builder_searcher_next(), from the end: a long pattern is
+// found by its last STRING_BUILDER_SEARCH_SHORT characters.
+const char *string_builder_searcher_previous(const StringBuilderSearcher *searcher, const char *text, size_t length) {
+    if (searcher->length <= STRING_BUILDER_SEARCH_SHORT) {
+        return string_builder_find_last(text, length, searcher->pattern, searcher->length);
+    }
+
+    size_t rest_length = searcher->length - STRING_BUILDER_SEARCH_SHORT;
+    const char *suffix = searcher->pattern + rest_length;
+    size_t unsearched_length = length;
+    size_t compared = 0;
+    while (compared <= (length - unsearched_length) + searcher->length) {
+        const char *candidate = string_builder_find_last(text, unsearched_length, suffix, STRING_BUILDER_SEARCH_SHORT);
+        if (candidate == NULL || (size_t)(candidate - text) < rest_length) {
+            return NULL;
+        }
+        if (memcmp(candidate - rest_length, searcher->pattern, rest_length) == 0) {
+            return candidate - rest_length;
+        }
+        compared += rest_length;
+        unsearched_length = (candidate - text) + STRING_BUILDER_SEARCH_SHORT - 1;
+    }
+    if (unsearched_length == 0) {
+        return NULL;
+    }
+
+    // The same search, of the reversed pattern in the reversed text.
+    size_t position = string_builder_two_way(&searcher->backward, (const unsigned char *)searcher->pattern + searcher->length - 1, searcher->length,
+                                             (const unsigned char *)text + unsearched_length - 1, unsearched_length, -1);
+    return position != STRING_BUILDER_NOT_FOUND ? text + (unsearched_length - position - searcher->length) : NULL;
+}
+
+// Counts the matches in `text` that don't overlap, from the start.
+size_t string_builder_searcher_count(const StringBuilderSearcher *searcher, const char *text, size_t length) {
+    const char *const text_end = text + length;
+    size_t count = 0;
+    while ((text = string_builder_searcher_next(searcher, text, text_end - text)) != NULL) {
+        count++;
+        text += searcher->length;
+    }
+    return count;
+}
+
+size_t string_builder_find(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t from) {
+    if (from >= builder->length) {
+        return STRING_BUILDER_NOT_FOUND;
+    }
+    const char *match = string_builder_searcher_next(searcher, builder->string + from, builder->length - from);
+    return match != NULL ? (size_t)(match - builder->string) : STRING_BUILDER_NOT_FOUND;
+}
+
+size_t string_builder_rfind(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t end) {
+    if (end > builder->length) {
+        end = builder->length;
+    }
+    const char *match = string_builder_searcher_previous(searcher, builder->string, end);
+    return match != NULL ? (size_t)(match - builder->string) : STRING_BUILDER_NOT_FOUND;
+}
+
+size_t string_builder_find_all(const StringBuilder *builder, const StringBuilderSearcher *searcher, size_t *offsets, size_t max_offsets) {
+    const char *text = builder->string;
+    const char *const text_end = text + builder->length;
+    size_t count = 0;
+    while ((text = string_builder_searcher_next(searcher, text, text_end - text)) != NULL) {
+        if (count < max_offsets) {
+            offsets[count] = text - builder->string;
+        }
+        count++;
+        text += searcher->length;
+    }
+    return count;
+}
+
+int string_builder_count_substrings(StringBuilder *builder, const char *substring) {
+    StringBuilderSearcher searcher = string_builder_searcher_new(substring);
+    return (int)string_builder_searcher_count(&searcher, builder->string, builder->length);
+}
+
+void string_builder_replace_searched(StringBuilder *builder, const StringBuilderSearcher *searcher, const char *replacement) {
+    STRING_BUILDER_STATS_TIMER(start);
+    size_t length = builder->length;
+    size_t old_substring_length = searcher->length;
+    size_t new_substring_length = strlen(replacement);
+    size_t substring_count = string_builder_searcher_count(searcher, builder->string, length);
+    STRING_BUILDER_STATS_ADD(builder, replace_passes, 1);
+    if (substring_count == 0) {
+        STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
+        return;
+    }
+
+    size_t new_length = length + (new_substring_length - old_substring_length) * substring_count;
+    string_builder_ensure_capacity(builder, new_length);
+    string_builder_begin_edit(builder);
+
+    // I don't want to allocate any memory in the function.
+    // To do that, all the copying and replacing has to be done
+    // in the same memory where the initial string is located.
+    //
+    // When the old substring is bigger than the new one, we
+    // can iterate the string from the beginning and
+    // insert the new substrings as we go: this won't overwrite
+    // any other string data because the new substring is smaller.
+    //
+    // In the other case, the string from the first match on is
+    // moved to the end of the new length first, and then rewritten
+    // from the beginning the same way. The writes can't catch up
+    // with the reads: the gap between them starts as big as all the
+    // growth, and only shrinks by the growth of the replaced matches.
+    //
+    // Going from the end instead would pick other matches when the
+    // substring overlaps itself, and string_builder_find_all() and
+    // string_builder_count_substrings() go from the beginning:
+    // ```
+    // string: aaa
+    // replace: aa -> bbb
+    // from the beginning: bbba
+    // from the end: abbb
+    // ```
+
+    char *inner = builder->string;
+    char *copy_iterator = inner;
+    const char *read_iterator = inner;
+    const char *inner_end = inner + length;
+    const char *match;
+    if (new_substring_length > old_substring_length) {
+        size_t growth = new_length - length;
+        copy_iterator = (char *)string_builder_searcher_next(searcher, inner, length);
+        memmove(copy_iterator + growth, copy_iterator, inner_end - copy_iterator);
+        STRING_BUILDER_STATS_ADD(builder, bytes_moved, inner_end - copy_iterator);
+        read_iterator = copy_iterator + growth;
+        inner_end += growth;
+    }
+
+    while ((match = string_builder_searcher_next(searcher, read_iterator, inner_end - read_iterator)) != NULL) {
+        size_t kept_length = match - read_iterator;
+        memmove(copy_iterator, read_iterator, kept_length);
+        STRING_BUILDER_STATS_ADD(builder, bytes_moved, kept_length);
+        copy_iterator += kept_length;
+        memcpy(copy_iterator, replacement, new_substring_length);
+        copy_iterator += new_substring_length;
+        read_iterator = match + old_substring_length;
+    }
+
+    size_t kept_length = inner_end - read_iterator;
+    memmove(copy_iterator, read_iterator, kept_length);
+    STRING_BUILDER_STATS_ADD(builder, bytes_moved, kept_length);
+    copy_iterator[kept_length] = '\0';
+
+    builder->length = new_length;
+    STRING_BUILDER_STATS_ADD(builder, replace_passes, 1);
+    STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
+}
+
+void string_builder_replace(StringBuilder *builder, const char *string_to_replace, const char *replacement) {
+    StringBuilderSearcher searcher = string_builder_searcher_new(string_to_replace);
+    string_builder_replace_searched(builder, &searcher, replacement);
+}
+
+void string_builder_replace_range(StringBuilder *builder, size_t start, size_t length, const char *replacement) {
+    size_t old_length = builder->length;
+    STRING_BUILDER_ASSERT(start <= old_length && length <= old_length - start);
+    size_t replacement_length = strlen(replacement);
+    size_t new_length = old_length - length + replacement_length;
+    string_builder_ensure_capacity(builder, new_length);
+    string_builder_begin_edit(builder);
+
+    char *range = builder->string + start;
+    size_t kept_length = old_length - start - length + 1;
+    memmove(range + replacement_length, range + length, kept_length);
+    STRING_BUILDER_STATS_ADD(builder, bytes_moved, kept_length);
+    memcpy(range, replacement, replacement_length);
+
+    builder->length = new_length;
+}
+
+#ifdef STRING_BUILDER_THREADS
+// A piece of the string that one thread searches and rewrites on its own.
+typedef struct {
+    const char *text;
+    size_t      length;
+    const StringBuilderSearcher *searcher;
+    const char *replacement;
+    size_t      replacement_length;
+    char       *output; // Where the chunk goes in the result
+    size_t      count;  // Matches in the chunk
+} StringBuilderParallelChunk;
+
+// Moves `cut` forward to the first position that no match straddles,
+// so the text before and after it can be searched separately and give
+// the same matches as one search of the whole text, whichever direction
+// it goes in. Returns `length` if there's no such position.
+size_t string_builder_parallel_cut(const char *text, size_t length, size_t cut, const StringBuilderSearcher *searcher) {
+    size_t needle_length = searcher->length;
+    while (cut < length) {
+        size_t window_start = cut > needle_length - 1 ? cut - (needle_length - 1) : 0;
+        size_t window_end = length - cut > needle_length - 1 ? cut + (needle_length - 1) : length;
+        const char *match = string_builder_searcher_next(searcher, text + window_start, window_end - window_start);
+        if (match == NULL || (size_t)(match - text) >= cut) {
+            return cut;
+        }
+        // Every position inside the match is straddled by it.
+        cut = (size_t)(match - text) + needle_length;
+    }
+    return length;
+}
+
+// Splits the string into at most `thread_count` chunks of at least
+// STRING_BUILDER_PARALLEL_MIN_CHUNK bytes. Returns the number of chunks.
+size_t string_builder_parallel_split(const StringBuilder *builder, const StringBuilderSearcher *searcher, int thread_count, StringBuilderParallelChunk *chunks) {
+    size_t length = builder->length;
+    if (thread_count <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = online > 0 ? (int)online : 1;
+    }
+    if (thread_count > STRING_BUILDER_MAX_THREADS) {
+        thread_count = STRING_BUILDER_MAX_THREADS;
+    }
+    if ((size_t)thread_count > length / STRING_BUILDER_PARALLEL_MIN_CHUNK) {
+        thread_count = (int)(length / STRING_BUILDER_PARALLEL_MIN_CHUNK);
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    size_t chunk_count = 0;
+    size_t start = 0;
+    for (int i = 1; i <= thread_count; i++) {
+        size_t cut = length;
+        if (i < thread_count) {
+            size_t even_cut = length / thread_count * i;
+            cut = string_builder_parallel_cut(builder->string, length, even_cut > start ? even_cut : start, searcher);
+        }
+
+        StringBuilderParallelChunk *chunk = &chunks[chunk_count++];
+        chunk->text = builder->string + start;
+        chunk->length = cut - start;
+        chunk->searcher = searcher;
+        chunk->replacement = NULL;
+        chunk->replacement_length = 0;
+        chunk->output = NULL;
+        chunk->count = 0;
+        if (cut == length) {
+            break;
+        }
+        start = cut;
+    }
+    return chunk_count;
+}
+
+// Runs `work` on every chunk, each on its own thread. The calling thread
+// takes the first chunk, and chunks whose thread can't be started.
+void string_builder_parallel_run(void *(*work)(void *), StringBuilderParallelChunk *chunks, size_t chunk_count) {
+    pthread_t threads[STRING_BUILDER_MAX_THREADS];
+    int started[STRING_BUILDER_MAX_THREADS];
+    for (size_t i = 1; i < chunk_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, work, &chunks[i]) == 0;
+        if (!started[i]) {
+            work(&chunks[i]);
+        }
+    }
+
+    work(&chunks[0]);
+
+    for (size_t i = 1; i < chunk_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+void *string_builder_parallel_count(void *argument) {
+    StringBuilderParallelChunk *chunk = (StringBuilderParallelChunk *)argument;
+    chunk->count = string_builder_searcher_count(chunk->searcher, chunk->text, chunk->length);
+    return NULL;
+}
+
+// Writes the chunk with its matches replaced, picked from the start like
+// string_builder_replace() does.
+void *string_builder_parallel_write(void *argument) {
+    StringBuilderParallelChunk *chunk = (StringBuilderParallelChunk *)argument;
+    const StringBuilderSearcher *searcher = chunk->searcher;
+    const char *read_iterator = chunk->text;
+    const char *const text_end = read_iterator + chunk->length;
+    char *write_iterator = chunk->output;
+    const char *match;
+
+    while ((match = string_builder_searcher_next(searcher, read_iterator, text_end - read_iterator)) != NULL) {
+        size_t kept_length = match - read_iterator;
+        memcpy(write_iterator, read_iterator, kept_length);
+        write_iterator += kept_length;
+        memcpy(write_iterator, chunk->replacement, chunk->replacement_length);
+        write_iterator += chunk->replacement_length;
+        read_iterator = match + searcher->length;
+    }
+    memcpy(write_iterator, read_iterator, text_end - read_iterator);
+
+    return NULL;
+}
+
+size_t string_builder_count_substrings_parallel(StringBuilder *builder, const char *substring, int thread_count) {
+    StringBuilderSearcher searcher = string_builder_searcher_new(substring);
+    StringBuilderParallelChunk chunks[STRING_BUILDER_MAX_THREADS];
+    size_t chunk_count = string_builder_parallel_split(builder, &searcher, thread_count, chunks);
+    string_builder_parallel_run(string_builder_parallel_count, chunks, chunk_count);
+
+    size_t substring_count = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        substring_count += chunks[i].count;
+    }
+    return substring_count;
+}
+
+void string_builder_replace_parallel(StringBuilder *builder, const char *string_to_replace, const char *replacement, int thread_count) {
+    size_t length = builder->length;
+    StringBuilderSearcher searcher = string_builder_searcher_new(string_to_replace);
+    size_t old_substring_length = searcher.length;
+    size_t new_substring_length = strlen(replacement);
+
+    StringBuilderParallelChunk chunks[STRING_BUILDER_MAX_THREADS];
+    size_t chunk_count = string_builder_parallel_split(builder, &searcher, thread_count, chunks);
+    int in_place = chunk_count <= 1 || builder->sink != NULL;
+#ifdef STRING_BUILDER_MAPPED
+    in_place = in_place || string_builder_is_mapped(builder);
+#endif // STRING_BUILDER_MAPPED
+    if (in_place) {
+        // Not worth a second buffer, or the buffer can't be swapped.
+        string_builder_replace_searched(builder, &searcher, replacement);
+        return;
+    }
+
+    STRING_BUILDER_STATS_TIMER(start);
+    string_builder_parallel_run(string_builder_parallel_count, chunks, chunk_count);
+    STRING_BUILDER_STATS_ADD(builder, replace_passes, 1);
+
+    size_t substring_count = 0;
+    for (size_t i = 0; i < chunk_count; i++) {
+        substring_count += chunks[i].count;
+    }
+    if (substring_count == 0) {
+        STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
+        return;
+    }
+
+    size_t new_length = length + (new_substring_length - old_substring_length) * substring_count;
+    size_t new_capacity = builder->capacity;
+    if (new_length >= new_capacity) {
+        StringBuilderGrowthPolicy growth = builder->growth != NULL ? builder->growth : string_builder_growth_geometric;
+        new_capacity = growth(new_capacity, new_length);
+    }
+    char *new_string = (char *)string_builder_allocate(builder, new_capacity);
+
+    // Each chunk starts where the ones before it end in the result.
+    char *output = new_string;
+    for (size_t i = 0; i < chunk_count; i++) {
+        StringBuilderParallelChunk *chunk = &chunks[i];
+        chunk->replacement = replacement;
+        chunk->replacement_length = new_substring_length;
+        chunk->output = output;
+        output += chunk->length + (new_substring_length - old_substring_length) * chunk->count;
+    }
+    string_builder_parallel_run(string_builder_parallel_write, chunks, chunk_count);
+    new_string[new_length] = '\0';
+
+    string_builder_deallocate_string(builder);
+    builder->string = new_string;
+    builder->capacity = new_capacity;
+    builder->length = new_length;
+    string_builder_forget_codepoints(builder);
+    STRING_BUILDER_STATS_CAPACITY(builder);
+    STRING_BUILDER_STATS_ADD(builder, replace_passes, 1);
+    STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
+}
+#endif // STRING_BUILDER_THREADS
+
+#define STRING_BUILDER_ALPHABET_SIZE 256
+StringBuilderAutomaton string_builder_automaton_new(const StringBuilderReplacement *replacements, size_t count) {
+    STRING_BUILDER_ASSERT(count > 0);
+
+    StringBuilderAutomaton automaton;
+    automaton.pattern_count = count;
+    automaton.pattern_lengths = (size_t *)STRING_BUILDER_MALLOC(count * sizeof *automaton.pattern_lengths);
+    automaton.replacement_lengths = (size_t *)STRING_BUILDER_MALLOC(count * sizeof *automaton.replacement_lengths);
+    automaton.replacements = (char **)STRING_BUILDER_MALLOC(count * sizeof *automaton.replacements);
+    automaton.grows = 0;
+    automaton.longest_pattern = 0;
+
+    size_t max_states = 1;
+    for (size_t i = 0; i < count; i++) {
+        size_t pattern_length = strlen(replacements[i].pattern);
+        size_t replacement_length = strlen(replacements[i].replacement);
+        STRING_BUILDER_ASSERT(pattern_length > 0);
+
+        char *replacement = (char *)STRING_BUILDER_MALLOC(replacement_length + 1);
+        memcpy(replacement, replacements[i].replacement, replacement_length + 1);
+
+        automaton.pattern_lengths[i] = pattern_length;
+        automaton.replacement_lengths[i] = replacement_length;
+        automaton.replacements[i] = replacement;
+        if (replacement_length > pattern_length) {
+            automaton.grows = 1;
+        }
+        if (pattern_length > automaton.longest_pattern) {
+            automaton.longest_pattern = pattern_length;
+        }
+        max_states += pattern_length;
+    }
+
+    int32_t *transitions = (int32_t *)STRING_BUILDER_MALLOC(max_states * STRING_BUILDER_ALPHABET_SIZE * sizeof *transitions);
+    int32_t *matches = (int32_t *)STRING_BUILDER_MALLOC(max_states * sizeof *matches);
+    memset(transitions, 0xff, max_states * STRING_BUILDER_ALPHABET_SIZE * sizeof *transitions);
+    matches[0] = -1;
+
+    // Build the trie of all the reversed patterns. Missing transitions are
+    // -1 for now.
+    size_t state_count = 1;
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *pattern = (const unsigned char *)replacements[i].pattern;
+        size_t state = 0;
+        for (size_t j = automaton.pattern_lengths[i]; j > 0; j--) {
+            int32_t *next = &transitions[state * STRING_BUILDER_ALPHABET_SIZE + pattern[j - 1]];
+            if (*next < 0) {
+                *next = (int32_t)state_count;
+                matches[state_count] = -1;
+                state_count++;
+            }
+            state = (size_t)*next;
+        }
+
+        if (matches[state] < 0) {
+            matches[state] = (int32_t)i;
+        }
+    }
+
+    // Turn the trie into a DFA by following the failure links breadth first.
+    // A state's failure link always has a smaller depth, so it is finished
+    // before the state itself is visited. That lets every state inherit the
+    // longest pattern that ends in it from its failure link.
+    int32_t *failures = (int32_t *)STRING_BUILDER_MALLOC(state_count * sizeof *failures);
+    int32_t *queue = (int32_t *)STRING_BUILDER_MALLOC(state_count * sizeof *queue);
+    size_t queue_start = 0;
+    size_t queue_end = 0;
+
+    for (int c = 0; c < STRING_BUILDER_ALPHABET_SIZE; c++) {
+        int32_t next = transitions[c];
+        if (next < 0) {
+            transitions[c] = 0;
+        } else {
+            failures[next] = 0;
+            queue[queue_end++] = next;
+        }
+    }
+
+    while (queue_start < queue_end) {
+        int32_t state = queue[queue_start++];
+        int32_t failure = failures[state];
+        if (matches[state] < 0) {
+            matches[state] = matches[failure];
+        }
+
+        int32_t *row = &transitions[(size_t)state * STRING_BUILDER_ALPHABET_SIZE];
+        const int32_t *failure_row = &transitions[(size_t)failure * STRING_BUILDER_ALPHABET_SIZE];
+        for (int c = 0; c < STRING_BUILDER_ALPHABET_SIZE; c++) {
+            if (row[c] < 0) {
+                row[c] = failure_row[c];
+            } else {
+                failures[row[c]] = failure_row[c];
+                queue[queue_end++] = row[c];
+            }
+        }
+    }
+
+    STRING_BUILDER_FREE(queue);
+    STRING_BUILDER_FREE(failures);
+
+    automaton.state_count = state_count;
+    automaton.transitions = transitions;
+    automaton.matches = matches;
+    return automaton;
+}
+
+void string_builder_automaton_free(StringBuilderAutomaton *automaton) {
+    for (size_t i = 0; i < automaton->pattern_count; i++) {
+        STRING_BUILDER_FREE(automaton->replacements[i]);
+    }
+    STRING_BUILDER_FREE(automaton->replacements);
+    STRING_BUILDER_FREE(automaton->replacement_lengths);
+    STRING_BUILDER_FREE(automaton->pattern_lengths);
+    STRING_BUILDER_FREE(automaton->matches);
+    STRING_BUILDER_FREE(automaton->transitions);
+    automaton->state_count = 0;
+    automaton->pattern_count = 0;
+}
+
+// The patterns that start at each position of a string, found with the
+// automaton of the reversed patterns from the end of a block of positions
+// back to its start. A pattern that starts in the block can end past it,
+// so the automaton starts up to `longest_pattern - 1` characters after the
+// block. Where it starts doesn't matter otherwise: no pattern is longer.
+#define STRING_BUILDER_MATCHES_BLOCK 4096
+
+typedef struct {
+    const StringBuilderAutomaton *automaton;
+    const char *text;
+    size_t      length;
+    size_t      block_start;
+    size_t      block_end;
+    size_t      block_size;
+    int32_t    *longest; // The longest pattern that starts at `block_start + i`, or -1
+} StringBuilderMatches;
+
+// `block` has room for STRING_BUILDER_MATCHES_BLOCK positions. A block has
+// to be longer than the longest pattern, or the same characters would go
+// through the automaton again and again, so a bigger one is allocated then.
+void string_builder_matches_init(StringBuilderMatches *matches, const StringBuilderAutomaton *automaton, const char *text, size_t length, int32_t *block) {
+    matches->automaton = automaton;
+    matches->text = text;
+    matches->length = length;
+    matches->block_start = 0;
+    matches->block_end = 0;
+    matches->block_size = STRING_BUILDER_MATCHES_BLOCK;
+    matches->longest = block;
+    if (automaton->longest_pattern > STRING_BUILDER_MATCHES_BLOCK) {
+        matches->block_size = automaton->longest_pattern;
+        matches->longest = (int32_t *)STRING_BUILDER_MALLOC(matches->block_size * sizeof *matches->longest);
+    }
+}
+
+void string_builder_matches_free(StringBuilderMatches *matches, int32_t *block) {
+    if (matches->longest != block) {
+        STRING_BUILDER_FREE(matches->longest);
+    }
+}
+
+void string_builder_matches_fill(StringBuilderMatches *matches, size_t block_start) {
+    const StringBuilderAutomaton *automaton = matches->automaton;
+    const int32_t *transitions = automaton->transitions;
+    const unsigned char *text = (const unsigned char *)matches->text;
+    size_t length = matches->length;
+    size_t block_end = length - block_start > matches->block_size ? block_start + matches->block_size : length;
+    size_t scan_end = length - block_end > automaton->longest_pattern - 1 ? block_end + automaton->longest_pattern - 1 : length;
+
+    size_t state = 0;
+    for (size_t i = scan_end; i > block_end; i--) {
+        state = (size_t)transitions[state * STRING_BUILDER_ALPHABET_SIZE + text[i - 1]];
+    }
+    for (size_t i = block_end; i > block_start; i--) {
+        state = (size_t)transitions[state * STRING_BUILDER_ALPHABET_SIZE + text[i - 1]];
+        // The longest pattern that ends in the state, which is the longest
+        // one that starts at i - 1 in the string.
+        matches->longest[i - 1 - block_start] = automaton->matches[state];
+    }
+
+    matches->block_start = block_start;
+    matches->block_end = block_end;
+}
+
+// Finds the leftmost-longest match that starts at or after `from`.
+// `from` never goes back.
+int string_builder_matches_next(StringBuilderMatches *matches, size_t from, size_t *match_start, size_t *match_index) {
+    for (size_t i = from; i < matches->length; i++) {
+        if (i >= matches->block_end) {
+            string_builder_matches_fill(matches, i);
+        }
+        int32_t match = matches->longest[i - matches->block_start];
+        if (match >= 0) {
+            *match_start = i;
+            *match_index = (size_t)match;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void string_builder_replace_many(StringBuilder *builder, const StringBuilderAutomaton *automaton) {
+    STRING_BUILDER_STATS_TIMER(start);
+    size_t length = builder->length;
+    size_t match_start;
+    size_t match_index;
+    size_t read = 0;
+    size_t write = 0;
+    int32_t block[STRING_BUILDER_MATCHES_BLOCK];
+    StringBuilderMatches matches;
+
+    if (!automaton->grows) {
+        // Every replacement fits into its pattern, so the write position
+        // never overtakes the read position.
+        string_builder_begin_edit(builder);
+        char *inner = builder->string;
+        string_builder_matches_init(&matches, automaton, inner, length, block);
+        while (string_builder_matches_next(&matches, read, &match_start, &match_index)) {
+            size_t replacement_length = automaton->replacement_lengths[match_index];
+            memmove(inner + write, inner + read, match_start - read);
+            STRING_BUILDER_STATS_ADD(builder, bytes_moved, match_start - read);
+            write += match_start - read;
+            memcpy(inner + write, automaton->replacements[match_index], replacement_length);
+            write += replacement_length;
+            read = match_start + automaton->pattern_lengths[match_index];
+        }
+        memmove(inner + write, inner + read, length - read);
+        STRING_BUILDER_STATS_ADD(builder, bytes_moved, length - read);
+        write += length - read;
+        inner[write] = '\0';
+        string_builder_matches_free(&matches, block);
+
+        builder->length = write;
+        STRING_BUILDER_STATS_ADD(builder, replace_passes, 1);
+        STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
+        return;
+    }
+
+    // Replacements can also shrink the string, so besides the final length
+    // keep the longest the string gets while it's rewritten from the start.
+    size_t new_length = length;
+    size_t max_length = length;
+    string_builder_matches_init(&matches, automaton, builder->string, length, block);
+    while (string_builder_matches_next(&matches, read, &match_start, &match_index)) {
+        new_length += automaton->replacement_lengths[match_index];
+        new_length -= automaton->pattern_lengths[match_index];
+        if (new_length > max_length) {
+            max_length = new_length;
+        }
+        read = match_start + automaton->pattern_lengths[match_index];
+    }
+    string_builder_matches_free(&matches, block);
+
+    // Move the string forward by the most it grows and rewrite it from the
+    // start. The output is never ahead of the input by more than that, so
+    // the writes never reach the part that is still to be read.
+    string_builder_ensure_capacity(builder, max_length);
+    string_builder_begin_edit(builder);
+    char *inner = builder->string;
+    size_t shift = max_length - length;
+    memmove(inner + shift, inner, length);
+    STRING_BUILDER_STATS_ADD(builder, bytes_moved, length);
+    const char *original = inner + shift;
 
-StringBuilder string_builder_new() {
-    return string_builder_new_with_capacity(STRING_BUILDER_DEFAULT_CAPACITY);
+    read = 0;
+    string_builder_matches_init(&matches, automaton, original, length, block);
+    while (string_builder_matches_next(&matches, read, &match_start, &match_index)) {
+        size_t replacement_length = automaton->replacement_lengths[match_index];
+        memmove(inner + write, original + read, match_start - read);
+        STRING_BUILDER_STATS_ADD(builder, bytes_moved, match_start - read);
+        write += match_start - read;
+        memcpy(inner + write, automaton->replacements[match_index], replacement_length);
+        write += replacement_length;
+        read = match_start + automaton->pattern_lengths[match_index];
+    }
+    memmove(inner + write, original + read, length - read);
+    STRING_BUILDER_STATS_ADD(builder, bytes_moved, length - read);
+    inner[new_length] = '\0';
+    string_builder_matches_free(&matches, block);
+
+    builder->length = new_length;
+    STRING_BUILDER_STATS_ADD(builder, replace_passes, 2);
+    STRING_BUILDER_STATS_ELAPSED(builder, replace_nanoseconds, start);
 }
 
-StringBuilder string_builder_new_with_capacity(size_t capacity) {
-    STRING_BUILDER_ASSERT(capacity > 0);
+StringRope string_rope_new() {
+    StringRope rope;
+    rope.length = 0;
+    rope.root = NULL;
+    rope.seed = 0x9e3779b9u;
+    return rope;
+}
 
-    char *inner = STRING_BUILDER_MALLOC(capacity * sizeof *inner);
-    *inner = '\0';
+StringRope string_rope_new_from(const char *string) {
+    StringRope rope = string_rope_new();
+    string_rope_append(&rope, string);
+    return rope;
+}
 
-    StringBuilder builder;
-    builder.length = 0;
-    builder.capacity = capacity;
-    builder.string = inner;
-    return builder;
+void string_rope_free_node(StringRopeNode *node) {
+    if (node != NULL) {
+        string_rope_free_node(node->left);
+        string_rope_free_node(node->right);
+        STRING_BUILDER_FREE(node);
+    }
 }
 
-StringBuilder string_builder_new_from(const char *string) {
-    size_t length = strlen(string);
-    size_t capacity = length + 1;
-    char *copy = STRING_BUILDER_MALLOC(capacity * sizeof *copy);
-    memcpy(copy, string, capacity);
+void string_rope_free(StringRope *rope) {
+    string_rope_free_node(rope->root);
+    rope->root = NULL;
+    rope->length = 0;
+}
 
-    StringBuilder builder;
-    builder.length = length;
-    builder.capacity = capacity;
-    builder.string = copy;
-    return builder;
+size_t string_rope_total_length(const StringRopeNode *node) {
+    return node != NULL ? node->total_length : 0;
 }
 
-void string_builder_free(StringBuilder *builder) {
-    builder->length = 0;
-    builder->capacity = 0;
-    STRING_BUILDER_FREE(builder->string);
+void string_rope_update(StringRopeNode *node) {
+    node->total_length = string_rope_total_length(node->left) + node->length + string_rope_total_length(node->right);
 }
 
-void string_builder_ensure_capacity(StringBuilder *builder, size_t expected_length) {
-    size_t new_capacity = builder->capacity;
-    while (expected_length >= new_capacity) {
-        new_capacity *= STRING_BUILDER_RESIZE_FACTOR;
+StringRopeNode *string_rope_new_node(StringRope *rope, const char *chunk, size_t length) {
+    STRING_BUILDER_ASSERT(length <= STRING_ROPE_CHUNK_SIZE);
+
+    // xorshift32, only used to keep the treap balanced.
+    uint32_t seed = rope->seed;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    rope->seed = seed;
+
+    StringRopeNode *node = (StringRopeNode *)STRING_BUILDER_MALLOC(sizeof *node);
+    node->left = NULL;
+    node->right = NULL;
+    node->priority = seed;
+    node->length = length;
+    node->total_length = length;
+    memcpy(node->chunk, chunk, length);
+    return node;
+}
+
+StringRopeNode *string_rope_merge(StringRopeNode *left, StringRopeNode *right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+
+    if (left->priority > right->priority) {
+        left->right = string_rope_merge(left->right, right);
+        string_rope_update(left);
+        return left;
+    } else {
+        right->left = string_rope_merge(left, right->left);
+        string_rope_update(right);
+        return right;
     }
+}
 
-    char *new_string = STRING_BUILDER_REALLOC(builder->string, new_capacity);
+// Splits the tree so that `*left` holds the first `index` characters and
+// `*right` holds the rest. A chunk that contains `index` is cut in two.
+void string_rope_split(StringRope *rope, StringRopeNode *node, size_t index, StringRopeNode **left, StringRopeNode **right) {
+    if (node == NULL) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
 
-    builder->capacity = new_capacity;
-    builder->string = new_string;
+    size_t left_length = string_rope_total_length(node->left);
+    if (index <= left_length) {
+        string_rope_split(rope, node->left, index, left, &node->left);
+        string_rope_update(node);
+        *right = node;
+    } else if (index >= left_length + node->length) {
+        string_rope_split(rope, node->right, index - left_length - node->length, &node->right, right);
+        string_rope_update(node);
+        *left = node;
+    } else {
+        size_t cut = index - left_length;
+        StringRopeNode *tail = string_rope_new_node(rope, node->chunk + cut, node->length - cut);
+        *right = string_rope_merge(tail, node->right);
+        node->length = cut;
+        node->right = NULL;
+        string_rope_update(node);
+        *left = node;
+    }
 }
 
-void string_builder_append(StringBuilder *builder, const char *string) {
-    string_builder_append_n(builder, string, strlen(string));
+// Copies as much of `string` as fits into the free space of the last chunk.
+size_t string_rope_fill_last_chunk(StringRopeNode *node, const char *string, size_t length) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    size_t filled;
+    if (node->right != NULL) {
+        filled = string_rope_fill_last_chunk(node->right, string, length);
+    } else {
+        filled = STRING_ROPE_CHUNK_SIZE - node->length;
+        if (filled > length) {
+            filled = length;
+        }
+        memcpy(node->chunk + node->length, string, filled);
+        node->length += filled;
+    }
+
+    node->total_length += filled;
+    return filled;
 }
 
-void string_builder_append_n(StringBuilder *builder, const char *string, size_t length) {
-    size_t old_length = builder->length;
-    size_t new_length = old_length + length;
-    string_builder_ensure_capacity(builder, new_length);
+// Appends `string` to the tree `node` and returns the new root.
+StringRopeNode *string_rope_append_to(StringRope *rope, StringRopeNode *node, const char *string, size_t length) {
+    size_t filled = string_rope_fill_last_chunk(node, string, length);
+    string += filled;
+    length -= filled;
 
-    char *inner_end = builder->string + old_length;
-    memcpy(inner_end, string, length + 1);
+    while (length > 0) {
+        size_t chunk_length = length < STRING_ROPE_CHUNK_SIZE ? length : STRING_ROPE_CHUNK_SIZE;
+        node = string_rope_merge(node, string_rope_new_node(rope, string, chunk_length));
+        string += chunk_length;
+        length -= chunk_length;
+    }
 
-    builder->string[new_length] = '\0';
-    builder->length = new_length;
+    return node;
 }
 
-void string_builder_append_reversed(StringBuilder *builder, const char *string, size_t length) {
-    size_t old_length = builder->length;
-    size_t new_length = old_length + length;
-    string_builder_ensure_capacity(builder, new_length);
+// Takes the first chunk out of the tree `node` into `*first` and returns
+// what's left of the tree.
+StringRopeNode *string_rope_remove_first(StringRopeNode *node, StringRopeNode **first) {
+    if (node->left == NULL) {
+        StringRopeNode *rest = node->right;
+        node->right = NULL;
+        string_rope_update(node);
+        *first = node;
+        return rest;
+    }
 
-    char *inner_end = builder->string + old_length;
-    const char *append_end = string + length - 1;
-    while (length--) {
-        *inner_end = *append_end;
-        inner_end++;
-        append_end--;
+    node->left = string_rope_remove_first(node->left, first);
+    string_rope_update(node);
+    return node;
+}
+
+// Same as string_rope_remove_first(), for the last chunk.
+StringRopeNode *string_rope_remove_last(StringRopeNode *node, StringRopeNode **last) {
+    if (node->right == NULL) {
+        StringRopeNode *rest = node->left;
+        node->left = NULL;
+        string_rope_update(node);
+        *last = node;
+        return rest;
     }
-    *inner_end = '\0';
 
-    builder->length = new_length;
+    node->right = string_rope_remove_last(node->right, last);
+    string_rope_update(node);
+    return node;
 }
 
-void string_builder_append_char(StringBuilder *builder, char c) {
-    size_t old_length = builder->length;
-    size_t new_length = old_length + 1;
-    string_builder_ensure_capacity(builder, new_length);
+size_t string_rope_first_length(const StringRopeNode *node) {
+    while (node->left != NULL) {
+        node = node->left;
+    }
+    return node->length;
+}
 
-    char *inner = builder->string;
-    inner[old_length] = c;
-    inner[new_length] = '\0';
-    builder->length = new_length;
+size_t string_rope_last_length(const StringRopeNode *node) {
+    while (node->right != NULL) {
+        node = node->right;
+    }
+    return node->length;
 }
 
-// -2147483648
-#define STRING_BUILDER_MAX_CHARS_IN_INT 11
-void string_builder_append_int(StringBuilder *builder, int value) {
-    char chars[STRING_BUILDER_MAX_CHARS_IN_INT];
-    int i = 0;
+// Splits and edits leave chunks that are far from full. Two neighbouring
+// chunks that fit into one are merged, so that every two neighbours hold
+// more than STRING_ROPE_CHUNK_SIZE characters between them and the chunks
+// are more than half full on average, however many edits there were.
 
-    if (value == 0) {
-        string_builder_append_char(builder, '0');
-        return;
+// Merges the first two chunks of the tree `node` if they fit into one.
+StringRopeNode *string_rope_coalesce_first(StringRopeNode *node) {
+    if (node == NULL) {
+        return NULL;
     }
-    else if (value < 0) {
-        value = -value;
 
-        while (value > 0) {
-            chars[i++] = '0' + value % 10;
-            value /= 10;
-        }
+    StringRopeNode *first;
+    StringRopeNode *rest = string_rope_remove_first(node, &first);
+    if (rest != NULL && first->length + string_rope_first_length(rest) <= STRING_ROPE_CHUNK_SIZE) {
+        StringRopeNode *second;
+        rest = string_rope_remove_first(rest, &second);
+        memcpy(first->chunk + first->length, second->chunk, second->length);
+        first->length += second->length;
+        string_rope_update(first);
+        STRING_BUILDER_FREE(second);
+    }
+    return string_rope_merge(first, rest);
+}
 
-        chars[i++] = '-';
-    } else {
-        while (value > 0) {
-            chars[i++] = '0' + value % 10;
-            value /= 10;
-        }
+// Merges the last two chunks of the tree `node` if they fit into one.
+StringRopeNode *string_rope_coalesce_last(StringRopeNode *node) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    StringRopeNode *last;
+    StringRopeNode *rest = string_rope_remove_last(node, &last);
+    if (rest != NULL && string_rope_last_length(rest) + last->length <= STRING_ROPE_CHUNK_SIZE) {
+        string_rope_fill_last_chunk(rest, last->chunk, last->length);
+        STRING_BUILDER_FREE(last);
+        return rest;
+    }
+    return string_rope_merge(rest, last);
+}
+
+// Merges the trees `left` and `right`, and the chunks on either side of
+// where they meet if they fit into one.
+StringRopeNode *string_rope_join(StringRopeNode *left, StringRopeNode *right) {
+    if (left != NULL && right != NULL && string_rope_last_length(left) + string_rope_first_length(right) <= STRING_ROPE_CHUNK_SIZE) {
+        StringRopeNode *first;
+        right = string_rope_remove_first(right, &first);
+        string_rope_fill_last_chunk(left, first->chunk, first->length);
+        STRING_BUILDER_FREE(first);
+    }
+    return string_rope_merge(left, right);
+}
+
+void string_rope_append(StringRope *rope, const char *string) {
+    string_rope_append_n(rope, string, strlen(string));
+}
+
+void string_rope_append_n(StringRope *rope, const char *string, size_t length) {
+    rope->root = string_rope_append_to(rope, rope->root, string, length);
+    rope->length += length;
+}
+
+void string_rope_append_char(StringRope *rope, char c) {
+    string_rope_append_n(rope, &c, 1);
+}
+
+void string_rope_append_int(StringRope *rope, int value) {
+    char chars[STRING_BUILDER_MAX_CHARS_IN_INT];
+    char *start = chars + STRING_BUILDER_MAX_CHARS_IN_INT;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0) {
+        *--start = '-';
     }
 
-    string_builder_append_reversed(builder, chars, i);
+    string_rope_append_n(rope, start, chars + STRING_BUILDER_MAX_CHARS_IN_INT - start);
 }
 
 #ifndef STRING_BUILDER_NO_FORMAT
-void string_builder_append_format(StringBuilder *builder, const char *format, ...) {
+void string_rope_append_format(StringRope *rope, const char *format, ...) {
+    char small[256];
     va_list arg_list;
-    size_t old_length = builder->length;
 
     va_start(arg_list, format);
-    size_t appended_length = vsnprintf(NULL, 0, format, arg_list);
-    size_t new_length = old_length + appended_length;
-    string_builder_ensure_capacity(builder, new_length);
+    size_t appended_length = vsnprintf(small, sizeof small, format, arg_list);
     va_end(arg_list);
 
-    char *string_end = builder->string + old_length;
+    if (appended_length < sizeof small) {
+        string_rope_append_n(rope, small, appended_length);
+        return;
+    }
+
+    char *large = (char *)STRING_BUILDER_MALLOC(appended_length + 1);
     va_start(arg_list, format);
-    vsnprintf(string_end, appended_length + 1, format, arg_list);
+    vsnprintf(large, appended_length + 1, format, arg_list);
     va_end(arg_list);
 
-    builder->length = new_length;
+    string_rope_append_n(rope, large, appended_length);
+    STRING_BUILDER_FREE(large);
 }
 #endif // STRING_BUILDER_NO_FORMAT
 
-void string_builder_append_bits(StringBuilder *builder, int64_t value, int bit_count) {
-    STRING_BUILDER_ASSERT((bit_count > 0) && (bit_count <= 64));
+void string_rope_insert(StringRope *rope, size_t insert_index, const char *inserted_string) {
+    string_rope_insert_n(rope, insert_index, inserted_string, strlen(inserted_string));
+}
 
-    int64_t mask = (int64_t)1 << (bit_count - 1);
+void string_rope_insert_n(StringRope *rope, size_t insert_index, const char *inserted_string, size_t length) {
+    STRING_BUILDER_ASSERT(insert_index <= rope->length);
 
-    while (bit_count--) {
-        if (value & mask) {
-            string_builder_append_char(builder, '1');
-        } else {
-            string_builder_append_char(builder, '0');
-        }
-        mask >>= 1;
+    StringRopeNode *left;
+    StringRopeNode *right;
+    string_rope_split(rope, rope->root, insert_index, &left, &right);
+    // The split shortened the chunks on both sides of it.
+    left = string_rope_coalesce_last(left);
+    right = string_rope_coalesce_first(right);
+    left = string_rope_append_to(rope, left, inserted_string, length);
+    rope->root = string_rope_join(left, right);
+    rope->length += length;
+}
+
+void string_rope_replace_range(StringRope *rope, size_t start, size_t length, const char *replacement) {
+    STRING_BUILDER_ASSERT(start <= rope->length && length <= rope->length - start);
+
+    StringRopeNode *left;
+    StringRopeNode *middle;
+    StringRopeNode *right;
+    string_rope_split(rope, rope->root, start, &left, &right);
+    string_rope_split(rope, right, length, &middle, &right);
+    string_rope_free_node(middle);
+    left = string_rope_coalesce_last(left);
+    right = string_rope_coalesce_first(right);
+
+    size_t replacement_length = strlen(replacement);
+    left = string_rope_append_to(rope, left, replacement, replacement_length);
+    rope->root = string_rope_join(left, right);
+    rope->length = rope->length - length + replacement_length;
+}
+
+char *string_rope_copy_to(const StringRopeNode *node, char *destination) {
+    if (node != NULL) {
+        destination = string_rope_copy_to(node->left, destination);
+        memcpy(destination, node->chunk, node->length);
+        destination = string_rope_copy_to(node->right, destination + node->length);
     }
+    return destination;
 }
 
-void string_builder_insert(StringBuilder *builder, size_t insert_index, const char *inserted_string) {
-    size_t old_length = builder->length;
-    STRING_BUILDER_ASSERT(insert_index <= old_length);
-    size_t inserted_length = strlen(inserted_string);
-    size_t new_length = old_length + inserted_length;
-    string_builder_ensure_capacity(builder, new_length);
+StringBuilder string_rope_flatten(const StringRope *rope) {
+    StringBuilder builder = string_builder_new_with_capacity(rope->length + 1);
+    string_rope_copy_to(rope->root, builder.string);
+    builder.string[rope->length] = '\0';
+    builder.length = rope->length;
+    return builder;
+}
 
-    char *insert_at = builder->string + insert_index;
-    char *after_insert = insert_at + inserted_length;
-    memmove(after_insert, insert_at, old_length - insert_index + 1);
-    memcpy(insert_at, inserted_string, inserted_length);
+#define STRING_BUILDER_IOV_SCRATCH_SIZE 4096
+StringBuilderIov string_builder_iov_new() {
+    StringBuilderIov iov;
+    iov.segment_capacity = STRING_BUILDER_DEFAULT_CAPACITY;
+    iov.segments = (StringBuilderSegment *)STRING_BUILDER_MALLOC(iov.segment_capacity * sizeof *iov.segments);
+    iov.segment_count = 0;
+    iov.length = 0;
+    iov.scratch = NULL;
+    return iov;
+}
 
-    builder->length = new_length;
+void string_builder_iov_free(StringBuilderIov *iov) {
+    STRING_BUILDER_FREE(iov->segments);
+    if (iov->scratch != NULL) {
+        string_builder_arena_free(iov->scratch);
+    }
+    iov->segments = NULL;
+    iov->segment_count = 0;
+    iov->segment_capacity = 0;
+    iov->length = 0;
+    iov->scratch = NULL;
 }
 
-int string_builder_count_substrings(StringBuilder *builder, const char *substring) {
-    const char *const substring_first_character = substring;
-    const char *inner = builder->string;
-    int substring_count = 0;
-
-    while (*inner != '\0') {
-        if (*inner == *substring) {
-            const char *const start_check_from = inner;
-            while (*substring != '\0') {
-                substring++;
-                inner++;
-                if (*inner != *substring) {
-                    break;
-                }
-            }
+void string_builder_iov_reset(StringBuilderIov *iov) {
+    iov->segment_count = 0;
+    iov->length = 0;
+    if (iov->scratch != NULL) {
+        string_builder_arena_reset(iov->scratch);
+    }
+}
 
-            if (*substring == '\0') {
-                substring_count++;
-            } else {
-                inner = start_check_from + 1;
+void string_builder_iov_push(StringBuilderIov *iov, const char *data, size_t length) {
+    if (iov->segment_count == iov->segment_capacity) {
+        iov->segment_capacity *= STRING_BUILDER_RESIZE_FACTOR;
+        iov->segments = (StringBuilderSegment *)STRING_BUILDER_REALLOC(iov->segments, iov->segment_capacity * sizeof *iov->segments);
+    }
+
+    StringBuilderSegment *segment = &iov->segments[iov->segment_count++];
+    segment->data = data;
+    segment->length = length;
+}
+
+void string_builder_iov_append_n(StringBuilderIov *iov, const char *string, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (iov->scratch == NULL) {
+        iov->scratch = string_builder_arena_new(STRING_BUILDER_IOV_SCRATCH_SIZE);
+    }
+
+    StringBuilderArena *scratch = iov->scratch;
+    StringBuilderSegment *last = iov->segment_count > 0 ? &iov->segments[iov->segment_count - 1] : NULL;
+    if (last != NULL && last->data == scratch->last_allocation) {
+        // The previous copy is at the end of the arena, grow it instead of
+        // starting a new segment. If it has to move, the segment follows it.
+        char *copy = (char *)string_builder_arena_reallocate(scratch, (void *)last->data, last->length, last->length + length);
+        memcpy(copy + last->length, string, length);
+        last->data = copy;
+        last->length += length;
+    } else {
+        char *copy = (char *)string_builder_arena_allocate(scratch, length);
+        memcpy(copy, string, length);
+        string_builder_iov_push(iov, copy, length);
+    }
+    iov->length += length;
+}
+
+void string_builder_iov_append(StringBuilderIov *iov, const char *string) {
+    string_builder_iov_append_n(iov, string, strlen(string));
+}
+
+void string_builder_iov_append_ref(StringBuilderIov *iov, const char *data, size_t length) {
+    if (length < STRING_BUILDER_IOV_COPY_THRESHOLD) {
+        string_builder_iov_append_n(iov, data, length);
+        return;
+    }
+
+    StringBuilderSegment *last = iov->segment_count > 0 ? &iov->segments[iov->segment_count - 1] : NULL;
+    if (last != NULL && last->data + last->length == data) {
+        // Consecutive pieces of the same buffer.
+        last->length += length;
+    } else {
+        string_builder_iov_push(iov, data, length);
+    }
+    iov->length += length;
+}
+
+void string_builder_iov_append_char(StringBuilderIov *iov, char c) {
+    string_builder_iov_append_n(iov, &c, 1);
+}
+
+void string_builder_iov_append_int(StringBuilderIov *iov, int value) {
+    // "-2147483648"
+    char digits[STRING_BUILDER_MAX_CHARS_IN_INT];
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    int digit_count = string_builder_count_digits(magnitude);
+    int sign_length = value < 0;
+
+    digits[0] = '-';
+    string_builder_write_u64(digits + sign_length, magnitude, digit_count);
+    string_builder_iov_append_n(iov, digits, sign_length + digit_count);
+}
+
+StringBuilder string_builder_iov_flatten(const StringBuilderIov *iov) {
+    StringBuilder builder = string_builder_new_with_capacity(iov->length + 1);
+    char *destination = builder.string;
+    for (size_t i = 0; i < iov->segment_count; i++) {
+        memcpy(destination, iov->segments[i].data, iov->segments[i].length);
+        destination += iov->segments[i].length;
+    }
+
+    *destination = '\0';
+    builder.length = iov->length;
+    return builder;
+}
+
+#ifdef STRING_BUILDER_POSIX
+int string_builder_iov_write(const StringBuilderIov *iov, int fd) {
+    struct iovec batch[STRING_BUILDER_IOV_MAX];
+    const StringBuilderSegment *segments = iov->segments;
+    size_t next = 0;
+    // How much of segments[next] a partial write has already written.
+    size_t written_of_next = 0;
+
+    while (next < iov->segment_count) {
+        int batch_count = 0;
+        for (size_t i = next; i < iov->segment_count && batch_count < STRING_BUILDER_IOV_MAX; i++) {
+            size_t skipped = i == next ? written_of_next : 0;
+            batch[batch_count].iov_base = (void *)(segments[i].data + skipped);
+            batch[batch_count].iov_len = segments[i].length - skipped;
+            batch_count++;
+        }
+
+        ssize_t written = writev(fd, batch, batch_count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return errno;
+        }
 
-            substring = substring_first_character;
-        } else {
-            inner++;
+        size_t unaccounted = written;
+        while (next < iov->segment_count && unaccounted >= segments[next].length - written_of_next) {
+            unaccounted -= segments[next].length - written_of_next;
+            written_of_next = 0;
+            next++;
         }
+        written_of_next += unaccounted;
     }
 
-    return substring_count;
+    return 0;
 }
+#endif // STRING_BUILDER_POSIX
 
-void string_builder_replace(StringBuilder *builder, const char *old, const char *new) {
-    size_t length = builder->length;
-    size_t old_substring_length = strlen(old);
-    size_t new_substring_length = strlen(new);
-    size_t new_length = length + (new_substring_length - old_substring_length) * string_builder_count_substrings(builder, old);
-    string_builder_ensure_capacity(builder, new_length);
+#ifdef STRING_BUILDER_CONCURRENT
+StringBuilderConcurrent string_builder_concurrent_new() {
+    StringBuilderConcurrent builder;
+    memset(&builder, 0, sizeof builder);
+    return builder;
+}
 
-    // I don't want to allocate any memory in the function.
-    // To do that, all the copying and replacing has to be done
-    // in the same memory where the initial string is located.
-    // For that I need to handle two different scenarios:
-    //
-    // When the old substring is bigger than the new one, we
-    // can iterate the string from the beginning and
-    // insert the new substrings as we go: this won't overwrite
-    // any other string data because the new substring is smaller.
-    //
-    // In the other case, we must go from the end, otherwise, when
-    // replacing the old substring, we would overwrite the symbols
-    // that aren't in the old substring and ruin the entire string.
-    //
-    // A small example demonstrating the problem:
-    // ```
-    // string: abc
-    // replace: a -> aa
-    // result: aac
-    // ```
-    // If we aren't going from the end, we will end up with
-    // 'a' being replaced by 'aa' with the second 'a' overwriting 'b'.
+void string_builder_concurrent_free(StringBuilderConcurrent *builder) {
+    for (size_t i = 0; i < STRING_BUILDER_CONCURRENT_SEGMENTS; i++) {
+        STRING_BUILDER_FREE(builder->segments[i]);
+        builder->segments[i] = NULL;
+    }
+    builder->reserved = 0;
+    builder->committed = 0;
+}
 
-    char *inner = builder->string;
-    if (old_substring_length >= new_substring_length) {
-        char *copy_iterator = inner;
-        const char *const old_start = old;
-        const char *const new_start = new;
-        const char *const inner_new_end = inner + new_length;
-
-        while (copy_iterator < inner_new_end) {
-            if (*inner == *old) {
-                char *const inner_start = inner;
-                while (*old != '\0') {
-                    if (*old != *inner) {
-                        break;
-                    }
-                    inner++;
-                    old++;
-                }
+// Finds the segment that holds the byte at `offset` and where in the
+// segment it is. Segment i starts at SEGMENT_SIZE * (2^i - 1).
+size_t string_builder_concurrent_locate(size_t offset, size_t *segment_offset) {
+    size_t index = string_builder_bit_width(offset / STRING_BUILDER_CONCURRENT_SEGMENT_SIZE + 1) - 1;
+    STRING_BUILDER_ASSERT(index < STRING_BUILDER_CONCURRENT_SEGMENTS);
+    *segment_offset = offset - STRING_BUILDER_CONCURRENT_SEGMENT_SIZE * (((size_t)1 << index) - 1);
+    return index;
+}
 
-                if (*old == '\0') {
-                    while (*new != '\0') {
-                        *copy_iterator = *new;
-                        copy_iterator++;
-                        new++;
-                    }
-                    new = new_start;
-                } else {
-                    inner = inner_start + 1;
-                    *copy_iterator = *inner_start;
-                    copy_iterator++;
-                }
-                old = old_start;
-            } else {
-                *copy_iterator = *inner;
-                copy_iterator++;
-                inner++;
-            }
+// Returns segment `index`, allocating it if no producer has yet. When two
+// producers race to allocate it, one of them frees its copy.
+char *string_builder_concurrent_segment(StringBuilderConcurrent *builder, size_t index) {
+    char *segment = __atomic_load_n(&builder->segments[index], __ATOMIC_ACQUIRE);
+    if (segment != NULL) {
+        return segment;
+    }
+
+    size_t segment_size = (size_t)STRING_BUILDER_CONCURRENT_SEGMENT_SIZE << index;
+    char *new_segment = (char *)STRING_BUILDER_MALLOC(segment_size + segment_size / 8);
+    memset(new_segment + segment_size, 0, segment_size / 8);
+    if (__atomic_compare_exchange_n(&builder->segments[index], &segment, new_segment, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return new_segment;
+    }
+    STRING_BUILDER_FREE(new_segment);
+    return segment;
+}
+
+// Sets the bits of the bytes from `start` to `end` in the bitmap of a
+// segment, which publishes the bytes to whoever sees the bits. See
+// string_builder_concurrent_append_n() for why it's sequentially consistent.
+void string_builder_concurrent_mark_written(char *segment, size_t segment_size, size_t start, size_t end) {
+    uint64_t *bitmap = (uint64_t *)(segment + segment_size);
+    while (start < end) {
+        size_t bit = start % 64;
+        size_t count = end - start < 64 - bit ? end - start : 64 - bit;
+        uint64_t mask = (count == 64 ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << bit;
+        __atomic_fetch_or(&bitmap[start / 64], mask, __ATOMIC_SEQ_CST);
+        start += count;
+    }
+}
+
+// Returns the end of the run of written bytes that starts at `offset`.
+size_t string_builder_concurrent_written_end(const StringBuilderConcurrent *builder, size_t offset) {
+    size_t segment_offset;
+    size_t index = string_builder_concurrent_locate(offset, &segment_offset);
+    while (index < STRING_BUILDER_CONCURRENT_SEGMENTS) {
+        const char *segment = __atomic_load_n(&builder->segments[index], __ATOMIC_ACQUIRE);
+        if (segment == NULL) {
+            return offset;
         }
-        *copy_iterator = '\0';
-    } else {
-        const char *const old_end = old + old_substring_length - 1;
-        const char *const new_end = new + new_substring_length - 1;
-        const char *reverse_inner = inner + length - 1;
-        char *copy_iterator = inner + new_length;
-        *copy_iterator = '\0';
-        copy_iterator--;
-
-        for (size_t i = 0; i < length; i++) {
-            if (*reverse_inner == *old_end) {
-                const char *old_reversed = old_end;
-                const char *const begin_from = reverse_inner;
-                size_t j = old_substring_length;
-                while (j) {
-                    if (*reverse_inner != *old_reversed) {
-                        break;
-                    }
-                    reverse_inner--;
-                    old_reversed--;
-                    j--;
-                }
 
-                if (j == 0) {
-                    const char *new_reversed = new_end;
-                    j = new_substring_length;
-                    while (j--) {
-                        *copy_iterator = *new_reversed;
-                        new_reversed--;
-                        copy_iterator--;
-                    }
-                } else {
-                    reverse_inner = begin_from - 1;
-                    *copy_iterator = *begin_from;
-                    copy_iterator--;
-                }
-            } else {
-                *copy_iterator = *reverse_inner;
-                reverse_inner--;
-                copy_iterator--;
+        size_t segment_size = (size_t)STRING_BUILDER_CONCURRENT_SEGMENT_SIZE << index;
+        const uint64_t *bitmap = (const uint64_t *)(segment + segment_size);
+        while (segment_offset < segment_size) {
+            uint64_t unwritten = ~__atomic_load_n(&bitmap[segment_offset / 64], __ATOMIC_SEQ_CST) >> (segment_offset % 64);
+            if (unwritten != 0) {
+                return offset + __builtin_ctzll(unwritten);
             }
+            size_t count = 64 - segment_offset % 64;
+            offset += count;
+            segment_offset += count;
         }
+        segment_offset = 0;
+        index++;
     }
+    return offset;
+}
 
-    builder->length = new_length;
+void string_builder_concurrent_append(StringBuilderConcurrent *builder, const char *string) {
+    string_builder_concurrent_append_n(builder, string, strlen(string));
+}
+
+void string_builder_concurrent_append_n(StringBuilderConcurrent *builder, const char *string, size_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    size_t offset = __atomic_fetch_add(&builder->reserved, length, __ATOMIC_RELAXED);
+
+    size_t segment_offset;
+    size_t index = string_builder_concurrent_locate(offset, &segment_offset);
+    size_t copied = 0;
+    while (copied < length) {
+        char *segment = string_builder_concurrent_segment(builder, index);
+        size_t segment_size = (size_t)STRING_BUILDER_CONCURRENT_SEGMENT_SIZE << index;
+        size_t chunk = segment_size - segment_offset;
+        if (chunk > length - copied) {
+            chunk = length - copied;
+        }
+        memcpy(segment + segment_offset, string + copied, chunk);
+        string_builder_concurrent_mark_written(segment, segment_size, segment_offset, segment_offset + chunk);
+        copied += chunk;
+        segment_offset = 0;
+        index++;
+    }
+
+    // Every producer moves `committed` after marking its own bytes, so the
+    // last one to finish of any run of records commits the whole run. A
+    // failed exchange means another producer moved it, so look again from
+    // there, unless it's past this record already.
+    //
+    // Two producers finishing at once each set their bits and then read the
+    // other's. Release and acquire allow both reads to miss the other's
+    // write when the bits are in different words (POWER and ARM do it), and
+    // then neither commits. So the bits are set and read, and `committed` is
+    // read, with sequentially consistent operations: they happen in one
+    // order that all threads agree on, and at least one of the producers
+    // sees both records.
+    size_t committed = __atomic_load_n(&builder->committed, __ATOMIC_SEQ_CST);
+    while (committed < offset + length) {
+        size_t written_end = string_builder_concurrent_written_end(builder, committed);
+        if (written_end == committed) {
+            break;
+        }
+        if (__atomic_compare_exchange_n(&builder->committed, &committed, written_end, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            committed = written_end;
+        }
+    }
+}
+
+size_t string_builder_concurrent_committed(const StringBuilderConcurrent *builder) {
+    return __atomic_load_n(&builder->committed, __ATOMIC_ACQUIRE);
+}
+
+size_t string_builder_concurrent_read(const StringBuilderConcurrent *builder, size_t from, StringBuilder *destination) {
+    size_t committed = string_builder_concurrent_committed(builder);
+    if (from >= committed) {
+        return from;
+    }
+
+    char *written = string_builder_extend(destination, committed - from);
+    size_t segment_offset;
+    size_t index = string_builder_concurrent_locate(from, &segment_offset);
+    while (from < committed) {
+        // Committed bytes are in segments that are published already.
+        const char *segment = __atomic_load_n(&builder->segments[index], __ATOMIC_ACQUIRE);
+        size_t segment_size = (size_t)STRING_BUILDER_CONCURRENT_SEGMENT_SIZE << index;
+        size_t chunk = segment_size - segment_offset;
+        if (chunk > committed - from) {
+            chunk = committed - from;
+        }
+        memcpy(written, segment + segment_offset, chunk);
+        written += chunk;
+        from += chunk;
+        segment_offset = 0;
+        index++;
+    }
+
+    return committed;
 }
 
+StringBuilder string_builder_concurrent_flatten(const StringBuilderConcurrent *builder) {
+    StringBuilder flat = string_builder_new_with_capacity(string_builder_concurrent_committed(builder) + 1);
+    string_builder_concurrent_read(builder, 0, &flat);
+    return flat;
+}
+#endif // STRING_BUILDER_CONCURRENT
+
 #endif // STRING_BUILDER_IMPLEMENTATION
 
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
 #endif // STRING_BUILDER_H
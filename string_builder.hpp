@@ -0,0 +1,564 @@
+// Copyright 2023 kawaii-Code.
+// Subject to the MIT License.
+
+#ifndef STRING_BUILDER_HPP
+#define STRING_BUILDER_HPP
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "string_builder.h"
+
+namespace sb {
+
+// A move-only owner of a StringBuilder that frees the string when it
+// goes out of scope. It's a thin layer over the C functions, so there is
+// no extra allocation or copy compared to using StringBuilder directly.
+// Define STRING_BUILDER_IMPLEMENTATION in exactly one translation unit
+// before including this header, like with string_builder.h.
+//
+// A moved-from builder is empty and owns no memory, but can be appended
+// to again.
+//
+//
+// Example:
+//
+// sb::Builder builder;
+// builder << "id=" << 42 << ", ratio=" << 0.5;
+// std::string_view view = builder.view(); // "id=42, ratio=0.5"
+class Builder {
+public:
+    Builder() : builder_(string_builder_new()) {}
+
+    explicit Builder(std::size_t capacity) : builder_(string_builder_new_with_capacity(capacity)) {}
+
+    explicit Builder(std::string_view string) : builder_(string_builder_new_with_capacity(string.size() + 1)) {
+        append(string);
+    }
+
+    // See string_builder_new_with_allocator().
+    explicit Builder(const StringBuilderAllocator *allocator) : builder_(string_builder_new_with_allocator(allocator)) {}
+
+    // See string_builder_new_from_buffer().
+    Builder(char *buffer, std::size_t capacity) : builder_(string_builder_new_from_buffer(buffer, capacity)) {}
+
+    Builder(const Builder &) = delete;
+    Builder &operator=(const Builder &) = delete;
+
+    Builder(Builder &&other) noexcept : builder_(other.builder_) {
+        other.forget();
+    }
+
+    Builder &operator=(Builder &&other) noexcept {
+        if (this != &other) {
+            string_builder_free(&builder_);
+            builder_ = other.builder_;
+            other.forget();
+        }
+        return *this;
+    }
+
+    ~Builder() {
+        string_builder_free(&builder_);
+    }
+
+    std::string_view view() const noexcept {
+        return std::string_view(c_str(), builder_.length);
+    }
+
+    operator std::string_view() const noexcept {
+        return view();
+    }
+
+    // Copies the string, for APIs that insist on std::string.
+    std::string str() const {
+        return std::string(view());
+    }
+
+    const char *c_str() const noexcept {
+        return builder_.string != nullptr ? builder_.string : "";
+    }
+
+    std::size_t size() const noexcept {
+        return builder_.length;
+    }
+
+    std::size_t capacity() const noexcept {
+        return builder_.capacity;
+    }
+
+    bool empty() const noexcept {
+        return builder_.length == 0;
+    }
+
+    void reserve(std::size_t expected_length) {
+        string_builder_ensure_capacity(&builder_, expected_length);
+    }
+
+    // The wrapped builder, for the functions that have no method here.
+    StringBuilder *get() noexcept {
+        return &builder_;
+    }
+
+    const StringBuilder *get() const noexcept {
+        return &builder_;
+    }
+
+    // Hands the string over to the caller without copying it, see
+    // string_builder_release(). The caller frees it with STRING_BUILDER_FREE,
+    // or through the allocator the builder was created with.
+    char *release() noexcept {
+        return string_builder_release(&builder_);
+    }
+
+#ifdef STRING_BUILDER_CONCURRENT
+    // A builder that shares the string with this one until either of them
+    // changes it, see string_builder_snapshot().
+    Builder snapshot() {
+        return Builder(string_builder_snapshot(&builder_));
+    }
+#endif // STRING_BUILDER_CONCURRENT
+
+    // Uses the length of the view, so nothing is scanned for a null terminator.
+    Builder &append(std::string_view string) {
+        string_builder_append_n(&builder_, string.data(), string.size());
+        return *this;
+    }
+
+    Builder &append(char c) {
+        string_builder_append_char(&builder_, c);
+        return *this;
+    }
+
+    Builder &insert(std::size_t insert_index, const char *insertion) {
+        string_builder_insert(&builder_, insert_index, insertion);
+        return *this;
+    }
+
+    Builder &replace(const char *string_to_replace, const char *replacement) {
+        string_builder_replace(&builder_, string_to_replace, replacement);
+        return *this;
+    }
+
+    Builder &replace(const StringBuilderSearcher &searcher, const char *replacement) {
+        string_builder_replace_searched(&builder_, &searcher, replacement);
+        return *this;
+    }
+
+    Builder &replace_range(std::size_t start, std::size_t length, const char *replacement) {
+        string_builder_replace_range(&builder_, start, length, replacement);
+        return *this;
+    }
+
+    // STRING_BUILDER_NOT_FOUND if there's no match, like std::string::npos.
+    std::size_t find(const StringBuilderSearcher &searcher, std::size_t from = 0) const noexcept {
+        return string_builder_find(&builder_, &searcher, from);
+    }
+
+    std::size_t rfind(const StringBuilderSearcher &searcher, std::size_t end = STRING_BUILDER_NOT_FOUND) const noexcept {
+        return string_builder_rfind(&builder_, &searcher, end);
+    }
+
+    Builder &operator<<(std::string_view string) {
+        return append(string);
+    }
+
+    // Without it, string literals would pick the bool overload.
+    Builder &operator<<(const char *string) {
+        return append(std::string_view(string));
+    }
+
+    Builder &operator<<(char c) {
+        return append(c);
+    }
+
+    Builder &operator<<(bool value) {
+        return append(value ? std::string_view("true") : std::string_view("false"));
+    }
+
+    template <typename Integer,
+              typename std::enable_if<std::is_integral<Integer>::value &&
+                                      !std::is_same<Integer, bool>::value &&
+                                      !std::is_same<Integer, char>::value, int>::type = 0>
+    Builder &operator<<(Integer value) {
+        if (std::is_signed<Integer>::value) {
+            string_builder_append_i64(&builder_, static_cast<std::int64_t>(value));
+        } else {
+            string_builder_append_u64(&builder_, static_cast<std::uint64_t>(value));
+        }
+        return *this;
+    }
+
+    Builder &operator<<(double value) {
+        string_builder_append_double(&builder_, value);
+        return *this;
+    }
+
+    Builder &operator<<(float value) {
+        string_builder_append_float(&builder_, value);
+        return *this;
+    }
+
+private:
+    explicit Builder(StringBuilder builder) noexcept : builder_(builder) {}
+
+    void forget() noexcept {
+        builder_.length = 0;
+        builder_.capacity = 0;
+        builder_.string = nullptr;
+        builder_.flags = 0;
+        builder_.sink = nullptr;
+        builder_.counted_length = 0;
+        builder_.codepoint_count = 0;
+#ifdef STRING_BUILDER_STATS
+        // The counters went with the string to the new owner.
+        std::memset(&builder_.stats, 0, sizeof builder_.stats);
+#endif // STRING_BUILDER_STATS
+    }
+
+    StringBuilder builder_;
+};
+
+#if __cplusplus >= 202002L
+namespace detail {
+
+// A string literal that can be passed as a template argument.
+template <std::size_t N>
+struct FormatString {
+    char characters[N] = {};
+
+    constexpr FormatString(const char (&string)[N]) {
+        for (std::size_t i = 0; i < N; i++) {
+            characters[i] = string[i];
+        }
+    }
+};
+
+// The same layout as StringBuilderFormat, but with fixed-size arrays so
+// it can be built by the compiler. A format of N characters can't have
+// more than N fields.
+template <std::size_t N>
+struct ParsedFormat {
+    char                     literals[N] = {};
+    std::size_t              literals_length = 0;
+    StringBuilderFormatField fields[N] = {};
+    std::size_t              field_count = 0;
+};
+
+// Deliberately not constexpr: reaching it while a format is parsed at
+// compile time stops the compilation at the call with the message.
+inline void format_error(const char *message) {
+    (void)message;
+}
+
+// Follows string_builder_format_compile(), see it for the syntax.
+template <std::size_t N>
+constexpr ParsedFormat<N> parse_format(const char (&format)[N]) {
+    ParsedFormat<N> parsed;
+    StringBuilderFormatField field = {};
+    std::size_t i = 0;
+
+    while (true) {
+        while (format[i] != '\0' && !(format[i] == '%' && format[i + 1] != '%')) {
+            parsed.literals[parsed.literals_length++] = format[i];
+            field.literal_length++;
+            i += format[i] == '%' ? 2 : 1;
+        }
+
+        field.conversion = 0;
+        field.length_modifier = 0;
+        field.flags = 0;
+        field.width = 0;
+        field.precision = -1;
+
+        if (format[i] == '\0') {
+            parsed.fields[parsed.field_count++] = field;
+            break;
+        }
+
+        i++;
+        for (;; i++) {
+            if (format[i] == '-') {
+                field.flags |= STRING_BUILDER_FORMAT_LEFT;
+            } else if (format[i] == '0') {
+                field.flags |= STRING_BUILDER_FORMAT_ZERO;
+            } else {
+                break;
+            }
+        }
+        while (format[i] >= '0' && format[i] <= '9') {
+            field.width = field.width * 10 + (format[i++] - '0');
+        }
+        if (format[i] == '.') {
+            i++;
+            field.precision = 0;
+            while (format[i] >= '0' && format[i] <= '9') {
+                field.precision = field.precision * 10 + (format[i++] - '0');
+            }
+        }
+        if (format[i] == 'l' && format[i + 1] == 'l') {
+            field.length_modifier = 'L';
+            i += 2;
+        } else if (format[i] == 'l' || format[i] == 'z') {
+            field.length_modifier = format[i++];
+        }
+
+        switch (format[i]) {
+            case 'd': case 'i': case 'u': case 'x': case 'X':
+                if (field.precision >= 0) {
+                    field.flags &= ~STRING_BUILDER_FORMAT_ZERO;
+                }
+                field.conversion = format[i++];
+                break;
+            case 'c':
+                if (field.precision >= 0) {
+                    format_error("precision on %c in sb::format()");
+                }
+                field.conversion = format[i++];
+                break;
+            case 's':
+                field.conversion = format[i++];
+                break;
+            default:
+                format_error("unsupported conversion in sb::format()");
+                break;
+        }
+
+        parsed.fields[parsed.field_count++] = field;
+        field.literal_start = parsed.literals_length;
+        field.literal_length = 0;
+    }
+
+    return parsed;
+}
+
+template <FormatString Format>
+struct CompiledFormat {
+    static constexpr auto value = parse_format(Format.characters);
+};
+
+template <typename Type>
+constexpr bool is_format_string = std::is_convertible_v<const Type &, std::string_view>;
+
+template <typename Type>
+constexpr bool is_format_integer = std::is_integral_v<Type> && !std::is_same_v<Type, bool> && !std::is_same_v<Type, char>;
+
+// The same rules as `printf`, with the argument sizes checked against the
+// length modifiers instead of being promoted silently.
+template <char Conversion, char LengthModifier, typename Argument>
+constexpr void check_format_argument() {
+    using Type = std::remove_cv_t<std::remove_reference_t<Argument>>;
+    if constexpr (Conversion == 's') {
+        static_assert(is_format_string<Type>, "%s expects a string");
+    } else if constexpr (Conversion == 'c') {
+        static_assert(std::is_same_v<Type, char>, "%c expects a char");
+    } else {
+        static_assert(is_format_integer<Type>, "%d, %i, %u, %x and %X expect an integer");
+        if constexpr (is_format_integer<Type>) {
+            if constexpr (Conversion == 'd' || Conversion == 'i') {
+                static_assert(std::is_signed_v<Type>, "%d and %i expect a signed integer");
+            } else {
+                static_assert(std::is_unsigned_v<Type>, "%u, %x and %X expect an unsigned integer");
+            }
+
+            if constexpr (LengthModifier == 'l') {
+                static_assert(sizeof(Type) == sizeof(long), "the argument doesn't match the 'l' length modifier");
+            } else if constexpr (LengthModifier == 'L') {
+                static_assert(sizeof(Type) == sizeof(long long), "the argument doesn't match the 'll' length modifier");
+            } else if constexpr (LengthModifier == 'z') {
+                static_assert(sizeof(Type) == sizeof(std::size_t), "the argument doesn't match the 'z' length modifier");
+            } else {
+                static_assert(sizeof(Type) <= sizeof(int), "the argument is wider than int, add a length modifier");
+            }
+        }
+    }
+}
+
+template <typename Compiled, typename... Arguments, std::size_t... I>
+constexpr void check_format_arguments(std::index_sequence<I...>) {
+    (check_format_argument<Compiled::value.fields[I].conversion, Compiled::value.fields[I].length_modifier, Arguments>(), ...);
+}
+
+// Strings are measured once, when they're turned into views.
+template <typename Argument>
+auto format_value(const Argument &argument) {
+    if constexpr (is_format_string<Argument>) {
+        return std::string_view(argument);
+    } else {
+        return argument;
+    }
+}
+
+// The longest output of a field that doesn't depend on the argument's value.
+template <typename Value>
+constexpr std::size_t format_fixed_length(const StringBuilderFormatField &field) {
+    std::size_t length = 0;
+    if constexpr (std::is_same_v<Value, std::string_view>) {
+        // The padding, the string itself is added by format_string_length().
+        return field.width;
+    } else if constexpr (std::is_same_v<Value, char>) {
+        length = 1;
+    } else if (field.conversion == 'x' || field.conversion == 'X') {
+        length = sizeof(Value) * 2;
+    } else {
+        length = std::numeric_limits<Value>::digits10 + 1 + std::is_signed_v<Value>;
+    }
+    if (field.precision >= 0 && (std::size_t)field.precision + std::is_signed_v<Value> > length) {
+        length = field.precision + std::is_signed_v<Value>;
+    }
+    return (std::size_t)field.width > length ? field.width : length;
+}
+
+inline std::size_t format_string_length(const StringBuilderFormatField &field, std::string_view string) {
+    if (field.precision >= 0 && (std::size_t)field.precision < string.size()) {
+        return field.precision;
+    }
+    return string.size();
+}
+
+template <typename Value>
+std::size_t format_string_length(const StringBuilderFormatField &, const Value &) {
+    return 0;
+}
+
+// Writes `body` (with its `prefix`, a sign, and `zeros` leading zeros)
+// padded to the field's width.
+inline char *format_write_padded(char *destination, const StringBuilderFormatField &field, char prefix, std::size_t zeros, const char *body, std::size_t body_length) {
+    std::size_t length = body_length + zeros + (prefix != 0);
+    std::size_t padding = (std::size_t)field.width > length ? (std::size_t)field.width - length : 0;
+    bool left = field.flags & STRING_BUILDER_FORMAT_LEFT;
+    bool zero = field.flags & STRING_BUILDER_FORMAT_ZERO;
+
+    if (!left && !zero) {
+        std::memset(destination, ' ', padding);
+        destination += padding;
+    }
+    if (prefix != 0) {
+        *destination++ = prefix;
+    }
+    if (!left && zero) {
+        std::memset(destination, '0', padding);
+        destination += padding;
+    }
+    std::memset(destination, '0', zeros);
+    destination += zeros;
+    std::memcpy(destination, body, body_length);
+    destination += body_length;
+    if (left) {
+        std::memset(destination, ' ', padding);
+        destination += padding;
+    }
+
+    return destination;
+}
+
+inline char *format_write(char *destination, const StringBuilderFormatField &field, std::string_view string) {
+    StringBuilderFormatField padding = field;
+    padding.flags &= ~STRING_BUILDER_FORMAT_ZERO;
+    return format_write_padded(destination, padding, 0, 0, string.data(), format_string_length(field, string));
+}
+
+inline char *format_write(char *destination, const StringBuilderFormatField &field, char c) {
+    return format_write_padded(destination, field, 0, 0, &c, 1);
+}
+
+template <typename Integer>
+char *format_write(char *destination, const StringBuilderFormatField &field, Integer value) {
+    using Unsigned = std::make_unsigned_t<Integer>;
+    Unsigned magnitude = static_cast<Unsigned>(value);
+    char sign = 0;
+    if constexpr (std::is_signed_v<Integer>) {
+        if (value < 0) {
+            sign = '-';
+            magnitude = static_cast<Unsigned>(0 - magnitude);
+        }
+    }
+
+    char digits[std::numeric_limits<Unsigned>::digits10 + 1];
+    bool hex = field.conversion == 'x' || field.conversion == 'X';
+    char *digits_end = digits;
+    // Like printf, a precision of 0 writes no digits for zero.
+    if (magnitude != 0 || field.precision != 0) {
+        digits_end = std::to_chars(digits, digits + sizeof digits, magnitude, hex ? 16 : 10).ptr;
+    }
+    if (field.conversion == 'X') {
+        for (char *digit = digits; digit != digits_end; digit++) {
+            *digit -= *digit >= 'a' ? 'a' - 'A' : 0;
+        }
+    }
+    std::size_t digit_count = digits_end - digits;
+    std::size_t zeros = field.precision >= 0 && (std::size_t)field.precision > digit_count ? field.precision - digit_count : 0;
+    return format_write_padded(destination, field, sign, zeros, digits, digit_count);
+}
+
+template <typename Compiled, typename... Values, std::size_t... I>
+void format_values(StringBuilder *builder, std::index_sequence<I...>, const Values &... values) {
+    constexpr const auto &format = Compiled::value;
+    constexpr std::size_t fixed_length = format.literals_length + (format_fixed_length<Values>(format.fields[I]) + ... + 0);
+
+    std::size_t max_length = fixed_length + (format_string_length(format.fields[I], values) + ... + 0);
+    if (builder->sink != nullptr && builder->length + max_length > builder->sink->high_water_mark) {
+        string_builder_flush(builder);
+    }
+    string_builder_ensure_capacity(builder, builder->length + max_length);
+
+    char *destination = builder->string + builder->length;
+    auto write_literal = [&](const StringBuilderFormatField &field) {
+        std::memcpy(destination, format.literals + field.literal_start, field.literal_length);
+        destination += field.literal_length;
+    };
+    ((write_literal(format.fields[I]), destination = format_write(destination, format.fields[I], values)), ...);
+    write_literal(format.fields[format.field_count - 1]);
+
+    *destination = '\0';
+    builder->length = destination - builder->string;
+}
+
+} // namespace detail
+
+// Appends a string formatted like string_builder_append_compiled(), but the
+// format is parsed by the compiler: every call only copies the literal runs
+// and writes the arguments. The arguments are checked against the format at
+// compile time, and the longest possible output of the integer and char
+// fields is a constant, so with the lengths of the string arguments it is
+// reserved with a single string_builder_ensure_capacity().
+//
+// The format has the syntax of string_builder_format_compile(). %s accepts
+// anything convertible to std::string_view. Integer arguments must have the
+// signedness of their conversion and the size of their length modifier.
+// Requires C++20.
+//
+//
+// Example:
+//
+// sb::Builder builder;
+// sb::format<"[%-5s] %s: %08x">(builder, "WARN", std::string_view("checksum"), 0xbeefu);
+// builder = StringBuilder{
+//      length = 26,
+//      capacity = ???, // Greater than length
+//      string = "[WARN ] checksum: 0000beef\0",
+// }
+template <detail::FormatString Format, typename... Arguments>
+void format(StringBuilder *builder, const Arguments &... arguments) {
+    using Compiled = detail::CompiledFormat<Format>;
+    static_assert(sizeof...(Arguments) + 1 == Compiled::value.field_count, "the number of arguments doesn't match the format");
+    detail::check_format_arguments<Compiled, Arguments...>(std::index_sequence_for<Arguments...>{});
+    detail::format_values<Compiled>(builder, std::index_sequence_for<Arguments...>{}, detail::format_value(arguments)...);
+}
+
+template <detail::FormatString Format, typename... Arguments>
+void format(Builder &builder, const Arguments &... arguments) {
+    format<Format>(builder.get(), arguments...);
+}
+#endif // __cplusplus >= 202002L
+
+} // namespace sb
+
+#endif // STRING_BUILDER_HPP